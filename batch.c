@@ -0,0 +1,418 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "brnflip.h"
+#include "cli.h"
+
+/* Batch Conversion
+ *
+ * Converting a fleet of brains one process at a time pays for a process start
+ * per file and leaves the disk idle while each brain is flipped. Instead, the
+ * files are handed out to a pool of workers. Each worker reads, converts and
+ * writes one file at a time into a buffer that it keeps and grows for the
+ * next file, so while one worker waits on the disk, the others keep the CPUs
+ * busy. Files are converted in place, and only those that actually change are
+ * written back, by renaming a converted copy over them with replace_file.
+ */
+
+typedef enum
+{
+    batch_pending = 0,
+    batch_converted,
+    batch_unchanged,
+    batch_failed
+} batch_status;
+
+typedef struct
+{
+    char*        path;
+    batch_status status;
+    const char*  message;
+} batch_file;
+
+typedef struct
+{
+    batch_file*        files;
+    size_t             num_files;
+    size_t             capacity;
+    size_t             next_file;
+    pthread_mutex_t    lock;
+    const cli_options* options;
+} batch_queue;
+
+int batch_add_file(batch_queue* queue, const char* path);
+int batch_add_path(batch_queue* queue, const char* path, int recursive, int top);
+int batch_add_directory(batch_queue* queue, const char* path, int recursive);
+void* batch_worker(void* argument);
+void batch_convert_file(batch_file* file, char** buffer, size_t* capacity,
+    const cli_options* options);
+
+int convert_batch(
+    char**             paths,
+    int                num_paths,
+    int                recursive,
+    unsigned int       num_jobs,
+    const cli_options* options
+)
+{
+    batch_queue queue;
+    memset(&queue, 0, sizeof(batch_queue));
+    queue.options = options;
+
+    int i;
+    for (i = 0; i < num_paths; ++i) {
+        if (strcmp(paths[i], "-") == 0) {
+            char line[4096];
+
+            while (fgets(line, sizeof(line), stdin) != NULL) {
+                line[strcspn(line, "\r\n")] = '\0';
+
+                if (line[0] != '\0') {
+                    batch_add_path(&queue, line, recursive, 1);
+                }
+            }
+        } else {
+            batch_add_path(&queue, paths[i], recursive, 1);
+        }
+    }
+
+    if (queue.num_files == 0) {
+        fprintf(stderr, "No files to convert.\n");
+        free(queue.files);
+        return 1;
+    }
+
+    if (num_jobs == 0) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_jobs = num_cpus > 0 ? (unsigned int) num_cpus : 1;
+    }
+
+    if (num_jobs > queue.num_files) {
+        num_jobs = (unsigned int) queue.num_files;
+    }
+
+    pthread_mutex_init(&queue.lock, NULL);
+
+    pthread_t* workers = (pthread_t*) calloc(num_jobs, sizeof(pthread_t));
+    unsigned int num_started = 0;
+
+    while (workers != NULL && num_started < num_jobs &&
+           pthread_create(&workers[num_started], NULL, batch_worker, &queue) == 0) {
+        ++num_started;
+    }
+
+    // If no worker could be started, do the work on this thread.
+    if (num_started == 0) {
+        batch_worker(&queue);
+    }
+
+    unsigned int j;
+    for (j = 0; j < num_started; ++j) {
+        pthread_join(workers[j], NULL);
+    }
+
+    free(workers);
+    pthread_mutex_destroy(&queue.lock);
+
+    size_t num_converted = 0;
+    size_t num_unchanged = 0;
+    size_t num_failed    = 0;
+
+    size_t k;
+    for (k = 0; k < queue.num_files; ++k) {
+        batch_file* file = &queue.files[k];
+
+        switch (file->status) {
+            case batch_converted:
+                ++num_converted;
+                printf("converted: %s\n", file->path);
+                break;
+
+            case batch_unchanged:
+                ++num_unchanged;
+                printf("unchanged: %s\n", file->path);
+                break;
+
+            case batch_pending:
+            case batch_failed:
+                ++num_failed;
+                printf("failed:    %s (%s)\n", file->path, file->message);
+                break;
+        }
+
+        free(file->path);
+    }
+
+    printf(
+        "%zu converted, %zu already in the target endianess, %zu failed.\n",
+        num_converted,
+        num_unchanged,
+        num_failed
+    );
+
+    free(queue.files);
+
+    return num_failed > 0 ? 1 : 0;
+}
+
+/* Appends a file to the queue, returning 0 if it could not be added. */
+int batch_add_file(batch_queue* queue, const char* path)
+{
+    if (queue->num_files == queue->capacity) {
+        size_t capacity = queue->capacity > 0 ? queue->capacity * 2 : 64;
+
+        batch_file* files = (batch_file*) realloc(
+            queue->files,
+            capacity * sizeof(batch_file)
+        );
+
+        if (files == NULL) {
+            fprintf(stderr, "Out of memory queueing: %s\n", path);
+            return 0;
+        }
+
+        queue->files    = files;
+        queue->capacity = capacity;
+    }
+
+    batch_file* file = &queue->files[queue->num_files];
+
+    file->path    = strdup(path);
+    file->status  = batch_pending;
+    file->message = "not converted";
+
+    if (file->path == NULL) {
+        fprintf(stderr, "Out of memory queueing: %s\n", path);
+        return 0;
+    }
+
+    ++queue->num_files;
+    return 1;
+}
+
+/* Queues a path named by the user or found in a directory. Paths given
+ * directly are always queued, so that a missing file shows up as a failure in
+ * the summary, and symbolic links among them are followed. Within directories,
+ * only regular files are queued, and only directories descended into when
+ * recursive is set. Symbolic links there are skipped, so that a link cannot
+ * lead the walk around a cycle or convert the same brain twice.
+ */
+int batch_add_path(batch_queue* queue, const char* path, int recursive, int top)
+{
+    struct stat path_stat;
+
+    if ((top ? stat(path, &path_stat) : lstat(path, &path_stat)) != 0) {
+        return top ? batch_add_file(queue, path) : 1;
+    }
+
+    if (S_ISDIR(path_stat.st_mode)) {
+        if (top || recursive) {
+            return batch_add_directory(queue, path, recursive);
+        }
+
+        return 1;
+    }
+
+    if (S_ISREG(path_stat.st_mode) || top) {
+        return batch_add_file(queue, path);
+    }
+
+    return 1;
+}
+
+int batch_add_directory(batch_queue* queue, const char* path, int recursive)
+{
+    DIR* directory = opendir(path);
+
+    if (directory == NULL) {
+        fprintf(stderr, "Unable to open directory: %s\n", path);
+        return 0;
+    }
+
+    struct dirent* entry;
+    int result = 1;
+
+    while (result && (entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0 ||
+            cache_is_own_file(entry->d_name)) {
+            continue;
+        }
+
+        size_t length = strlen(path) + strlen(entry->d_name) + 2;
+        char*  child  = (char*) malloc(length);
+
+        if (child == NULL) {
+            result = 0;
+            break;
+        }
+
+        snprintf(child, length, "%s/%s", path, entry->d_name);
+        result = batch_add_path(queue, child, recursive, 0);
+        free(child);
+    }
+
+    closedir(directory);
+    return result;
+}
+
+void* batch_worker(void* argument)
+{
+    batch_queue* queue = (batch_queue*) argument;
+
+    char*  buffer   = NULL;
+    size_t capacity = 0;
+
+    for (;;) {
+        batch_file* file = NULL;
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->next_file < queue->num_files) {
+            file = &queue->files[queue->next_file];
+            ++queue->next_file;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        if (file == NULL) {
+            break;
+        }
+
+        batch_convert_file(file, &buffer, &capacity, queue->options);
+    }
+
+    brnflip_free_buffer(buffer, capacity);
+    return NULL;
+}
+
+/* Converts one file in place using the worker's buffer, growing it if the
+ * file does not fit.
+ */
+void batch_convert_file(
+    batch_file*        file,
+    char**             buffer,
+    size_t*            capacity,
+    const cli_options* options
+)
+{
+    struct stat file_stat;
+
+    file->status = batch_failed;
+
+    int fd = open(file->path, O_RDONLY);
+
+    if (fd < 0) {
+        file->message = "unable to open file";
+        return;
+    }
+
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        file->message = "not a regular file";
+        close(fd);
+        return;
+    }
+
+    if ((uintmax_t) file_stat.st_size > SIZE_MAX) {
+        file->message = "file too large";
+        close(fd);
+        return;
+    }
+
+    size_t             brain_length = (size_t) file_stat.st_size;
+    brnflip_brain_info cached;
+    cli_options        cached_options;
+
+    // An unchanged brain that was already in the target endianess is not read.
+    if (options->cache && options->force != 1 &&
+        cache_lookup(file->path, &cached)) {
+        if (cached.file_type == options->target) {
+            file->status = batch_unchanged;
+            close(fd);
+            return;
+        }
+
+        cached_options        = *options;
+        cached_options.cached = &cached;
+        options               = &cached_options;
+    }
+
+    int loaded = read_file(fd, brain_length, buffer, capacity);
+
+    close(fd);
+
+    if (!loaded) {
+        file->message = "unable to read file";
+        return;
+    }
+
+    int                flipped;
+    brnflip_brain_info info;
+    brnflip_error      error = convert_buffer(
+        *buffer,
+        brain_length,
+        options,
+        &flipped,
+        NULL,
+        &info
+    );
+
+    if (error != no_error) {
+        file->message = "does not appear to be a brain";
+        return;
+    }
+
+    if (!flipped) {
+        file->status = batch_unchanged;
+
+        if (options->cache) {
+            cache_store(file->path, &info);
+        }
+
+        return;
+    }
+
+    struct stat temp_stat;
+    const char* message = replace_file(
+        file->path,
+        *buffer,
+        brain_length,
+        &file_stat,
+        &temp_stat
+    );
+
+    if (message != NULL) {
+        file->message = message;
+        return;
+    }
+
+    if (options->cache) {
+        cache_store(file->path, &info);
+    }
+
+    file->status = batch_converted;
+}
@@ -0,0 +1,339 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "brnflip.h"
+#include "generate.h"
+
+/* Benchmarks
+ *
+ * For each size, brnbench generates a brain in the opposite of the native
+ * byte order and times brnflip_detect_endianess, brnflip_flip_buffer and a
+ * run of the brnflip program converting the brain from one file to another.
+ * Every measurement is the best of several runs, to keep noise from other
+ * processes out of the comparison between releases. The results are written
+ * to stdout as CSV, one line per measurement.
+ */
+
+extern char** environ;
+
+typedef struct
+{
+    const char*  brnflip_path;
+    const char*  temp_directory;
+    unsigned int num_repeats;
+} bench_options;
+
+typedef int (*bench_fn)(void* context);
+
+typedef struct
+{
+    char*              brain;
+    size_t             brain_length;
+    const char* const* arguments;
+    const char*        output;
+} bench_context;
+
+void print_usage(char* program_name);
+int bench_size(uint64_t size, const bench_options* options);
+double bench_best_time(bench_fn fn, void* context, unsigned int num_repeats);
+void bench_report(
+    const char* benchmark,
+    size_t      brain_length,
+    uint64_t    num_nodes,
+    double      seconds
+);
+int bench_detect(void* context);
+int bench_flip(void* context);
+int bench_cli(void* context);
+
+int main(int argc, char* argv[]) {
+    static const char* default_sizes[] = { "64K", "1M", "16M", "256M" };
+
+    bench_options options;
+    options.brnflip_path   = "./brnflip";
+    options.temp_directory = "/tmp";
+    options.num_repeats    = 3;
+
+    const char** sizes = (const char**) calloc(argc, sizeof(char*));
+    int num_sizes = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--brnflip") == 0 && i + 1 < argc) {
+            options.brnflip_path = argv[++i];
+        } else if (strcmp(argv[i], "--tmpdir") == 0 && i + 1 < argc) {
+            options.temp_directory = argv[++i];
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            if (atoi(argv[i + 1]) < 1) {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            options.num_repeats = (unsigned int) atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            sizes[num_sizes++] = argv[i];
+        }
+    }
+
+    if (num_sizes == 0) {
+        num_sizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+
+    puts("benchmark,bytes,nodes,kernel,seconds,mb_per_s,ns_per_node");
+
+    int failed = 0;
+
+    for (int i = 0; i < num_sizes; ++i) {
+        uint64_t size;
+
+        if (!brngen_parse_size(sizes[i], &size) || size == 0) {
+            fprintf(stderr, "Not a size: %s\n", sizes[i]);
+            failed = 1;
+        } else if (!bench_size(size, &options)) {
+            failed = 1;
+        }
+
+        fflush(stdout);
+    }
+
+    free(sizes);
+    return failed;
+}
+
+/* Runs every benchmark on a brain of about size bytes, returning 0 if any of
+ * them failed.
+ */
+int bench_size(uint64_t size, const bench_options* options)
+{
+    brngen_options generate_options;
+    brngen_default_options(&generate_options);
+
+    generate_options.byte_order = megahal_native_endianess == big_endian ?
+        little_endian : big_endian;
+    generate_options.num_nodes = brngen_nodes_for_length(
+        size,
+        generate_options.num_words
+    );
+
+    bench_context context;
+    uint64_t      num_nodes;
+
+    context.brain = (char*) malloc(brngen_max_length(&generate_options));
+
+    if (context.brain == NULL) {
+        fprintf(stderr, "Unable to allocate a brain of %llu bytes.\n",
+            (unsigned long long) size);
+        return 0;
+    }
+
+    brngen_generate(
+        &generate_options,
+        context.brain,
+        &context.brain_length,
+        &num_nodes
+    );
+
+    size_t path_length = strlen(options->temp_directory) + 32;
+    char*  input       = (char*) malloc(path_length);
+    char*  output      = (char*) malloc(path_length);
+
+    snprintf(input, path_length, "%s/brnbench-%d.in", options->temp_directory,
+        (int) getpid());
+    snprintf(output, path_length, "%s/brnbench-%d.out", options->temp_directory,
+        (int) getpid());
+
+    FILE* file = fopen(input, "wb");
+    int   result = file != NULL &&
+        fwrite(context.brain, 1, context.brain_length, file) ==
+            context.brain_length;
+
+    if (file == NULL || fclose(file) != 0 || !result) {
+        fprintf(stderr, "Unable to write %s\n", input);
+        result = 0;
+    }
+
+    double seconds = bench_best_time(bench_detect, &context, options->num_repeats);
+
+    if (seconds < 0) {
+        fprintf(stderr, "Unable to detect the endianess of a generated brain.\n");
+        result = 0;
+    } else {
+        bench_report("detect", context.brain_length, num_nodes, seconds);
+    }
+
+    seconds = bench_best_time(bench_flip, &context, options->num_repeats);
+
+    if (seconds < 0) {
+        fprintf(stderr, "Unable to flip a generated brain.\n");
+        result = 0;
+    } else {
+        bench_report("flip", context.brain_length, num_nodes, seconds);
+    }
+
+    // The brnflip program needs the memory more than the buffer does.
+    free(context.brain);
+    context.brain = NULL;
+
+    if (result) {
+        const char* arguments[] = {
+            options->brnflip_path, input, "-o", output, NULL
+        };
+
+        context.arguments = arguments;
+        context.output    = output;
+        seconds = bench_best_time(bench_cli, &context, options->num_repeats);
+
+        if (seconds < 0) {
+            fprintf(stderr, "Unable to run %s\n", options->brnflip_path);
+            result = 0;
+        } else {
+            bench_report("cli", context.brain_length, num_nodes, seconds);
+        }
+    }
+
+    remove(input);
+    remove(output);
+    free(input);
+    free(output);
+
+    return result;
+}
+
+/* Returns the shortest time fn took over num_repeats runs, in seconds, or -1
+ * if it failed.
+ */
+double bench_best_time(bench_fn fn, void* context, unsigned int num_repeats)
+{
+    double best = -1;
+
+    unsigned int i;
+    for (i = 0; i < num_repeats; ++i) {
+        struct timespec start;
+        struct timespec end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (!fn(context)) {
+            return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = (end.tv_sec - start.tv_sec) +
+            (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        if (best < 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+
+    return best;
+}
+
+void bench_report(
+    const char* benchmark,
+    size_t      brain_length,
+    uint64_t    num_nodes,
+    double      seconds
+)
+{
+    printf(
+        "%s,%zu,%llu,%s,%.9f,%.2f,%.3f\n",
+        benchmark,
+        brain_length,
+        (unsigned long long) num_nodes,
+        brnflip_kernel_name(),
+        seconds,
+        seconds > 0 ? brain_length / seconds / 1e6 : 0.0,
+        num_nodes > 0 ? seconds * 1e9 / num_nodes : 0.0
+    );
+}
+
+int bench_detect(void* context)
+{
+    bench_context* bench = (bench_context*) context;
+    megahal_filetype file_type;
+
+    return brnflip_detect_endianess(
+        bench->brain,
+        bench->brain_length,
+        &file_type
+    ) == no_error;
+}
+
+int bench_flip(void* context)
+{
+    bench_context* bench = (bench_context*) context;
+
+    return brnflip_flip_buffer(bench->brain, bench->brain_length) == no_error;
+}
+
+int bench_cli(void* context)
+{
+    bench_context* bench = (bench_context*) context;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+    pid_t pid;
+    int   status;
+    int   result = posix_spawn(
+        &pid,
+        bench->arguments[0],
+        &actions,
+        NULL,
+        (char* const*) bench->arguments,
+        environ
+    ) == 0;
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    result = result && waitpid(pid, &status, 0) == pid &&
+        WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    // brnflip reports some failures only on stderr, so check its output too.
+    struct stat output_stat;
+
+    return result && stat(bench->output, &output_stat) == 0 &&
+        (size_t) output_stat.st_size == bench->brain_length;
+}
+
+void print_usage(char* program_name) {
+    printf("Usage: %s [--brnflip path] [--tmpdir directory] [--repeat count]\n", program_name);
+    printf("       [size...]\n");
+
+    puts("Times brnflip_detect_endianess, brnflip_flip_buffer and the brnflip");
+    puts("program on generated brains of each size, such as 64K, 16M or 2G.");
+    puts("Each time is the best of --repeat runs (default 3). Results are");
+    puts("printed as CSV with the columns:");
+    puts("  benchmark,bytes,nodes,kernel,seconds,mb_per_s,ns_per_node");
+}
@@ -26,6 +26,7 @@
 #endif
 
 #include "brnflip.h"
+#include "brnflip_internal.h"
 
 /* Megahal Brain Format
  *
@@ -37,7 +38,7 @@
  *
  * Type     | Name        |  Description
  *----------+-------------+----------------------------------------------------
- * char[9]  | cookie      | "Megahalv8", not null terminated
+ * char[9]  | brnflip_cookie      | "Megahalv8", not null terminated
  * char     | model order | This is always 5.
  *
  * Tree Nodes
@@ -70,67 +71,172 @@ const megahal_filetype megahal_native_endianess = little_endian;
 const megahal_filetype megahal_native_endianess = unknown_filetype;
 #endif
 
-const char*  cookie                 = "MegaHALv8";
-const size_t cookie_length          = 9;
-const char   model_order            = 5;
-const off_t  header_length          = cookie_length + sizeof(model_order);
+const char*  brnflip_cookie         = "MegaHALv8";
+const size_t brnflip_cookie_length  = 9;
+const char   brnflip_model_order    = 5;
+const off_t  brnflip_header_length  = brnflip_cookie_length +
+    sizeof(brnflip_model_order);
 
-const uint32_t num_trees            = 2;
-const off_t    tree_node_length     = sizeof(uint16_t) * 3 + sizeof(uint32_t);
+const uint32_t brnflip_num_trees        = 2;
+const off_t    brnflip_tree_node_length = sizeof(uint16_t) * 3 + sizeof(uint32_t);
 
-const char*  firstDictWord          = "<ERROR>";
-const size_t first_dict_word_length = 7;
+const size_t brnflip_first_dict_word_length = 7;
 
-const size_t min_dict_length = sizeof(uint32_t) +
-    first_dict_word_length + 1;
+const size_t brnflip_min_dict_length = sizeof(uint32_t) +
+    brnflip_first_dict_word_length + 1;
 
-const size_t min_brain_length = header_length +
-    tree_node_length * num_trees +
-    min_dict_length;
+const size_t brnflip_min_brain_length = brnflip_header_length +
+    brnflip_tree_node_length * brnflip_num_trees +
+    brnflip_min_dict_length;
+
+// Nodes flipped at a time while traversing, small enough to stay in cache.
+static const size_t flip_run_nodes = 4096;
+
+/* Hits of the dictionary signature checked before giving up on finding one
+ * that fits, which bounds the search on brains with many words that contain
+ * it.
+ */
+static const size_t max_dictionary_candidates = 64;
+
+// Nodes read from the start of the node region by quick detection.
+static const size_t quick_detect_head_nodes = 64;
+
+// Nodes sampled at even strides across the node region by quick detection.
+static const size_t quick_detect_sampled_nodes = 64;
+
+/* Brains at least this large are copied by brnflip_flip_copy with
+ * non-temporal stores, since they will not fit in the cache anyway.
+ */
+static const size_t flip_copy_streaming_length = 1 << 22;
+
+// Nodes flipped at a time into a scratch buffer before being streamed out.
+static const size_t flip_copy_run_nodes = 1024;
 
 void brnflip_flip_16_in_place(char* x);
 void brnflip_flip_32_in_place(char* x);
 
 // Function declarations
 
-brnflip_error brnflip_verify_header(char* brain, size_t brain_length);
-
-brnflip_error brnflip_find_dictionary_offset(
-    char*  brain,
-    size_t brain_length,
-    off_t* dictionary_offset
+int brnflip_dictionary_fits(
+    const char* brain,
+    size_t      brain_length,
+    off_t       dictionary_offset,
+    uint64_t*   out_num_words
 );
 
-brnflip_error brnflip_count_words_in_dictionary(
-    char*    brain,
-    size_t   brain_length,
-    off_t    dictionary_offset,
-    int32_t* num_words_in_dictionary
+void brnflip_count_implausible_symbols(
+    const char* brain,
+    off_t       dictionary_offset,
+    uint32_t    num_words,
+    size_t      out_implausible[2]
 );
 
 brnflip_error brnflip_traverse_tree(
-    char*  brain,
-    size_t brain_length,
-    off_t* position,
-    int    assume_flipped
+    const char*        brain,
+    off_t              limit,
+    off_t*             position,
+    int                assume_flipped,
+    char*              flip_into,
+    brnflip_tree_info* info
+);
+
+brnflip_error brnflip_detect_and_flip(
+    char*               brain,
+    size_t              brain_length,
+    megahal_filetype    target,
+    unsigned int        num_threads,
+    brnflip_brain_info* out_info
+);
+
+megahal_filetype brnflip_file_type(int flipped);
+
+int brnflip_needs_flip(int flipped, megahal_filetype target);
+
+brnflip_error brnflip_walk_trees(
+    char*              brain,
+    off_t              dictionary_offset,
+    int                assume_flipped,
+    int                flip,
+    brnflip_tree_info* tree_info
+);
+
+brnflip_error brnflip_flip_region(
+    char*        brain,
+    off_t        dictionary_offset,
+    unsigned int num_threads
+);
+
+void brnflip_balance_trees(
+    const char*        brain,
+    off_t              dictionary_offset,
+    unsigned int       num_threads,
+    brnflip_tree_info  out_infos[2],
+    brnflip_error      out_errors[2]
 );
 
+void brnflip_balance_chunk(
+    void*        context,
+    unsigned int chunk,
+    size_t       begin,
+    size_t       end
+);
+
+void brnflip_flip_chunk(
+    void*        context,
+    unsigned int chunk,
+    size_t       begin,
+    size_t       end
+);
+
+void brnflip_flip_copy_chunk(
+    void*        context,
+    unsigned int chunk,
+    size_t       begin,
+    size_t       end
+);
+
+// The nodes brnflip_flip_copy_chunk copies from and to.
+typedef struct
+{
+    const char* src;
+    char*       dst;
+    int         streaming;
+} brnflip_copy_context;
+
 // Function implementations
 
-brnflip_error brnflip_detect_endianess(
-    char*             brain,
-    size_t            brain_length,
-    megahal_filetype* out_file_type
+/* This function is the body of brnflip_detect_endianess, brnflip_inspect_brain
+ * and brnflip_convert. It detects the endianess of a brain and fills in
+ * out_info. If target is not unknown_filetype and the brain is in the other
+ * endianess, each run of nodes is flipped right after the traversal has read
+ * it, while it is still in cache, so that the node region only passes through
+ * memory once. If the traversal then fails, the nodes flipped so far are
+ * flipped back, leaving the buffer as it was.
+ *
+ * With more than one thread, the trees are checked under both endianesses at
+ * once by brnflip_balance_trees instead, and the nodes are flipped afterwards
+ * by brnflip_flip_region. The verdict is the same either way.
+ */
+brnflip_error brnflip_detect_and_flip(
+    char*               brain,
+    size_t              brain_length,
+    megahal_filetype    target,
+    unsigned int        num_threads,
+    brnflip_brain_info* out_info
 )
 {
-    off_t    position                  = header_length;
     off_t    dictionary_offset         = 0;
     uint32_t dictionary_length         = 0;
     uint32_t flipped_dictionary_length = 0;
-    int32_t  num_words_in_dictionary   = 0;
+    uint64_t num_words_in_dictionary   = 0;
     int      assume_flipped            = 0;
+    int      flip                      = 0;
+
+    brnflip_tree_info tree_info = { 0 };
+    brnflip_tree_info balances[2];
+    brnflip_error     balance_errors[2];
 
-    *out_file_type = unknown_filetype;
+    memset(out_info, 0, sizeof(brnflip_brain_info));
 
     brnflip_error return_code = brnflip_verify_header(
         brain,
@@ -140,15 +246,16 @@ brnflip_error brnflip_detect_endianess(
     return_code = return_code || brnflip_find_dictionary_offset(
         brain,
         brain_length,
-        &dictionary_offset
+        &dictionary_offset,
+        &num_words_in_dictionary
     );
 
     /* Now that we know where the dictionary starts, we can read in the
-     * dictionary length saved in the file. We can then progress to the end of
-     * the file, counting the actual number of words in the dictionary. If the
-     * two counts differ, we know that the file is not in our native endianess,
-     * but if the counts are the same, we can't make any assumptions, since
-     * there are some numbers with the same representation in both endianesses.
+     * dictionary length saved in the file, and compare it with the number of
+     * words counted while the dictionary was being found. If the two counts
+     * differ, we know that the file is not in our native endianess, but if the
+     * counts are the same, we can't make any assumptions, since there are some
+     * numbers with the same representation in both endianesses.
      */
 
     if (return_code == no_error) {
@@ -162,12 +269,9 @@ brnflip_error brnflip_detect_endianess(
         brnflip_flip_32_in_place((char*) &flipped_dictionary_length);
     }
 
-    return_code = return_code || brnflip_count_words_in_dictionary(
-        brain,
-        brain_length,
-        dictionary_offset,
-        &num_words_in_dictionary
-    );
+    if (return_code == no_error && num_words_in_dictionary == 0) {
+        return_code = invalid_file;
+    }
 
     if (flipped_dictionary_length == num_words_in_dictionary) {
         assume_flipped = 1;
@@ -180,45 +284,53 @@ brnflip_error brnflip_detect_endianess(
      * previously calculated dictionary position.
      */
 
-    if (return_code == no_error) {
-        return_code = return_code || brnflip_traverse_tree(
+    if (return_code == no_error && num_threads > 1) {
+        brnflip_balance_trees(
             brain,
-            brain_length,
-            &position,
-            assume_flipped
+            dictionary_offset,
+            num_threads,
+            balances,
+            balance_errors
         );
+    }
 
-        return_code = return_code || brnflip_traverse_tree(
-            brain,
-            brain_length,
-            &position,
-            assume_flipped
-        );
+    if (return_code == no_error) {
+        flip = brnflip_needs_flip(assume_flipped, target);
 
+        if (num_threads > 1) {
+            tree_info   = balances[assume_flipped];
+            return_code = balance_errors[assume_flipped];
+        } else {
+            return_code = brnflip_walk_trees(
+                brain,
+                dictionary_offset,
+                assume_flipped,
+                flip,
+                &tree_info
+            );
+        }
 
-        if (return_code != no_error || position != dictionary_offset) {
+        if (return_code != no_error) {
             /* If dictionary_length is the same number when its endianess is
              * flipped, we could have gotten assume_flipped wrong, so try
              * traversing the trees again with the opposite assumed endianess.
              */
             if (dictionary_length == flipped_dictionary_length) {
-                position      = header_length;
                 assume_flipped = !assume_flipped;
-                return_code    = no_error;
-
-                return_code = return_code || brnflip_traverse_tree(
-                    brain,
-                    brain_length,
-                    &position,
-                    assume_flipped
-                );
-
-                return_code = return_code || brnflip_traverse_tree(
-                    brain,
-                    brain_length,
-                    &position,
-                    assume_flipped
-                );
+                flip           = brnflip_needs_flip(assume_flipped, target);
+
+                if (num_threads > 1) {
+                    tree_info   = balances[assume_flipped];
+                    return_code = balance_errors[assume_flipped];
+                } else {
+                    return_code = brnflip_walk_trees(
+                        brain,
+                        dictionary_offset,
+                        assume_flipped,
+                        flip,
+                        &tree_info
+                    );
+                }
             } else {
                 return_code = invalid_file;
             }
@@ -227,24 +339,277 @@ brnflip_error brnflip_detect_endianess(
 
     if (return_code == no_error) {
         // We can now be sure that assume_flipped is a correct assumption.
-        if (assume_flipped) {
-            #if BYTE_ORDER == BIG_ENDIAN
-            *out_file_type = little_endian;
-            #elif BYTE_ORDER == LITTLE_ENDIAN
-            *out_file_type = big_endian;
-            #endif
-        } else {
-            #if BYTE_ORDER == BIG_ENDIAN
-            *out_file_type = big_endian;
-            #elif BYTE_ORDER == LITTLE_ENDIAN
-            *out_file_type = little_endian;
-            #endif
+        out_info->detected_file_type = brnflip_file_type(assume_flipped);
+        out_info->file_type          = out_info->detected_file_type;
+        out_info->dictionary_offset  = dictionary_offset;
+        out_info->num_nodes          = tree_info.num_nodes;
+        out_info->num_words          = (uint32_t) num_words_in_dictionary;
+        out_info->max_depth          = tree_info.max_depth;
+
+        if (flip && num_threads > 1) {
+            brnflip_flip_region(brain, dictionary_offset, num_threads);
+            out_info->file_type = target;
+        } else if (flip) {
+            brnflip_flip_32_in_place(brain + dictionary_offset);
+            out_info->file_type = target;
+        }
+    } else {
+        return_code = invalid_file;
+    }
+
+    return return_code;
+}
+
+/* This function returns the endianess of a brain that is or is not flipped
+ * relative to this machine.
+ */
+megahal_filetype brnflip_file_type(int flipped)
+{
+    if (flipped) {
+        #if BYTE_ORDER == BIG_ENDIAN
+        return little_endian;
+        #elif BYTE_ORDER == LITTLE_ENDIAN
+        return big_endian;
+        #endif
+    } else {
+        #if BYTE_ORDER == BIG_ENDIAN
+        return big_endian;
+        #elif BYTE_ORDER == LITTLE_ENDIAN
+        return little_endian;
+        #endif
+    }
+
+    return unknown_filetype;
+}
+
+/* This function returns 1 if a brain that is or is not flipped relative to
+ * this machine must be flipped to reach target. A target of unknown_filetype
+ * never needs flipping.
+ */
+int brnflip_needs_flip(int flipped, megahal_filetype target)
+{
+    return target != unknown_filetype && brnflip_file_type(flipped) != target;
+}
+
+/* This function traverses both trees from the end of the header, flipping the
+ * nodes as it goes if flip is set, and checks that they end exactly at the
+ * dictionary. If they do not, any nodes that were flipped are flipped back.
+ */
+brnflip_error brnflip_walk_trees(
+    char*              brain,
+    off_t              dictionary_offset,
+    int                assume_flipped,
+    int                flip,
+    brnflip_tree_info* tree_info
+)
+{
+    off_t    position = brnflip_header_length;
+    uint64_t start    = brnflip_stats_start();
+
+    brnflip_error return_code = no_error;
+
+    memset(tree_info, 0, sizeof(brnflip_tree_info));
+    tree_info->error_offset = -1;
+
+    uint32_t i;
+    for (i = 0; i < brnflip_num_trees && return_code == no_error; ++i) {
+        return_code = brnflip_traverse_tree(
+            brain,
+            dictionary_offset,
+            &position,
+            assume_flipped,
+            flip ? brain : NULL,
+            tree_info
+        );
+    }
+
+    if (return_code == no_error && position != dictionary_offset) {
+        tree_info->error_offset = position;
+        return_code = invalid_file;
+    }
+
+    if (return_code != no_error && flip) {
+        brnflip_flip_nodes(
+            brain + brnflip_header_length,
+            brain + brnflip_header_length,
+            (position - brnflip_header_length) / brnflip_tree_node_length
+        );
+    }
+
+    tree_info->end_offset = position;
+
+    brnflip_stats_stop(
+        phase_walk,
+        start,
+        tree_info->num_nodes * brnflip_tree_node_length,
+        tree_info->num_nodes
+    );
+
+    return return_code;
+}
+
+brnflip_error brnflip_detect_endianess(
+    const char*       brain,
+    size_t            brain_length,
+    megahal_filetype* out_file_type
+)
+{
+    brnflip_brain_info info;
+
+    // With no target, brnflip_detect_and_flip never writes to the brain.
+    brnflip_error return_code = brnflip_detect_and_flip(
+        (char*) brain,
+        brain_length,
+        unknown_filetype,
+        1,
+        &info
+    );
+
+    *out_file_type = info.detected_file_type;
+
+    return return_code;
+}
+
+brnflip_error brnflip_quick_detect_endianess(
+    const char*         brain,
+    size_t              brain_length,
+    megahal_filetype*   out_file_type,
+    brnflip_confidence* out_confidence
+)
+{
+    off_t    dictionary_offset         = 0;
+    uint32_t dictionary_length         = 0;
+    uint32_t flipped_dictionary_length = 0;
+    uint64_t num_words_in_dictionary   = 0;
+
+    *out_file_type  = unknown_filetype;
+    *out_confidence = no_confidence;
+
+    brnflip_error return_code = brnflip_verify_header(
+        brain,
+        brain_length
+    );
+
+    return_code = return_code || brnflip_find_dictionary_offset(
+        brain,
+        brain_length,
+        &dictionary_offset,
+        &num_words_in_dictionary
+    );
+
+    if (return_code != no_error || num_words_in_dictionary == 0) {
+        return invalid_file;
+    }
+
+    memcpy(&dictionary_length, brain + dictionary_offset, sizeof(uint32_t));
+
+    flipped_dictionary_length = dictionary_length;
+    brnflip_flip_32_in_place((char*) &flipped_dictionary_length);
+
+    int native_fits  = dictionary_length == num_words_in_dictionary;
+    int flipped_fits = flipped_dictionary_length == num_words_in_dictionary;
+
+    /* The dictionary length almost always tells the endianesses apart on its
+     * own, since a word count below 2^16 reads as a multiple of 2^16 in the
+     * other endianess. The sampled symbols then confirm or contradict it.
+     */
+    if (native_fits != flipped_fits &&
+        dictionary_offset >= brnflip_header_length +
+            brnflip_tree_node_length * (off_t) brnflip_num_trees &&
+        (dictionary_offset - brnflip_header_length) %
+            brnflip_tree_node_length == 0) {
+        int    assume_flipped = flipped_fits;
+        size_t implausible[2];
+
+        brnflip_count_implausible_symbols(
+            brain,
+            dictionary_offset,
+            (uint32_t) num_words_in_dictionary,
+            implausible
+        );
+
+        if (implausible[assume_flipped] == 0 &&
+            megahal_native_endianess != unknown_filetype) {
+            *out_file_type  = brnflip_file_type(assume_flipped);
+            *out_confidence = implausible[!assume_flipped] > 0 ?
+                high_confidence :
+                low_confidence;
+
+            return no_error;
         }
     }
 
+    return_code = brnflip_detect_endianess(
+        brain,
+        brain_length,
+        out_file_type
+    );
+
+    if (return_code == no_error) {
+        *out_confidence = full_confidence;
+    }
+
     return return_code;
 }
 
+brnflip_error brnflip_inspect_brain(
+    const char*         brain,
+    size_t              brain_length,
+    brnflip_brain_info* out_info
+)
+{
+    return brnflip_detect_and_flip(
+        (char*) brain,
+        brain_length,
+        unknown_filetype,
+        1,
+        out_info
+    );
+}
+
+brnflip_error brnflip_inspect_brain_parallel(
+    const char*         brain,
+    size_t              brain_length,
+    unsigned int        num_threads,
+    brnflip_brain_info* out_info
+)
+{
+    return brnflip_detect_and_flip(
+        (char*) brain,
+        brain_length,
+        unknown_filetype,
+        num_threads,
+        out_info
+    );
+}
+
+brnflip_error brnflip_convert(
+    char*               brain,
+    size_t              brain_length,
+    megahal_filetype    target,
+    brnflip_brain_info* out_info
+)
+{
+    return brnflip_detect_and_flip(brain, brain_length, target, 1, out_info);
+}
+
+brnflip_error brnflip_convert_parallel(
+    char*               brain,
+    size_t              brain_length,
+    megahal_filetype    target,
+    unsigned int        num_threads,
+    brnflip_brain_info* out_info
+)
+{
+    return brnflip_detect_and_flip(
+        brain,
+        brain_length,
+        target,
+        num_threads,
+        out_info
+    );
+}
+
 /* This function performs the flipping of the MegaHALv8 brain. Since the
  * dictionary must not be flipped, this function finds the start position of
  * the dictonary.
@@ -254,7 +619,6 @@ brnflip_error brnflip_flip_buffer(
     size_t brain_length
 )
 {
-    off_t position         = header_length;
     off_t dictionary_offset = 0;
 
     brnflip_error return_code = brnflip_verify_header(
@@ -265,46 +629,342 @@ brnflip_error brnflip_flip_buffer(
     return_code = return_code || brnflip_find_dictionary_offset(
         brain,
         brain_length,
-        &dictionary_offset
+        &dictionary_offset,
+        NULL
     );
 
     if (return_code == no_error) {
-        while (position < dictionary_offset) {
-            brnflip_flip_16_in_place(brain + position);
-            position += sizeof(uint16_t);
+        return_code = brnflip_flip_region(brain, dictionary_offset, 1);
+    } else {
+        return_code = invalid_file;
+    }
 
-            brnflip_flip_32_in_place(brain + position);
-            position += sizeof(uint32_t);
+    return return_code;
+}
 
-            brnflip_flip_16_in_place(brain + position);
-            position += sizeof(uint16_t);
+brnflip_error brnflip_flip_buffer_with_info(
+    char*               brain,
+    size_t              brain_length,
+    brnflip_brain_info* info
+)
+{
+    return brnflip_flip_buffer_parallel(brain, brain_length, info, 1);
+}
+
+brnflip_error brnflip_flip_buffer_parallel(
+    char*               brain,
+    size_t              brain_length,
+    brnflip_brain_info* info,
+    unsigned int        num_threads
+)
+{
+    if (info == NULL) {
+        off_t dictionary_offset = 0;
 
-            brnflip_flip_16_in_place(brain + position);
-            position += sizeof(uint16_t);
+        brnflip_error return_code = brnflip_verify_header(
+            brain,
+            brain_length
+        );
+
+        return_code = return_code || brnflip_find_dictionary_offset(
+            brain,
+            brain_length,
+            &dictionary_offset,
+            NULL
+        );
+
+        if (return_code != no_error) {
+            return invalid_file;
         }
 
-        brnflip_flip_32_in_place(brain + position);
-        position += sizeof(uint32_t);
+        return brnflip_flip_region(brain, dictionary_offset, num_threads);
+    }
+
+    if (info->dictionary_offset < brnflip_header_length ||
+        (size_t) info->dictionary_offset + brnflip_min_dict_length >
+            brain_length) {
+        return invalid_file;
+    }
+
+    brnflip_error return_code = brnflip_flip_region(
+        brain,
+        info->dictionary_offset,
+        num_threads
+    );
+
+    if (return_code == no_error) {
+        info->file_type = info->file_type == big_endian ?
+            little_endian :
+            big_endian;
     }
 
     return return_code;
 }
 
-/* This function verifies the header of a brain file, returning no_error
- * if the header is valid, and BRNFLIP_INVALID_INPUT otherwise.
+brnflip_error brnflip_flip_copy(
+    const char*         src,
+    char*               dst,
+    size_t              brain_length,
+    brnflip_brain_info* info,
+    unsigned int        num_threads
+)
+{
+    off_t dictionary_offset = 0;
+
+    if (info == NULL) {
+        brnflip_error return_code = brnflip_verify_header(
+            src,
+            brain_length
+        );
+
+        return_code = return_code || brnflip_find_dictionary_offset(
+            src,
+            brain_length,
+            &dictionary_offset,
+            NULL
+        );
+
+        if (return_code != no_error) {
+            return invalid_file;
+        }
+    } else {
+        dictionary_offset = info->dictionary_offset;
+
+        if (dictionary_offset < brnflip_header_length ||
+            (size_t) dictionary_offset + brnflip_min_dict_length >
+                brain_length) {
+            return invalid_file;
+        }
+    }
+
+    if ((dictionary_offset - brnflip_header_length) %
+        brnflip_tree_node_length != 0) {
+        return invalid_file;
+    }
+
+    int      streaming = brain_length >= flip_copy_streaming_length;
+    size_t   num_nodes = (dictionary_offset - brnflip_header_length) /
+        brnflip_tree_node_length;
+    off_t    words     = dictionary_offset + sizeof(uint32_t);
+    uint64_t start     = brnflip_stats_start();
+
+    brnflip_copy_context context;
+    context.src       = src + brnflip_header_length;
+    context.dst       = dst + brnflip_header_length;
+    context.streaming = streaming;
+
+    if (dst != src) {
+        memcpy(dst, src, brnflip_header_length);
+    }
+
+    brnflip_parallel_for(
+        num_nodes,
+        brnflip_parallel_chunks(num_nodes, num_threads),
+        brnflip_flip_copy_chunk,
+        &context
+    );
+
+    memmove(dst + dictionary_offset, src + dictionary_offset, sizeof(uint32_t));
+    brnflip_flip_32_in_place(dst + dictionary_offset);
+
+    if (dst != src && streaming) {
+        brnflip_copy_nontemporal(dst + words, src + words, brain_length - words);
+    } else if (dst != src) {
+        memcpy(dst + words, src + words, brain_length - words);
+    }
+
+    brnflip_stats_stop(phase_flip, start, brain_length, num_nodes);
+
+    if (info != NULL) {
+        info->file_type = info->file_type == big_endian ?
+            little_endian :
+            big_endian;
+    }
+
+    return no_error;
+}
+
+brnflip_error brnflip_changed_range(
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    brnflip_range*            out_range
+)
+{
+    off_t dictionary_offset = info->dictionary_offset;
+
+    if (dictionary_offset < brnflip_header_length ||
+        (size_t) dictionary_offset + brnflip_min_dict_length > brain_length ||
+        (dictionary_offset - brnflip_header_length) %
+            brnflip_tree_node_length != 0) {
+        return invalid_file;
+    }
+
+    // The nodes, followed by the dictionary length.
+    out_range->offset = brnflip_header_length;
+    out_range->length = dictionary_offset + sizeof(uint32_t) -
+        brnflip_header_length;
+
+    return no_error;
+}
+
+brnflip_error brnflip_flip_changed_copy(
+    const char*         src,
+    char*               dst,
+    size_t              brain_length,
+    brnflip_brain_info* info,
+    unsigned int        num_threads
+)
+{
+    brnflip_range range;
+
+    if (brnflip_changed_range(brain_length, info, &range) != no_error) {
+        return invalid_file;
+    }
+
+    size_t   num_nodes = (range.length - sizeof(uint32_t)) /
+        brnflip_tree_node_length;
+    uint64_t start     = brnflip_stats_start();
+
+    brnflip_copy_context context;
+    context.src       = src + range.offset;
+    context.dst       = dst;
+    context.streaming = range.length >= flip_copy_streaming_length;
+
+    brnflip_parallel_for(
+        num_nodes,
+        brnflip_parallel_chunks(num_nodes, num_threads),
+        brnflip_flip_copy_chunk,
+        &context
+    );
+
+    char* num_words = dst + range.length - sizeof(uint32_t);
+
+    memcpy(num_words, src + info->dictionary_offset, sizeof(uint32_t));
+    brnflip_flip_32_in_place(num_words);
+
+    brnflip_stats_stop(phase_flip, start, range.length, num_nodes);
+
+    info->file_type = info->file_type == big_endian ?
+        little_endian :
+        big_endian;
+
+    return no_error;
+}
+
+/* This function flips one chunk of the node region for brnflip_flip_copy. When
+ * streaming, the nodes are flipped a run at a time into a scratch buffer that
+ * stays in the cache, and streamed from there into the destination.
  */
-brnflip_error brnflip_verify_header(char* brain, size_t brain_length)
+void brnflip_flip_copy_chunk(
+    void*        context,
+    unsigned int chunk,
+    size_t       begin,
+    size_t       end
+)
 {
-    char cookie[cookie_length + 1] = { 0 };
+    brnflip_copy_context* copy = (brnflip_copy_context*) context;
+
+    const char* src       = copy->src + begin * brnflip_tree_node_length;
+    char*       dst       = copy->dst + begin * brnflip_tree_node_length;
+    size_t      num_nodes = end - begin;
+    char*       run       = NULL;
 
-    if (brain_length < min_brain_length ||
-        brain[cookie_length] != model_order) {
+    if (copy->streaming && src != dst) {
+        run = (char*) malloc(flip_copy_run_nodes * brnflip_tree_node_length);
+    }
+
+    if (run == NULL) {
+        brnflip_flip_nodes(src, dst, num_nodes);
+        return;
+    }
+
+    while (num_nodes > 0) {
+        size_t run_nodes = num_nodes < flip_copy_run_nodes ?
+            num_nodes :
+            flip_copy_run_nodes;
+
+        brnflip_flip_nodes(src, run, run_nodes);
+        brnflip_copy_nontemporal(
+            dst,
+            run,
+            run_nodes * brnflip_tree_node_length
+        );
+
+        src       += run_nodes * brnflip_tree_node_length;
+        dst       += run_nodes * brnflip_tree_node_length;
+        num_nodes -= run_nodes;
+    }
+
+    free(run);
+}
+
+/* This function flips the nodes between the header and the dictionary, and
+ * the dictionary length. The nodes are split between up to num_threads
+ * threads.
+ */
+brnflip_error brnflip_flip_region(
+    char*        brain,
+    off_t        dictionary_offset,
+    unsigned int num_threads
+)
+{
+    off_t position = brnflip_header_length;
+
+    /* The node region is a whole number of fixed-size nodes, which lets the
+     * kernels in kernels.c flip it without walking the trees, and lets it be
+     * split into node-aligned chunks.
+     */
+    if ((dictionary_offset - position) % brnflip_tree_node_length != 0) {
         return invalid_file;
     }
 
-    memcpy(cookie, brain, cookie_length);
+    size_t   num_nodes = (dictionary_offset - position) /
+        brnflip_tree_node_length;
+    uint64_t start     = brnflip_stats_start();
+
+    brnflip_parallel_for(
+        num_nodes,
+        brnflip_parallel_chunks(num_nodes, num_threads),
+        brnflip_flip_chunk,
+        brain + position
+    );
 
-    if (strcmp(cookie, cookie) != 0) {
+    brnflip_stats_stop(
+        phase_flip,
+        start,
+        num_nodes * brnflip_tree_node_length,
+        num_nodes
+    );
+
+    position = dictionary_offset;
+
+    brnflip_flip_32_in_place(brain + position);
+    position += sizeof(uint32_t);
+
+    return no_error;
+}
+
+/* This function flips one chunk of the node region for brnflip_flip_region. */
+void brnflip_flip_chunk(
+    void*        context,
+    unsigned int chunk,
+    size_t       begin,
+    size_t       end
+)
+{
+    char* nodes = (char*) context + begin * brnflip_tree_node_length;
+
+    brnflip_flip_nodes(nodes, nodes, end - begin);
+}
+
+/* This function verifies the header of a brain file, returning no_error
+ * if the header is valid, and BRNFLIP_INVALID_INPUT otherwise.
+ */
+brnflip_error brnflip_verify_header(const char* brain, size_t brain_length)
+{
+    if (brain_length < brnflip_min_brain_length ||
+        memcmp(brain, brnflip_cookie, brnflip_cookie_length) != 0 ||
+        brain[brnflip_cookie_length] != brnflip_model_order) {
         return invalid_file;
     }
 
@@ -312,46 +972,71 @@ brnflip_error brnflip_verify_header(char* brain, size_t brain_length)
 }
 
 /* This function finds the start of the MegaHALv8 dictionary. It takes
- * advantage of the fact that the dictionary starts with "<ERROR>". If the
- * start is found, it returns no_error, but if not, returns
- * BRNFLIP_INVALID_FILE.
+ * advantage of the fact that the dictionary starts with "<ERROR>", searching
+ * backwards from the end of the brain for it with brnflip_find_signature.
+ * Since a later word, or a word followed by the next one, could contain the
+ * same bytes, each hit is checked with brnflip_dictionary_fits, and the search
+ * goes on past hits that do not fit. If none of them fit, the last hit is
+ * returned, which is where the dictionary would have to be, and the callers'
+ * own checks reject the brain. If the start is found, it returns no_error,
+ * but if not, returns BRNFLIP_INVALID_FILE. If num_words is not NULL, it is
+ * set to the number of words brnflip_dictionary_fits counted in the
+ * dictionary, or 0 if none of the hits fit, so that callers need not walk the
+ * words again.
  */
 
 brnflip_error brnflip_find_dictionary_offset(
-    char*  brain,
-    size_t brain_length,
-    off_t* dictionary_offset
+    const char* brain,
+    size_t      brain_length,
+    off_t*      dictionary_offset,
+    uint64_t*   num_words
 )
 {
-    char c;
-    int foundStart = 0;
+    off_t    last_hit       = -1;
+    off_t    fitting_hit    = -1;
+    uint64_t fitting_words  = 0;
+    size_t   end            = brain_length;
+    size_t   num_candidates = 0;
+    uint64_t start          = brnflip_stats_start();
+
+    while (num_candidates < max_dictionary_candidates) {
+        off_t hit = brnflip_find_signature(brain, end);
+
+        if (hit < brnflip_header_length + (off_t) sizeof(uint32_t)) {
+            break;
+        }
 
-    *dictionary_offset = brain_length - first_dict_word_length - 1;
-    c = brain[*dictionary_offset];
+        if (last_hit < 0) {
+            last_hit = hit - sizeof(uint32_t);
+        }
 
-    while (*dictionary_offset >= 0 && !foundStart) {
-        // Search for the start of the dictionary
-        if (c == first_dict_word_length) {
-            char word[first_dict_word_length + 1] = { 0 };
+        if (brnflip_dictionary_fits(
+                brain,
+                brain_length,
+                hit - sizeof(uint32_t),
+                &fitting_words
+            )) {
+            fitting_hit = hit - sizeof(uint32_t);
+            break;
+        }
 
-            memcpy(
-                word,
-                &brain[*dictionary_offset + 1],
-                first_dict_word_length
-            );
+        // Look for the signature again, starting just before this hit.
+        end = hit + brnflip_first_dict_word_length;
+        ++num_candidates;
+    }
 
-            if(strncmp(word, firstDictWord, first_dict_word_length) == 0){
-                foundStart = 1;
-            }
-        }
-        if(*dictionary_offset > 0){
-            --*dictionary_offset;
-            c = brain[*dictionary_offset];
-        }
+    *dictionary_offset = fitting_hit >= 0 ? fitting_hit : last_hit;
+
+    if (num_words != NULL) {
+        *num_words = fitting_hit >= 0 ? fitting_words : 0;
     }
 
-    ++*dictionary_offset;
-    *dictionary_offset -= sizeof(uint32_t);
+    brnflip_stats_stop(
+        phase_dictionary,
+        start,
+        *dictionary_offset < 0 ? 0 : brain_length - *dictionary_offset,
+        0
+    );
 
     if (*dictionary_offset < 0) {
         return invalid_file;
@@ -360,54 +1045,143 @@ brnflip_error brnflip_find_dictionary_offset(
     return no_error;
 }
 
-/* This function counts the number of words in the dictionary, returning
- * invalid_file if there are no words in the dictionary, and
- * no_error otherwise.
+/* This function checks whether a dictionary starting at dictionary_offset fits
+ * the rest of the brain. The nodes before it must be a whole number of nodes,
+ * and its words must end exactly at the end of the brain, having counted as
+ * many words as the dictionary length in either endianess. The words counted
+ * are placed in out_num_words.
  */
-brnflip_error brnflip_count_words_in_dictionary(
-    char*    brain,
-    size_t   brain_length,
-    off_t    dictionary_offset,
-    int32_t* num_words_in_dictionary
+int brnflip_dictionary_fits(
+    const char* brain,
+    size_t      brain_length,
+    off_t       dictionary_offset,
+    uint64_t*   out_num_words
 )
 {
-    unsigned char  wordLength = 0;
-    off_t position = dictionary_offset + sizeof(uint32_t);
+    uint32_t dictionary_length;
+    uint32_t flipped_dictionary_length;
+    uint64_t num_words = 0;
+    size_t   position  = dictionary_offset + sizeof(uint32_t);
+
+    if ((dictionary_offset - brnflip_header_length) %
+        brnflip_tree_node_length != 0) {
+        return 0;
+    }
+
+    memcpy(&dictionary_length, brain + dictionary_offset, sizeof(uint32_t));
 
-    *num_words_in_dictionary = 0;
+    flipped_dictionary_length = dictionary_length;
+    brnflip_flip_32_in_place((char*) &flipped_dictionary_length);
 
-    while(position < brain_length && *num_words_in_dictionary >= 0){
-        wordLength = brain[position];
-        ++*num_words_in_dictionary;
-        position += wordLength + 1;
+    while (position < brain_length) {
+        position += (unsigned char) brain[position] + 1;
+        ++num_words;
     }
 
-    if (*num_words_in_dictionary <= 0 || position > brain_length + 1) {
-        return invalid_file;
+    *out_num_words = num_words;
+
+    return position == brain_length &&
+        (num_words == dictionary_length ||
+         num_words == flipped_dictionary_length);
+}
+
+/* This function reads the symbols of the first quick_detect_head_nodes nodes
+ * and of quick_detect_sampled_nodes nodes spread evenly across the node
+ * region, and counts how many of them are not below num_words, and so could
+ * not name a word in the dictionary, when read in the native endianess and
+ * when flipped. A symbol is only implausible, not impossible, as it would be
+ * if the trees were walked, since a sampled node is not known to be in use.
+ */
+void brnflip_count_implausible_symbols(
+    const char* brain,
+    off_t       dictionary_offset,
+    uint32_t    num_words,
+    size_t      out_implausible[2]
+)
+{
+    size_t num_nodes   = (dictionary_offset - brnflip_header_length) /
+        brnflip_tree_node_length;
+    size_t num_head    = quick_detect_head_nodes;
+    size_t num_sampled = quick_detect_sampled_nodes;
+
+    if (num_head > num_nodes) {
+        num_head = num_nodes;
     }
 
-    return no_error;
+    // With no nodes at all, there is nowhere to sample from.
+    if (num_nodes == 0) {
+        num_sampled = 0;
+    }
+
+    out_implausible[0] = 0;
+    out_implausible[1] = 0;
+
+    size_t i;
+    for (i = 0; i < num_head + num_sampled; ++i) {
+        size_t node = i;
+
+        if (i >= num_head) {
+            node = (i - num_head) * (num_nodes - 1) /
+                (quick_detect_sampled_nodes - 1);
+        }
+
+        uint16_t symbol;
+        memcpy(
+            &symbol,
+            brain + brnflip_header_length + node * brnflip_tree_node_length,
+            sizeof(uint16_t)
+        );
+
+        uint16_t flipped_symbol = symbol;
+        brnflip_flip_16_in_place((char*) &flipped_symbol);
+
+        out_implausible[0] += symbol >= num_words;
+        out_implausible[1] += flipped_symbol >= num_words;
+    }
 }
 
-/* This function attempts to traverse a MegaHALv8 tree. If the tree extends
- * past the brain length, the function returns invalid_file, otherwise,
- * it advances position to the end of the tree and returns no_error.
+/* This function traverses a MegaHALv8 tree starting at position, without
+ * reading at or past limit. Rather than recursing once per node, it keeps an
+ * explicit stack holding the number of children still to be visited at each
+ * level, so that long chains of nodes cannot exhaust the call stack and the
+ * work done depends only on the number of nodes. If a node would extend past
+ * limit, the function places its offset in info->error_offset and returns
+ * invalid_file, otherwise, it advances position to the end of the tree and
+ * returns no_error. In both cases, the nodes visited and the deepest level
+ * reached are added to info.
+ *
+ * If flip_into is not NULL, every node visited is also flipped into it, in
+ * runs of flip_run_nodes, once its branch count has been read.
  */
 brnflip_error brnflip_traverse_tree(
-    char*  brain,
-    size_t brain_length,
-    off_t* position,
-    int    assume_flipped
+    const char*        brain,
+    off_t              limit,
+    off_t*             position,
+    int                assume_flipped,
+    char*              flip_into,
+    brnflip_tree_info* info
 )
 {
-    uint16_t num_branches = 0;
+    uint16_t  initial_stack[64];
+    uint16_t* pending  = initial_stack;
+    size_t    capacity = sizeof(initial_stack) / sizeof(initial_stack[0]);
+    size_t    depth    = 0;
+    off_t     run      = *position;
 
     brnflip_error return_code = no_error;
 
-    if (*position + tree_node_length < brain_length) {
+    do {
+        uint16_t num_branches = 0;
+
+        if (*position < 0 || *position > limit - brnflip_tree_node_length) {
+            info->error_offset = *position;
+            return_code = invalid_file;
+            break;
+        }
+
         memcpy(
             &num_branches,
-            brain + *position + tree_node_length - sizeof(uint16_t),
+            brain + *position + brnflip_tree_node_length - sizeof(uint16_t),
             sizeof(uint16_t)
         );
 
@@ -415,22 +1189,374 @@ brnflip_error brnflip_traverse_tree(
             brnflip_flip_16_in_place((char*) &num_branches);
         }
 
-        *position += tree_node_length;
+        *position += brnflip_tree_node_length;
+        ++info->num_nodes;
+
+        if (flip_into != NULL &&
+            *position - run >= brnflip_tree_node_length * (off_t) flip_run_nodes) {
+            brnflip_flip_nodes(brain + run, flip_into + run, flip_run_nodes);
+            run = *position;
+        }
+
+        // A chain over four billion nodes deep saturates max_depth.
+        if (depth > info->max_depth) {
+            info->max_depth = depth > UINT32_MAX ? UINT32_MAX : (uint32_t) depth;
+        }
+
+        if (num_branches > 0) {
+            if (depth == capacity) {
+                uint16_t* grown = pending == initial_stack ?
+                    malloc(capacity * 2 * sizeof(uint16_t)) :
+                    realloc(pending, capacity * 2 * sizeof(uint16_t));
+
+                if (grown == NULL) {
+                    info->error_offset = *position - brnflip_tree_node_length;
+                    return_code = invalid_file;
+                    break;
+                }
+
+                if (pending == initial_stack) {
+                    memcpy(grown, initial_stack, sizeof(initial_stack));
+                }
+
+                pending   = grown;
+                capacity *= 2;
+            }
+
+            pending[depth] = num_branches;
+            ++depth;
+        } else {
+            // A leaf completes its parent's subtree if it was the last child.
+            while (depth > 0 && --pending[depth - 1] == 0) {
+                --depth;
+            }
+        }
+    } while (depth > 0);
+
+    if (flip_into != NULL) {
+        brnflip_flip_nodes(
+            brain + run,
+            flip_into + run,
+            (*position - run) / brnflip_tree_node_length
+        );
+    }
+
+    if (pending != initial_stack) {
+        free(pending);
+    }
+
+    return return_code;
+}
+
+/* This function walks both trees under the given endianess and checks that
+ * they end exactly where the dictionary begins.
+ */
+brnflip_error brnflip_validate_trees(
+    const char*        brain,
+    size_t             brain_length,
+    megahal_filetype   file_type,
+    brnflip_tree_info* out_info
+)
+{
+    off_t position          = brnflip_header_length;
+    off_t dictionary_offset = 0;
+    int   assume_flipped    = file_type != megahal_native_endianess;
+
+    memset(out_info, 0, sizeof(brnflip_tree_info));
+    out_info->error_offset = -1;
+
+    brnflip_error return_code = brnflip_verify_header(
+        (char*) brain,
+        brain_length
+    );
+
+    if (return_code != no_error) {
+        out_info->error_offset = 0;
+        return invalid_file;
+    }
+
+    return_code = brnflip_find_dictionary_offset(
+        (char*) brain,
+        brain_length,
+        &dictionary_offset,
+        NULL
+    );
+
+    if (return_code != no_error) {
+        out_info->error_offset = brain_length;
+        return invalid_file;
     }
 
     uint32_t i;
-    for (i = 0; i < num_branches && return_code == no_error; ++i) {
-        return_code = return_code || brnflip_traverse_tree(
+    for (i = 0; i < brnflip_num_trees && return_code == no_error; ++i) {
+        return_code = brnflip_traverse_tree(
             brain,
-            brain_length,
-            position,
-            assume_flipped
+            dictionary_offset,
+            &position,
+            assume_flipped,
+            NULL,
+            out_info
         );
     }
 
+    if (return_code == no_error && position != dictionary_offset) {
+        out_info->error_offset = position;
+        return_code = invalid_file;
+    }
+
+    out_info->end_offset = position;
+
     return return_code;
 }
 
+/* Parallel Validation
+ *
+ * Walking the trees only checks their shape, and the shape is determined by
+ * the branch counts alone. Counting from the first root, the two trees are
+ * complete after node k exactly when the running balance
+ *
+ *     S(k) = sum of (branch - 1) over the first k nodes
+ *
+ * first reaches -2, since each tree consumes one more node than the branches
+ * it promises. Every step is at least -1, so the balance cannot skip over -2.
+ * The trees end at the dictionary when the first such k is the number of
+ * nodes before the dictionary. If the balance never reaches -2, the walk would
+ * have run into the dictionary looking for more nodes.
+ *
+ * Since nodes sit at a fixed stride, each chunk of the node region can compute
+ * its own sum and lowest running balance, under both byte orders at once,
+ * without knowing where its nodes fall in the trees. Adding up the sums of the
+ * preceding chunks then finds the chunk where the balance first reaches -2,
+ * and only that chunk is scanned again to find the exact node.
+ */
+
+typedef struct
+{
+    const char* nodes;
+    int64_t*    sums;
+    int64_t*    lowest;
+} brnflip_balance_context;
+
+/* This function computes a chunk's balance and lowest running balance under
+ * both byte orders, storing them at index chunk * 2 + assume_flipped.
+ */
+void brnflip_balance_chunk(
+    void*        context,
+    unsigned int chunk,
+    size_t       begin,
+    size_t       end
+)
+{
+    brnflip_balance_context* balance = (brnflip_balance_context*) context;
+
+    int64_t sum[2]    = { 0, 0 };
+    int64_t lowest[2] = { INT64_MAX, INT64_MAX };
+
+    const char* branch = balance->nodes +
+        begin * brnflip_tree_node_length +
+        brnflip_tree_node_length - sizeof(uint16_t);
+
+    size_t i;
+    for (i = begin; i < end; ++i) {
+        uint16_t num_branches;
+        memcpy(&num_branches, branch, sizeof(uint16_t));
+
+        sum[0] += (int64_t) num_branches - 1;
+        sum[1] += (int64_t) (uint16_t) ((num_branches >> 8) |
+            (num_branches << 8)) - 1;
+
+        if (sum[0] < lowest[0]) {
+            lowest[0] = sum[0];
+        }
+
+        if (sum[1] < lowest[1]) {
+            lowest[1] = sum[1];
+        }
+
+        branch += brnflip_tree_node_length;
+    }
+
+    balance->sums[chunk * 2]       = sum[0];
+    balance->sums[chunk * 2 + 1]   = sum[1];
+    balance->lowest[chunk * 2]     = lowest[0];
+    balance->lowest[chunk * 2 + 1] = lowest[1];
+}
+
+/* This function checks the trees under both endianesses, filling in
+ * out_infos and out_errors for assume_flipped 0 and 1 just as
+ * brnflip_walk_trees would, except that max_depth is not computed.
+ */
+void brnflip_balance_trees(
+    const char*        brain,
+    off_t              dictionary_offset,
+    unsigned int       num_threads,
+    brnflip_tree_info  out_infos[2],
+    brnflip_error      out_errors[2]
+)
+{
+    size_t num_nodes = (dictionary_offset - brnflip_header_length) /
+        brnflip_tree_node_length;
+
+    int assume_flipped;
+
+    /* A region that is not a whole number of nodes cannot end at the
+     * dictionary, and where the walk stops depends on the trees, so leave it
+     * to the walk.
+     */
+    if ((dictionary_offset - brnflip_header_length) %
+        brnflip_tree_node_length != 0) {
+        for (assume_flipped = 0; assume_flipped < 2; ++assume_flipped) {
+            out_errors[assume_flipped] = brnflip_walk_trees(
+                (char*) brain,
+                dictionary_offset,
+                assume_flipped,
+                0,
+                &out_infos[assume_flipped]
+            );
+        }
+
+        return;
+    }
+
+    unsigned int num_chunks = brnflip_parallel_chunks(num_nodes, num_threads);
+    uint64_t     start      = brnflip_stats_start();
+
+    int64_t* sums   = malloc(num_chunks * 2 * sizeof(int64_t));
+    int64_t* lowest = malloc(num_chunks * 2 * sizeof(int64_t));
+
+    if (sums == NULL || lowest == NULL) {
+        free(sums);
+        free(lowest);
+
+        num_chunks = 1;
+        sums       = NULL;
+        lowest     = NULL;
+    }
+
+    int64_t single_sums[2];
+    int64_t single_lowest[2];
+
+    brnflip_balance_context balance;
+    balance.nodes  = brain + brnflip_header_length;
+    balance.sums   = sums != NULL ? sums : single_sums;
+    balance.lowest = lowest != NULL ? lowest : single_lowest;
+
+    brnflip_parallel_for(num_nodes, num_chunks, brnflip_balance_chunk, &balance);
+
+    for (assume_flipped = 0; assume_flipped < 2; ++assume_flipped) {
+        brnflip_tree_info* info = &out_infos[assume_flipped];
+
+        int64_t      offset = 0;
+        size_t       end    = num_nodes;
+        unsigned int chunk;
+
+        memset(info, 0, sizeof(brnflip_tree_info));
+        info->error_offset = -1;
+
+        for (chunk = 0; chunk < num_chunks; ++chunk) {
+            int64_t chunk_lowest = balance.lowest[chunk * 2 + assume_flipped];
+
+            if (chunk_lowest != INT64_MAX && offset + chunk_lowest <= -2) {
+                break;
+            }
+
+            offset += balance.sums[chunk * 2 + assume_flipped];
+        }
+
+        if (chunk < num_chunks) {
+            // Find the node in this chunk where the balance reaches -2.
+            size_t i = brnflip_chunk_begin(num_nodes, num_chunks, chunk);
+
+            const char* branch = brain + brnflip_header_length +
+                i * brnflip_tree_node_length +
+                brnflip_tree_node_length - sizeof(uint16_t);
+
+            for (;; ++i, branch += brnflip_tree_node_length) {
+                uint16_t num_branches;
+                memcpy(&num_branches, branch, sizeof(uint16_t));
+
+                if (assume_flipped) {
+                    brnflip_flip_16_in_place((char*) &num_branches);
+                }
+
+                offset += (int64_t) num_branches - 1;
+
+                if (offset <= -2) {
+                    break;
+                }
+            }
+
+            end = i + 1;
+        }
+
+        info->num_nodes  = end;
+        info->end_offset = brnflip_header_length +
+            end * brnflip_tree_node_length;
+
+        if (chunk < num_chunks && end == num_nodes) {
+            out_errors[assume_flipped] = no_error;
+        } else {
+            info->error_offset         = info->end_offset;
+            out_errors[assume_flipped] = invalid_file;
+        }
+    }
+
+    free(sums);
+    free(lowest);
+
+    brnflip_stats_stop(
+        phase_walk,
+        start,
+        num_nodes * brnflip_tree_node_length,
+        num_nodes
+    );
+}
+
+brnflip_error brnflip_validate_trees_parallel(
+    const char*        brain,
+    size_t             brain_length,
+    megahal_filetype   file_type,
+    unsigned int       num_threads,
+    brnflip_tree_info* out_info
+)
+{
+    off_t dictionary_offset = 0;
+
+    brnflip_tree_info infos[2];
+    brnflip_error     errors[2];
+
+    memset(out_info, 0, sizeof(brnflip_tree_info));
+    out_info->error_offset = -1;
+
+    if (brnflip_verify_header((char*) brain, brain_length) != no_error) {
+        out_info->error_offset = 0;
+        return invalid_file;
+    }
+
+    if (brnflip_find_dictionary_offset(
+        (char*) brain,
+        brain_length,
+        &dictionary_offset,
+        NULL
+    ) != no_error) {
+        out_info->error_offset = brain_length;
+        return invalid_file;
+    }
+
+    brnflip_balance_trees(
+        brain,
+        dictionary_offset,
+        num_threads,
+        infos,
+        errors
+    );
+
+    int assume_flipped = file_type != megahal_native_endianess;
+
+    *out_info = infos[assume_flipped];
+    return errors[assume_flipped];
+}
+
 void brnflip_flip_16_in_place(char* x)
 {
     uint8_t temp = x[0];
@@ -18,10 +18,24 @@
 #ifndef __BRNFLIP_H__
 #define __BRNFLIP_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The version of the library this header belongs to. The major version changes
+ * whenever a program built against an earlier header may no longer work with
+ * the library, which is then installed under a new shared object name.
+ */
+
+#define BRNFLIP_VERSION_MAJOR 1
+#define BRNFLIP_VERSION_MINOR 0
+#define BRNFLIP_VERSION_PATCH 0
+
 typedef enum
 {
-    no_error     =  0,
-    invalid_file = -1,
+    no_error          =  0,
+    invalid_file      = -1,
+    unknown_endianess = -2,
 } brnflip_error;
 
 typedef enum
@@ -41,11 +55,111 @@ extern const megahal_filetype megahal_native_endianess;
  */
 
 brnflip_error brnflip_detect_endianess(
-    char*             brain,
+    const char*       brain,
     size_t            brain_length,
     megahal_filetype* out_file_type
 );
 
+/* How sure brnflip_quick_detect_endianess is of its answer.
+ *
+ * low_confidence means that only the dictionary length told the endianesses
+ * apart, and the sampled nodes were plausible either way. high_confidence
+ * means that the sampled nodes agreed with the dictionary length, and were
+ * implausible in the other endianess. full_confidence means that the evidence
+ * was ambiguous, so the whole brain was checked as by brnflip_detect_endianess.
+ */
+
+typedef enum
+{
+    no_confidence   = 0,
+    low_confidence  = 1,
+    high_confidence = 2,
+    full_confidence = 3
+} brnflip_confidence;
+
+/* This function detects the endianess of a brain like brnflip_detect_endianess,
+ * but from bounded evidence rather than a walk of every node: the dictionary
+ * length read in both endianesses, and the symbols of the first nodes and of
+ * nodes sampled across the node region, which must name words in the
+ * dictionary. Its cost depends on the size of the dictionary, but not on the
+ * number of nodes. Only if the evidence is ambiguous or contradictory does it
+ * fall back to the full walk, so unlike brnflip_detect_endianess, it does not
+ * find brains whose trees are damaged. The confidence of the answer is placed
+ * into out_confidence.
+ */
+
+brnflip_error brnflip_quick_detect_endianess(
+    const char*         brain,
+    size_t              brain_length,
+    megahal_filetype*   out_file_type,
+    brnflip_confidence* out_confidence
+);
+
+/* What brnflip_inspect_brain and brnflip_convert learn about a brain.
+ * detected_file_type is the endianess the brain was found in, and file_type is
+ * the endianess it is in now. dictionary_offset is the offset of the
+ * dictionary length, which follows the last tree node.
+ */
+
+typedef struct
+{
+    megahal_filetype detected_file_type;
+    megahal_filetype file_type;
+    off_t            dictionary_offset;
+    uint64_t         num_nodes;
+    uint32_t         num_words;
+    uint32_t         max_depth;
+} brnflip_brain_info;
+
+/* This function does the same work as brnflip_detect_endianess, but places
+ * everything it learns about the brain into out_info, so that later calls such
+ * as brnflip_flip_buffer_with_info do not need to scan the brain again.
+ */
+
+brnflip_error brnflip_inspect_brain(
+    const char*         brain,
+    size_t              brain_length,
+    brnflip_brain_info* out_info
+);
+
+/* This function is brnflip_inspect_brain with the trees checked by up to
+ * num_threads threads, as in brnflip_validate_trees_parallel. out_info->max_depth
+ * is not computed when more than one thread is used.
+ */
+
+brnflip_error brnflip_inspect_brain_parallel(
+    const char*         brain,
+    size_t              brain_length,
+    unsigned int        num_threads,
+    brnflip_brain_info* out_info
+);
+
+/* This function detects the endianess of a brain and, if it is not already in
+ * the target endianess, flips it in the same pass over the trees. On success,
+ * out_info describes the brain, and out_info->file_type is target. On failure,
+ * the buffer is left unchanged.
+ */
+
+brnflip_error brnflip_convert(
+    char*               brain,
+    size_t              brain_length,
+    megahal_filetype    target,
+    brnflip_brain_info* out_info
+);
+
+/* This function is brnflip_convert with the trees checked and the nodes
+ * flipped by up to num_threads threads. The trees are checked before any node
+ * is flipped, so the buffer is still left unchanged on failure.
+ */
+
+brnflip_error brnflip_convert_parallel(
+    char*               brain,
+    size_t              brain_length,
+    megahal_filetype    target,
+    unsigned int        num_threads,
+    brnflip_brain_info* out_info
+);
+
 /* This function flips the endianess of a buffer in-place. It must perform one
  * check to complete the conversion, but otherwise does not check to ensure that
  * the buffer is a valid MegaHAL brain.
@@ -56,4 +170,767 @@ brnflip_error brnflip_flip_buffer(
     size_t brain_length
 );
 
+/* This function flips a buffer in-place using the dictionary offset in info,
+ * which must have come from brnflip_inspect_brain or brnflip_convert on the
+ * same brain, without verifying the header or searching for the dictionary
+ * again. info->file_type is updated to the new endianess.
+ */
+
+brnflip_error brnflip_flip_buffer_with_info(
+    char*               brain,
+    size_t              brain_length,
+    brnflip_brain_info* info
+);
+
+/* This function flips a buffer in-place like brnflip_flip_buffer, or like
+ * brnflip_flip_buffer_with_info if info is not NULL, but splits the nodes into
+ * node-aligned chunks flipped by up to num_threads threads. Brains too small to
+ * benefit are flipped on the calling thread.
+ */
+
+brnflip_error brnflip_flip_buffer_parallel(
+    char*               brain,
+    size_t              brain_length,
+    brnflip_brain_info* info,
+    unsigned int        num_threads
+);
+
+/* This function is brnflip_flip_buffer_parallel, but writes the flipped brain
+ * to dst, which must hold brain_length bytes, and leaves src untouched, so src
+ * may be a read-only mapping of the original brain. The nodes are byte-swapped
+ * as they are copied, the dictionary is copied verbatim, and large brains are
+ * written with non-temporal stores, so that dst does not displace src from
+ * the cache. src and dst may be the same buffer, but must not otherwise
+ * overlap. If info is not NULL, it must describe src, and on success its
+ * file_type is updated to describe dst.
+ */
+
+brnflip_error brnflip_flip_copy(
+    const char*         src,
+    char*               dst,
+    size_t              brain_length,
+    brnflip_brain_info* info,
+    unsigned int        num_threads
+);
+
+/* A run of bytes within a brain. */
+
+typedef struct
+{
+    off_t  offset;
+    size_t length;
+} brnflip_range;
+
+/* This function places into out_range the bytes of the brain described by
+ * info that flipping it changes: the tree nodes and the dictionary length.
+ * The header before them and the words after them are the same in either
+ * endianess, so a converted brain can take them straight from the original.
+ * info must have come from brnflip_inspect_brain or brnflip_convert.
+ */
+
+brnflip_error brnflip_changed_range(
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    brnflip_range*            out_range
+);
+
+/* This function is brnflip_flip_copy, but writes only the range given by
+ * brnflip_changed_range, flipped, to the start of dst, which must hold its
+ * length in bytes. info is required, and on success its file_type is updated
+ * to describe the flipped brain.
+ */
+
+brnflip_error brnflip_flip_changed_copy(
+    const char*         src,
+    char*               dst,
+    size_t              brain_length,
+    brnflip_brain_info* info,
+    unsigned int        num_threads
+);
+
+/* The result of walking a brain's trees. num_nodes and max_depth cover every
+ * node visited, with the roots at depth 0. If the walk failed, error_offset is
+ * the offset of the node that extends past the end of the node region, or of
+ * the first byte left over before the dictionary. Otherwise, it is -1.
+ */
+
+typedef struct
+{
+    off_t    end_offset;
+    off_t    error_offset;
+    uint64_t num_nodes;
+    uint32_t max_depth;
+} brnflip_tree_info;
+
+/* This function walks both trees of a brain, assuming that it is in the given
+ * endianess, and checks that they end exactly at the start of the dictionary.
+ * It returns invalid_file if they do not, and fills in out_info either way.
+ */
+
+brnflip_error brnflip_validate_trees(
+    const char*        brain,
+    size_t             brain_length,
+    megahal_filetype   file_type,
+    brnflip_tree_info* out_info
+);
+
+/* This function gives the same verdict as brnflip_validate_trees, but instead
+ * of walking the trees it splits the node region between up to num_threads
+ * threads, each of which adds up the branch counts in its chunk. max_depth is
+ * not computed and is left at 0.
+ */
+
+brnflip_error brnflip_validate_trees_parallel(
+    const char*        brain,
+    size_t             brain_length,
+    megahal_filetype   file_type,
+    unsigned int       num_threads,
+    brnflip_tree_info* out_info
+);
+
+/* This function returns the name of the kernel brnflip_flip_buffer uses to
+ * flip tree nodes on this machine, such as "avx2" or "scalar". The fastest
+ * kernel the CPU supports is chosen the first time it is needed, unless the
+ * BRNFLIP_KERNEL environment variable names another supported kernel.
+ */
+
+const char* brnflip_kernel_name(void);
+
+/* Buffers
+ *
+ * Brains of many gigabytes spend much of their time in TLB misses when held
+ * in ordinary 4 KB pages. A buffer from brnflip_alloc_buffer is backed by
+ * huge pages when it is large enough for them to matter: explicit huge pages
+ * if the system has any reserved, or else transparent huge pages. Small
+ * buffers, and systems without huge pages, get ordinary memory.
+ */
+
+/* This function allocates length bytes for a brain or an index, returning
+ * NULL if it cannot. The buffer must be freed with brnflip_free_buffer, given
+ * the same length.
+ */
+
+void* brnflip_alloc_buffer(size_t length);
+
+void brnflip_free_buffer(void* buffer, size_t length);
+
+/* This function hints that a buffer or mapping is about to be read from front
+ * to back, so that the system reads ahead of it and, for a mapping of a file,
+ * drops the pages behind it early. It has no effect where there is no way to
+ * give the hint.
+ */
+
+void brnflip_advise_sequential(const void* buffer, size_t length);
+
+/* Contexts
+ *
+ * A program that converts brains over and over, such as a bot server that
+ * converts them as they are uploaded, can keep a brnflip_context for its
+ * settings and the memory the conversions need, so that each conversion does
+ * not have to allocate it again. num_threads is the most threads any one call
+ * uses, and may be changed between calls. The other fields are private to the
+ * library. A context must not be used by two threads at once.
+ */
+
+typedef struct
+{
+    unsigned int num_threads;
+    char*        scratch;
+    size_t       scratch_length;
+} brnflip_context;
+
+/* This function prepares a context that uses up to num_threads threads, or
+ * one if num_threads is 0.
+ */
+
+void brnflip_context_init(brnflip_context* context, unsigned int num_threads);
+
+/* This function frees the memory held by a context. It may be initialized
+ * again afterwards.
+ */
+
+void brnflip_context_close(brnflip_context* context);
+
+/* This function converts a brain to the target endianess without modifying
+ * it, so the brain may be in read-only memory. If the brain is already in the
+ * target endianess, *out_brain is brain itself. Otherwise, the converted brain
+ * is written into the context's scratch memory, which grows as needed, and
+ * *out_brain points there until the next call with the same context, or until
+ * it is closed. On success, out_info describes the converted brain.
+ */
+
+brnflip_error brnflip_context_convert(
+    brnflip_context*    context,
+    const char*         brain,
+    size_t              brain_length,
+    megahal_filetype    target,
+    const char**        out_brain,
+    brnflip_brain_info* out_info
+);
+
+/* One brain in a call to brnflip_flip_many. brain and brain_length are set by
+ * the caller, and info and error are filled in by the call.
+ */
+
+typedef struct
+{
+    char*              brain;
+    size_t             brain_length;
+    brnflip_brain_info info;
+    brnflip_error      error;
+} brnflip_batch_brain;
+
+/* This function converts num_brains brains in place to the target endianess,
+ * as brnflip_convert does, using up to the context's num_threads threads for
+ * all of them together. Brains large enough to be split are converted one at
+ * a time, each by all of the threads, and the rest are shared out between the
+ * threads whole, so that many small brains convert as fast as a few large
+ * ones. A brain that fails is left unchanged, with its error set, and does
+ * not stop the others. Returns invalid_file if any of the brains failed.
+ */
+
+brnflip_error brnflip_flip_many(
+    brnflip_context*     context,
+    brnflip_batch_brain* brains,
+    size_t               num_brains,
+    megahal_filetype     target
+);
+
+/* Statistics
+ *
+ * The library can time the phases of its work on a thread, for finding out
+ * where a slow conversion spent its time. The dictionary phase covers finding
+ * and counting the dictionary, the walk phase covers checking the trees,
+ * along with the nodes brnflip_convert flips as it walks them, and the flip
+ * phase covers flipping or copying the node region on its own. bytes and
+ * nodes are the amount of the brain each phase worked through.
+ */
+
+typedef enum
+{
+    phase_dictionary = 0,
+    phase_walk,
+    phase_flip,
+    num_brnflip_phases
+} brnflip_phase;
+
+typedef struct
+{
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t bytes;
+    uint64_t nodes;
+} brnflip_phase_stats;
+
+typedef struct
+{
+    brnflip_phase_stats phases[num_brnflip_phases];
+} brnflip_stats;
+
+/* This function makes the library add the phases of everything the calling
+ * thread does from now on into stats, until it is called again with NULL.
+ * Collecting is off by default, and costs nothing measurable while it is.
+ * Other threads, including the library's own workers, are not affected.
+ */
+
+void brnflip_collect_stats(brnflip_stats* stats);
+
+/* This function returns the name of a phase, such as "walk". */
+
+const char* brnflip_phase_name(brnflip_phase phase);
+
+/* Node Cursors
+ *
+ * A brnflip_cursor reads the nodes of both trees in pre-order, in the byte
+ * order of the brain, without modifying the brain or allocating memory. Each
+ * node is decoded into a brnflip_node, whose offset is that of the node in the
+ * brain and whose depth is 0 for the roots. The cursor's fields are private to
+ * the library.
+ */
+
+#define BRNFLIP_CURSOR_MAX_LEVELS 64
+#define BRNFLIP_UNKNOWN_DEPTH     UINT32_MAX
+
+typedef struct
+{
+    uint32_t depth;
+    uint16_t symbol;
+    uint32_t usage;
+    uint16_t count;
+    uint16_t branch;
+    off_t    offset;
+} brnflip_node;
+
+typedef struct
+{
+    const char*   brain;
+    off_t         position;
+    off_t         end;
+    int           flipped;
+    brnflip_error error;
+    uint32_t      trees_remaining;
+    uint64_t      pending_nodes;
+    uint32_t      depth;
+    int           depth_lost;
+    uint32_t      num_levels;
+    uint16_t      level_pending[BRNFLIP_CURSOR_MAX_LEVELS];
+    uint32_t      level_run[BRNFLIP_CURSOR_MAX_LEVELS];
+} brnflip_cursor;
+
+/* This function prepares a cursor over the trees of a brain described by
+ * info, which must have come from brnflip_inspect_brain or brnflip_convert.
+ */
+
+brnflip_error brnflip_cursor_init(
+    brnflip_cursor*           cursor,
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info
+);
+
+/* This function decodes up to max_nodes of the next nodes into out_nodes and
+ * places the number decoded into out_num_nodes, which is 0 once both trees
+ * have been read. Nodes are decoded in batches to keep the cost of each call
+ * off the cost of each node. The depth of a node is BRNFLIP_UNKNOWN_DEPTH if
+ * more than BRNFLIP_CURSOR_MAX_LEVELS of its ancestors have children still to
+ * come. If the trees turn out not to end exactly at the dictionary, the nodes
+ * before that point are returned first, and the next call returns
+ * invalid_file.
+ */
+
+brnflip_error brnflip_cursor_next(
+    brnflip_cursor* cursor,
+    brnflip_node*   out_nodes,
+    size_t          max_nodes,
+    size_t*         out_num_nodes
+);
+
+/* Receives a batch of num_nodes nodes from brnflip_visit_nodes. Returning
+ * anything but 0 stops the walk.
+ */
+typedef int (*brnflip_visit_fn)(
+    void*               context,
+    const brnflip_node* nodes,
+    size_t              num_nodes
+);
+
+/* This function runs a cursor over the trees of a brain described by info and
+ * passes every node to fn, in batches decoded on the stack.
+ */
+
+brnflip_error brnflip_visit_nodes(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    brnflip_visit_fn          fn,
+    void*                     context
+);
+
+/* Dictionary Views
+ *
+ * A brnflip_dictionary maps between symbols and the words of a brain's
+ * dictionary without copying any of them: every word it returns points into
+ * the brain, which must outlive the view. Its fields are private to the
+ * library, apart from num_words.
+ */
+
+typedef struct
+{
+    const char* words;
+    uint32_t    num_words;
+    uint32_t*   offsets;
+    uint32_t*   table;
+    uint64_t    table_mask;
+} brnflip_dictionary;
+
+/* This function builds a view of the dictionary of a brain described by info,
+ * which must have come from brnflip_inspect_brain or brnflip_convert, in one
+ * pass over the words. If hashed is set, it also builds the hash table used by
+ * brnflip_dictionary_find. The view takes one allocation for the offsets of
+ * the words, and one for the table, however many words there are. Returns
+ * invalid_file if the words do not end exactly at the end of the brain.
+ */
+
+brnflip_error brnflip_dictionary_open(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    int                       hashed,
+    brnflip_dictionary*       out_dictionary
+);
+
+/* This function returns the word for a symbol, which is not NUL-terminated,
+ * and places its length into out_length. Returns NULL if there is no such
+ * symbol.
+ */
+
+const char* brnflip_dictionary_word(
+    const brnflip_dictionary* dictionary,
+    uint32_t                  symbol,
+    size_t*                   out_length
+);
+
+/* This function looks up a word of the given length, placing its symbol into
+ * out_symbol. If the dictionary holds the word more than once, the first
+ * symbol is found. Returns 0 if the word is not in the dictionary, or if the
+ * view was opened without a hash table.
+ */
+
+int brnflip_dictionary_find(
+    const brnflip_dictionary* dictionary,
+    const char*               word,
+    size_t                    length,
+    uint32_t*                 out_symbol
+);
+
+/* This function frees a view opened by brnflip_dictionary_open. */
+
+void brnflip_dictionary_close(brnflip_dictionary* dictionary);
+
+/* Indexed Brains
+ *
+ * An index is a brain exported into a form that a bot can map and use at
+ * once, instead of parsing the trees into linked nodes on startup. Everything
+ * in it is in the byte order of the machine that wrote it. It starts with a
+ * brnflip_index_header, and every array after it starts on a multiple of
+ * BRNFLIP_INDEX_ALIGNMENT bytes:
+ *
+ * symbol, usage, count and branch hold the fields of each node, and
+ * first_child the slot of its first child. The nodes are in breadth-first
+ * order, with the roots of the two trees in slots 0 and 1, so the children of
+ * a node are the branch slots starting at first_child, sorted by symbol as in
+ * the brain.
+ *
+ * word_offsets holds num_words + 1 offsets into words, where word i starts at
+ * word_offsets[i] and is terminated by a NUL at word_offsets[i + 1] - 1.
+ */
+
+#define BRNFLIP_INDEX_ALIGNMENT 4096
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t model_order;
+    uint32_t num_words;
+    uint64_t num_nodes;
+    uint64_t brain_length;
+    uint64_t index_length;
+    uint64_t symbol_offset;
+    uint64_t usage_offset;
+    uint64_t count_offset;
+    uint64_t branch_offset;
+    uint64_t first_child_offset;
+    uint64_t word_offset_offset;
+    uint64_t words_offset;
+} brnflip_index_header;
+
+typedef struct
+{
+    const brnflip_index_header* header;
+    const uint16_t*             symbols;
+    const uint32_t*             usages;
+    const uint16_t*             counts;
+    const uint16_t*             branches;
+    const uint64_t*             first_child;
+    const uint64_t*             word_offsets;
+    const char*                 words;
+} brnflip_index;
+
+/* This function returns the length of the index brnflip_export_index makes
+ * from a brain described by info, which must have come from
+ * brnflip_inspect_brain or brnflip_convert. It returns 0 if the dictionary
+ * does not fit the brain.
+ */
+
+size_t brnflip_index_length(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info
+);
+
+/* This function writes an index of the brain described by info into index,
+ * which must hold brnflip_index_length bytes and be aligned as malloc or mmap
+ * align memory. The brain is not modified.
+ */
+
+brnflip_error brnflip_export_index(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    char*                     index
+);
+
+/* This function checks the header and dictionary of an index of index_length
+ * bytes and places pointers to its arrays into out_index. It returns
+ * invalid_file if the index is damaged or was written on a machine of the
+ * other byte order. The trees are not checked, so that opening a large index
+ * takes no time, and a reader of an untrusted index must check the
+ * first_child slots it follows against num_nodes.
+ */
+
+brnflip_error brnflip_open_index(
+    const char*    index,
+    size_t         index_length,
+    brnflip_index* out_index
+);
+
+/* This function writes the brain held by an index back out as a MegaHALv8
+ * brain in the target endianess. brain must hold index->header->brain_length
+ * bytes. Returns invalid_file if the trees in the index are damaged.
+ */
+
+brnflip_error brnflip_import_index(
+    const brnflip_index* index,
+    megahal_filetype     target,
+    char*                brain
+);
+
+/* Checksums
+ *
+ * brnflip_crc32c uses the CRC32 instruction of SSE4.2 where the CPU has it and
+ * a table elsewhere. The choice is made apart from the flip kernel's, and the
+ * BRNFLIP_CRC_KERNEL environment variable set to "table" overrides it.
+ *
+ * The fingerprint of a brain is the CRC-32C of the brain as it would be stored
+ * little-endian. It depends only on the values in the brain, so a conversion
+ * leaves it unchanged, and a brain has the same fingerprint on machines of
+ * either byte order. Checking a conversion is then a matter of comparing the
+ * fingerprint of the original with that of the copy, wherever it ends up.
+ */
+
+/* This function continues a CRC-32C, returning the checksum of everything
+ * checksummed so far followed by length bytes of data. Start with a crc of 0,
+ * which is also the checksum of nothing.
+ */
+
+uint32_t brnflip_crc32c(uint32_t crc, const char* data, size_t length);
+
+/* What brnflip_flip_buffer_checksummed learns about a brain as it flips it.
+ * input and output are the CRC-32C of the brain before and after, byte for
+ * byte, and the fingerprints are those of the brain before and after. Each
+ * fingerprint is taken from its own side's bytes, decoding the nodes without
+ * the flip kernels, so they differ if the flip damaged the brain.
+ */
+
+typedef struct
+{
+    uint32_t input;
+    uint32_t output;
+    uint32_t input_fingerprint;
+    uint32_t output_fingerprint;
+} brnflip_checksums;
+
+/* This function is brnflip_flip_buffer_parallel, but also places the
+ * checksums of the brain into out_checksums, computed as each run of nodes is
+ * flipped rather than in further passes over the brain. Without info, the
+ * byte order of the brain is not known, so the fingerprints are 0.
+ */
+
+brnflip_error brnflip_flip_buffer_checksummed(
+    char*               brain,
+    size_t              brain_length,
+    brnflip_brain_info* info,
+    unsigned int        num_threads,
+    brnflip_checksums*  out_checksums
+);
+
+/* This function places the fingerprint of the brain described by info, which
+ * must have come from brnflip_inspect_brain or brnflip_convert, into
+ * out_fingerprint, without changing the brain. The nodes of a big-endian brain
+ * are checksummed by up to num_threads threads.
+ */
+
+brnflip_error brnflip_fingerprint(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    unsigned int              num_threads,
+    uint32_t*                 out_fingerprint
+);
+
+/* Skip Indexes
+ *
+ * A skip index is a sidecar kept beside a brain that lets a reader jump to
+ * any node's children without walking the trees from the start. The nodes of
+ * a brain are numbered in the order they are stored, so node n is at offset
+ * brnflip_skip_node_offset(n). skips[n] holds the number of nodes below node
+ * n, so its first child, if it has any, is node n + 1, and every other child
+ * follows the subtree of the child before it. Like an index, a skip index is
+ * in the byte order of the machine that wrote it. It starts with a
+ * brnflip_skip_header, followed by skips at skips_offset.
+ *
+ * The header also records the offsets of the roots and the dictionary and a
+ * CRC-32C checksum of the brain, so that a brain matching it can be converted
+ * without its trees being checked again. The skips are the same in either
+ * endianess, but the checksum is not, so a converted brain needs a new index.
+ * Brains with a subtree of more than 2^32 - 1 nodes below its root cannot be
+ * indexed.
+ */
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t file_type;
+    uint32_t checksum;
+    uint32_t num_words;
+    uint32_t max_depth;
+    uint64_t brain_length;
+    uint64_t num_nodes;
+    uint64_t root_offsets[2];
+    uint64_t dictionary_offset;
+    uint64_t skips_offset;
+} brnflip_skip_header;
+
+typedef struct
+{
+    const brnflip_skip_header* header;
+    const uint32_t*            skips;
+} brnflip_skip_index;
+
+/* This function returns the length of the skip index of a brain described by
+ * info, which must have come from brnflip_inspect_brain or brnflip_convert.
+ */
+
+size_t brnflip_skip_index_length(const brnflip_brain_info* info);
+
+/* This function walks the trees of the brain described by info and writes its
+ * skip index into sidecar, which must hold brnflip_skip_index_length bytes
+ * and be aligned as malloc or mmap align memory. The brain is not modified.
+ */
+
+brnflip_error brnflip_build_skip_index(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    char*                     sidecar
+);
+
+/* This function checks the header of a skip index of sidecar_length bytes and
+ * places pointers to it into out_index. It returns invalid_file if the index
+ * is damaged or was written on a machine of the other byte order. As with
+ * brnflip_open_index, the skips themselves are not checked.
+ */
+
+brnflip_error brnflip_open_skip_index(
+    const char*         sidecar,
+    size_t              sidecar_length,
+    brnflip_skip_index* out_index
+);
+
+/* This function checks that a brain is the one a skip index was built from,
+ * by its length and checksum, and if so fills in out_info from the index, as
+ * brnflip_inspect_brain would have done by walking the trees. It costs one
+ * pass over the brain to checksum it. Returns invalid_file if the brain does
+ * not match.
+ */
+
+brnflip_error brnflip_match_skip_index(
+    const brnflip_skip_index* index,
+    const char*               brain,
+    size_t                    brain_length,
+    brnflip_brain_info*       out_info
+);
+
+/* This function returns the offset in the brain of node number node. */
+
+off_t brnflip_skip_node_offset(uint64_t node);
+
+/* This function finds the child of node with the given symbol in a brain that
+ * matches the index, hopping from child to child over their subtrees, and
+ * places its number into out_child. Brains do not always keep children sorted
+ * by symbol, so every child is checked. Returns 0 if there is no such child.
+ */
+
+int brnflip_skip_find_child(
+    const brnflip_skip_index* index,
+    const char*               brain,
+    uint64_t                  node,
+    uint16_t                  symbol,
+    uint64_t*                 out_child
+);
+
+/* Streaming Conversion
+ *
+ * The functions below convert a brain that arrives a piece at a time, such as
+ * from a pipe, using no memory beyond the caller's buffer and a
+ * brnflip_stream. The stream's fields are private to the library.
+ */
+
+#define BRNFLIP_STREAM_MAX_DEPTH 64
+
+/* The length of a tree node. Tree nodes follow a header of the same length,
+ * so data presented to brnflip_stream_convert in pieces whose lengths are
+ * multiples of it, apart from the last, is always converted whole.
+ */
+
+#define BRNFLIP_NODE_LENGTH 10
+
+typedef struct
+{
+    int      state;
+    int      source_flipped;
+    int      flip;
+    uint32_t trees_remaining;
+    uint64_t pending_nodes;
+    uint32_t depth;
+    uint32_t max_depth;
+    uint32_t depth_pending[BRNFLIP_STREAM_MAX_DEPTH];
+    uint32_t dictionary_length;
+    uint32_t words_seen;
+    uint32_t word_remaining;
+    uint64_t position;
+} brnflip_stream;
+
+/* This function determines the endianess of a brain from its first length
+ * bytes, without modifying them. If complete is set, data holds the entire
+ * brain and this is equivalent to brnflip_detect_endianess. Otherwise, the
+ * trees are parsed under both byte orders as far as the data goes, and the
+ * order under which they are consistent and shallowest is chosen. If the data
+ * does not decide the question, unknown_endianess is returned. The choice is
+ * verified once the whole brain has been seen by brnflip_stream_finish.
+ */
+
+brnflip_error brnflip_stream_detect(
+    const char*       data,
+    size_t            length,
+    int               complete,
+    megahal_filetype* out_file_type
+);
+
+/* This function prepares a stream to convert a brain in the source endianess
+ * to the target endianess. If they are the same, the brain is validated but
+ * passed through unchanged.
+ */
+
+void brnflip_stream_init(
+    brnflip_stream*  stream,
+    megahal_filetype source,
+    megahal_filetype target
+);
+
+/* This function converts as much of data as it can in place, and places the
+ * number of converted bytes, which are ready to be written out, into
+ * out_converted. Fewer than length bytes are converted only when data ends in
+ * the middle of the header, a node or the dictionary length. The caller must
+ * then present the remaining bytes again, followed by more data, on the next
+ * call. Returns invalid_file as soon as the data cannot be a MegaHAL brain.
+ */
+
+brnflip_error brnflip_stream_convert(
+    brnflip_stream* stream,
+    char*           data,
+    size_t          length,
+    size_t*         out_converted
+);
+
+/* This function checks that the stream has seen a complete brain, returning
+ * invalid_file if it was truncated or its dictionary does not match.
+ */
+
+brnflip_error brnflip_stream_finish(brnflip_stream* stream);
+
 #endif // __BRNFLIP_H__
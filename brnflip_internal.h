@@ -0,0 +1,159 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Declarations shared between the translation units of the brnflip library.
+ * Nothing in here is part of the public interface in brnflip.h, and none of it
+ * is exported from libbrnflip.so, but libbrnflip.a cannot hide it, so every
+ * name is prefixed with brnflip_ to keep clear of a program's own symbols.
+ */
+
+#ifndef __BRNFLIP_INTERNAL_H__
+#define __BRNFLIP_INTERNAL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "brnflip.h"
+
+// Constants, defined in brnflip.c
+
+extern const char*    brnflip_cookie;
+extern const size_t   brnflip_cookie_length;
+extern const char     brnflip_model_order;
+extern const off_t    brnflip_header_length;
+extern const uint32_t brnflip_num_trees;
+extern const off_t    brnflip_tree_node_length;
+extern const size_t   brnflip_first_dict_word_length;
+extern const size_t   brnflip_min_dict_length;
+extern const size_t   brnflip_min_brain_length;
+
+// Byte swapping, defined in brnflip.c
+
+void brnflip_flip_16_in_place(char* x);
+void brnflip_flip_32_in_place(char* x);
+
+// Validation, defined in brnflip.c
+
+/* Returns no_error if the brain starts with a MegaHALv8 header. */
+brnflip_error brnflip_verify_header(const char* brain, size_t brain_length);
+
+/* Places the offset of the dictionary length into dictionary_offset, found by
+ * searching backwards from the end of the brain for the first word, and the
+ * number of words counted in the dictionary found into num_words, unless it
+ * is NULL. num_words is 0 if no dictionary that fits the brain was found.
+ */
+brnflip_error brnflip_find_dictionary_offset(
+    const char* brain,
+    size_t      brain_length,
+    off_t*      dictionary_offset,
+    uint64_t*   num_words
+);
+
+// Node, search and copy kernels, defined in kernels.c
+
+/* Byte-swaps num_nodes consecutive tree nodes from src into dst. src and dst
+ * may be the same buffer, in which case the nodes are flipped in place, but
+ * they must not otherwise overlap.
+ */
+typedef void (*brnflip_node_kernel)(
+    const char* src,
+    char*       dst,
+    size_t      num_nodes
+);
+
+void brnflip_flip_nodes(const char* src, char* dst, size_t num_nodes);
+
+/* Returns the offset of the last occurrence of the 8-byte signature that
+ * starts the dictionary, "\x07<ERROR>", lying entirely within the first length
+ * bytes of data, or -1 if there is none.
+ */
+typedef off_t (*brnflip_search_kernel)(const char* data, size_t length);
+
+off_t brnflip_find_signature(const char* data, size_t length);
+
+/* Copies length bytes from src to dst like memcpy, but with non-temporal
+ * stores where the CPU has them, so that dst is not brought into the cache.
+ * The buffers must not overlap.
+ */
+typedef void (*brnflip_copy_kernel)(char* dst, const char* src, size_t length);
+
+void brnflip_copy_nontemporal(char* dst, const char* src, size_t length);
+
+/* Continues a CRC-32C, as brnflip_crc32c does. */
+typedef uint32_t (*brnflip_crc_kernel)(
+    uint32_t    crc,
+    const char* data,
+    size_t      length
+);
+
+// Statistics, defined in stats.c
+
+/* Returns the time a phase starts, or 0 if the calling thread is not
+ * collecting statistics.
+ */
+uint64_t brnflip_stats_start(void);
+
+/* Adds a phase that began at start and worked through the given bytes and
+ * nodes to the calling thread's statistics, if it is collecting them.
+ */
+void brnflip_stats_stop(
+    brnflip_phase phase,
+    uint64_t      start,
+    uint64_t      bytes,
+    uint64_t      nodes
+);
+
+// Parallel work, defined in parallel.c
+
+extern const size_t brnflip_parallel_min_nodes_per_thread;
+
+/* Processes the nodes in [begin, end), which form chunk number chunk. */
+typedef void (*brnflip_chunk_fn)(
+    void*        context,
+    unsigned int chunk,
+    size_t       begin,
+    size_t       end
+);
+
+/* Returns the number of chunks to split num_nodes nodes into for up to
+ * num_threads threads, which is 1 when the nodes are too few to be worth
+ * splitting.
+ */
+unsigned int brnflip_parallel_chunks(size_t num_nodes, unsigned int num_threads);
+
+/* Returns the index of the first node in the given chunk when num_nodes nodes
+ * are split into num_chunks chunks.
+ */
+size_t brnflip_chunk_begin(
+    size_t       num_nodes,
+    unsigned int num_chunks,
+    unsigned int chunk
+);
+
+/* Splits num_nodes nodes into num_chunks contiguous chunks and runs fn on each,
+ * spread over the calling thread and the process's pool of workers, returning
+ * once all of them have finished.
+ */
+void brnflip_parallel_for(
+    size_t           num_nodes,
+    unsigned int     num_chunks,
+    brnflip_chunk_fn fn,
+    void*            context
+);
+
+#endif // __BRNFLIP_INTERNAL_H__
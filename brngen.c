@@ -0,0 +1,165 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "brnflip.h"
+#include "generate.h"
+
+/* Writes a synthetic MegaHALv8 brain, for testing and benchmarking brnflip. */
+
+void print_usage(char* program_name);
+
+int main(int argc, char* argv[]) {
+    char* output = NULL;
+    uint64_t size = 0;
+    brngen_options options;
+
+    brngen_default_options(&options);
+
+    for (int i = 1; i < argc; ++i) {
+        uint64_t value = 0;
+
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        if (strcmp(argv[i], "-o") == 0) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--size") == 0) {
+            if (!brngen_parse_size(argv[++i], &size) || size == 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--nodes") == 0) {
+            if (!brngen_parse_size(argv[++i], &value) || value < 2) {
+                print_usage(argv[0]);
+                return 1;
+            }
+
+            options.num_nodes = value;
+        } else if (strcmp(argv[i], "--depth") == 0) {
+            options.max_depth = (uint32_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fanout") == 0) {
+            options.max_fanout = (uint32_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--distribution") == 0) {
+            ++i;
+
+            if (strcasecmp(argv[i], "uniform") == 0) {
+                options.distribution = fanout_uniform;
+            } else if (strcasecmp(argv[i], "skewed") == 0) {
+                options.distribution = fanout_skewed;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--words") == 0) {
+            options.num_words = (uint32_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--order") == 0) {
+            ++i;
+
+            if (strcasecmp(argv[i], "big") == 0) {
+                options.byte_order = big_endian;
+            } else if (strcasecmp(argv[i], "little") == 0) {
+                options.byte_order = little_endian;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            options.seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (output == NULL) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (size != 0) {
+        options.num_nodes = brngen_nodes_for_length(size, options.num_words);
+    }
+
+    size_t capacity = brngen_max_length(&options);
+    char* brain = (char*) malloc(capacity);
+
+    if (brain == NULL) {
+        fprintf(stderr, "Unable to allocate %zu bytes.\n", capacity);
+        return 1;
+    }
+
+    size_t brain_length;
+    uint64_t num_nodes;
+
+    if (brngen_generate(&options, brain, &brain_length, &num_nodes) != no_error) {
+        fprintf(stderr, "Those options do not describe a valid brain.\n");
+        free(brain);
+        return 1;
+    }
+
+    FILE* file = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
+
+    if (file == NULL) {
+        perror("Unable to open output file");
+        free(brain);
+        return 1;
+    }
+
+    size_t written = fwrite(brain, 1, brain_length, file);
+
+    if ((file != stdout && fclose(file) != 0) || written != brain_length) {
+        perror("Unable to write output file");
+        free(brain);
+        return 1;
+    }
+
+    fprintf(
+        stderr,
+        "Wrote %zu bytes with %llu nodes and %u words.\n",
+        brain_length,
+        (unsigned long long) num_nodes,
+        options.num_words
+    );
+
+    free(brain);
+    return 0;
+}
+
+void print_usage(char* program_name) {
+    printf("Usage: %s -o output [--size size | --nodes count] [--depth depth]\n", program_name);
+    printf("       [--fanout count] [--distribution uniform|skewed]\n");
+    printf("       [--words count] [--order big|little] [--seed seed]\n");
+
+    puts("Writes a synthetic MegaHALv8 brain to output, or to stdout if it is -.");
+    puts("--size is the approximate length of the brain, such as 64K, 16M or 2G.");
+    puts("--nodes sets the number of tree nodes instead. It defaults to 100000.");
+    puts("--depth is the depth of the deepest node below each root (default 6).");
+    puts("--fanout is the largest branch count drawn for a node (default 8).");
+    puts("Branch counts are raised where needed to reach the requested size.");
+    puts("--distribution is how branch counts are drawn: uniform, or skewed");
+    puts("towards leaves like a brain learned from text (the default).");
+    puts("--words is the number of dictionary words, from 2 to 65536.");
+    puts("--order is the byte order. It defaults to your machine's.");
+    puts("--seed selects a different brain of the same shape.");
+}
@@ -0,0 +1,154 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "brnflip.h"
+#include "brnflip_internal.h"
+
+#if !defined(_WIN32) && !defined(DOS)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* Buffers
+ *
+ * Huge pages are 2 MB on every system that brnflip_alloc_buffer uses them on.
+ * Buffers of at least huge_buffer_length are rounded up to a whole number of
+ * them and mapped directly, trying explicit huge pages first, which need
+ * pages reserved by the administrator and so usually fail at once. Otherwise,
+ * an ordinary mapping is aligned to a huge page by over-allocating and
+ * trimming, since the kernel only backs whole, aligned 2 MB ranges with
+ * transparent huge pages, and is then marked with MADV_HUGEPAGE. Whether a
+ * buffer was mapped follows from its length alone, which is why
+ * brnflip_free_buffer needs it.
+ */
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+#define BRNFLIP_HAVE_HUGE_PAGES 1
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static const size_t huge_page_length = (size_t) 2 << 20;
+
+// Buffers smaller than this come from malloc.
+static const size_t huge_buffer_length = (size_t) 16 << 20;
+
+static size_t brnflip_huge_length(size_t length)
+{
+    return (length + huge_page_length - 1) & ~(huge_page_length - 1);
+}
+
+static void* brnflip_map_huge(size_t length)
+{
+    // 21 is log2 of 2 MB, which pins the page size whatever the default is.
+    void* buffer = mmap(
+        NULL,
+        length,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT),
+        -1,
+        0
+    );
+
+    if (buffer != MAP_FAILED) {
+        return buffer;
+    }
+
+    char* mapping = (char*) mmap(
+        NULL,
+        length + huge_page_length,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    uintptr_t address = (uintptr_t) mapping;
+    uintptr_t aligned = (address + huge_page_length - 1) &
+        ~(uintptr_t) (huge_page_length - 1);
+    size_t    head    = aligned - address;
+
+    if (head > 0) {
+        munmap(mapping, head);
+    }
+
+    if (huge_page_length - head > 0) {
+        munmap((char*) aligned + length, huge_page_length - head);
+    }
+
+    madvise((void*) aligned, length, MADV_HUGEPAGE);
+
+    return (void*) aligned;
+}
+#endif
+
+void* brnflip_alloc_buffer(size_t length)
+{
+    #ifdef BRNFLIP_HAVE_HUGE_PAGES
+    if (length >= huge_buffer_length) {
+        return brnflip_map_huge(brnflip_huge_length(length));
+    }
+    #endif
+
+    return malloc(length > 0 ? length : 1);
+}
+
+void brnflip_free_buffer(void* buffer, size_t length)
+{
+    if (buffer == NULL) {
+        return;
+    }
+
+    #ifdef BRNFLIP_HAVE_HUGE_PAGES
+    if (length >= huge_buffer_length) {
+        munmap(buffer, brnflip_huge_length(length));
+        return;
+    }
+    #else
+    (void) length;
+    #endif
+
+    free(buffer);
+}
+
+void brnflip_advise_sequential(const void* buffer, size_t length)
+{
+    #if !defined(_WIN32) && !defined(DOS) && defined(MADV_SEQUENTIAL)
+    long page_length = sysconf(_SC_PAGESIZE);
+
+    if (page_length <= 0 || length == 0) {
+        return;
+    }
+
+    // madvise needs a page-aligned start, and advising a little more is fine.
+    uintptr_t end   = (uintptr_t) buffer + length;
+    uintptr_t start = (uintptr_t) buffer & ~(uintptr_t) (page_length - 1);
+
+    madvise((void*) start, end - start, MADV_SEQUENTIAL);
+    #else
+    (void) buffer;
+    (void) length;
+    #endif
+}
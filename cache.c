@@ -0,0 +1,334 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "brnflip.h"
+#include "cli.h"
+
+#if !defined(_WIN32) && !defined(DOS)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#endif
+
+/* The Detection Cache
+ *
+ * Once a brain file has been inspected, or written by brnflip, what was
+ * learned about it is kept in a cache_record in the user.brnflip.detection
+ * extended attribute of the file, so that later runs over the same file can
+ * trust it rather than walk the trees again. Where the filesystem has no
+ * extended attributes, the record goes to a hidden sidecar beside the brain,
+ * named .<name>.brnflip.
+ *
+ * A record only stands while the file is the one it describes: the same
+ * inode and generation, the same length and modification time, and the same
+ * CRC-32C of its first and last CACHE_SAMPLE_LENGTH bytes, which hold the
+ * first nodes and the end of the dictionary. Setting the attribute does not
+ * change the modification time, but writing the brain in any other way does.
+ */
+
+#define CACHE_SAMPLE_LENGTH 4096
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+static const char     cache_attribute[]  = "user.brnflip.detection";
+static const char     cache_magic[8]     = { 'M', 'H', 'A', 'L', 'D', 'E', 'T', '1' };
+static const uint32_t cache_byte_order   = 0x01020304;
+
+// The record is in the byte order of the machine that wrote it.
+typedef struct
+{
+    char     magic[8];
+    uint32_t byte_order;
+    uint32_t file_type;
+    uint64_t length;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    uint64_t inode;
+    uint32_t generation;
+    uint32_t checksum;
+    uint64_t dictionary_offset;
+    uint64_t num_nodes;
+    uint32_t num_words;
+    uint32_t max_depth;
+} cache_record;
+
+/* Returns the path of the sidecar for path, which must be freed, or NULL if
+ * there is no memory for it.
+ */
+static char* cache_sidecar_path(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    size_t      dir   = slash != NULL ? (size_t) (slash - path) + 1 : 0;
+    char*       name  = (char*) malloc(
+        strlen(path) + sizeof(".") + sizeof(CACHE_SIDECAR_SUFFIX)
+    );
+
+    if (name != NULL) {
+        memcpy(name, path, dir);
+        sprintf(name + dir, ".%s" CACHE_SIDECAR_SUFFIX, path + dir);
+    }
+
+    return name;
+}
+
+int cache_is_own_file(const char* name)
+{
+    size_t length = strlen(name);
+    size_t suffix = sizeof(CACHE_SIDECAR_SUFFIX) - 1;
+
+    if (name[0] != '.') {
+        return 0;
+    }
+
+    // A sidecar needs a name between its leading dot and its suffix.
+    if (length > suffix + 1 &&
+        strcmp(name + length - suffix, CACHE_SIDECAR_SUFFIX) == 0) {
+        return 1;
+    }
+
+    return strstr(name, TEMP_FILE_INFIX) != NULL;
+}
+
+/* Returns 1 if an extended attribute call failed only because the filesystem
+ * has none, so that the sidecar should be used instead.
+ */
+static int cache_unsupported(void)
+{
+    #ifdef EOPNOTSUPP
+    if (errno == EOPNOTSUPP) {
+        return 1;
+    }
+    #endif
+
+    return errno == ENOTSUP;
+}
+
+// Reads all of length bytes at offset, returning 0 on failure.
+static int cache_read_all(int fd, char* data, size_t length, off_t offset)
+{
+    while (length > 0) {
+        ssize_t count = pread(fd, data, length, offset);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            return 0;
+        }
+
+        data   += count;
+        length -= (size_t) count;
+        offset += count;
+    }
+
+    return 1;
+}
+
+/* Fills in the fields of record that identify the file open as fd, returning
+ * 0 if it could not be read.
+ */
+static int cache_identify(int fd, cache_record* record)
+{
+    struct stat file_stat;
+    char        sample[CACHE_SAMPLE_LENGTH];
+
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        return 0;
+    }
+
+    record->length     = (uint64_t) file_stat.st_size;
+    record->mtime_sec  = (int64_t) file_stat.st_mtim.tv_sec;
+    record->mtime_nsec = (int64_t) file_stat.st_mtim.tv_nsec;
+    record->inode      = (uint64_t) file_stat.st_ino;
+    record->generation = 0;
+
+    #ifdef FS_IOC_GETVERSION
+    // A filesystem that does not reuse inodes carefully has no generation.
+    int generation;
+
+    if (ioctl(fd, FS_IOC_GETVERSION, &generation) == 0) {
+        record->generation = (uint32_t) generation;
+    }
+    #endif
+
+    size_t head = record->length < CACHE_SAMPLE_LENGTH ?
+        (size_t) record->length :
+        CACHE_SAMPLE_LENGTH;
+
+    if (!cache_read_all(fd, sample, head, 0)) {
+        return 0;
+    }
+
+    record->checksum = brnflip_crc32c(0, sample, head);
+
+    if (!cache_read_all(fd, sample, head, (off_t) (record->length - head))) {
+        return 0;
+    }
+
+    record->checksum = brnflip_crc32c(record->checksum, sample, head);
+
+    return 1;
+}
+
+// Reads the record kept for path, open as fd, returning 0 if there is none.
+static int cache_load(int fd, const char* path, cache_record* record)
+{
+    #ifdef __linux__
+    ssize_t length = fgetxattr(fd, cache_attribute, record, sizeof(cache_record));
+
+    if (length >= 0 || !cache_unsupported()) {
+        return length == (ssize_t) sizeof(cache_record);
+    }
+    #else
+    (void) fd;
+    #endif
+
+    char* sidecar_path = cache_sidecar_path(path);
+
+    if (sidecar_path == NULL) {
+        return 0;
+    }
+
+    FILE* sidecar = fopen(sidecar_path, "rb");
+    free(sidecar_path);
+
+    if (sidecar == NULL) {
+        return 0;
+    }
+
+    int loaded = fread(record, sizeof(cache_record), 1, sidecar) == 1;
+
+    fclose(sidecar);
+    return loaded;
+}
+
+// Keeps record for path, open as fd, doing nothing if it cannot.
+static void cache_save(int fd, const char* path, const cache_record* record)
+{
+    #ifdef __linux__
+    if (fsetxattr(fd, cache_attribute, record, sizeof(cache_record), 0) == 0 ||
+        !cache_unsupported()) {
+        return;
+    }
+    #else
+    (void) fd;
+    #endif
+
+    char* sidecar_path = cache_sidecar_path(path);
+
+    if (sidecar_path == NULL) {
+        return;
+    }
+
+    FILE* sidecar = fopen(sidecar_path, "wb");
+
+    // A sidecar cut short would only fail to load.
+    if (sidecar != NULL) {
+        fwrite(record, sizeof(cache_record), 1, sidecar);
+        fclose(sidecar);
+    }
+
+    free(sidecar_path);
+}
+
+int cache_lookup(const char* path, brnflip_brain_info* out_info)
+{
+    cache_record stored;
+    cache_record current;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    int found = cache_load(fd, path, &stored) && cache_identify(fd, &current);
+
+    close(fd);
+
+    if (!found ||
+        memcmp(stored.magic, cache_magic, sizeof(cache_magic)) != 0 ||
+        stored.byte_order != cache_byte_order ||
+        (stored.file_type != big_endian && stored.file_type != little_endian) ||
+        stored.length != current.length ||
+        stored.mtime_sec != current.mtime_sec ||
+        stored.mtime_nsec != current.mtime_nsec ||
+        stored.inode != current.inode ||
+        stored.generation != current.generation ||
+        stored.checksum != current.checksum ||
+        stored.dictionary_offset > stored.length) {
+        return 0;
+    }
+
+    memset(out_info, 0, sizeof(brnflip_brain_info));
+
+    out_info->detected_file_type = (megahal_filetype) stored.file_type;
+    out_info->file_type          = out_info->detected_file_type;
+    out_info->dictionary_offset  = (off_t) stored.dictionary_offset;
+    out_info->num_nodes          = stored.num_nodes;
+    out_info->num_words          = stored.num_words;
+    out_info->max_depth          = stored.max_depth;
+
+    return 1;
+}
+
+void cache_store(const char* path, const brnflip_brain_info* info)
+{
+    cache_record record;
+
+    if (info->file_type != big_endian && info->file_type != little_endian) {
+        return;
+    }
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return;
+    }
+
+    memset(&record, 0, sizeof(cache_record));
+
+    if (cache_identify(fd, &record)) {
+        memcpy(record.magic, cache_magic, sizeof(cache_magic));
+
+        record.byte_order        = cache_byte_order;
+        record.file_type         = (uint32_t) info->file_type;
+        record.dictionary_offset = (uint64_t) info->dictionary_offset;
+        record.num_nodes         = info->num_nodes;
+        record.num_words         = info->num_words;
+        record.max_depth         = info->max_depth;
+
+        cache_save(fd, path, &record);
+    }
+
+    close(fd);
+}
+
+#endif
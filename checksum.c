@@ -0,0 +1,506 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "brnflip.h"
+#include "brnflip_internal.h"
+
+/* Checksummed Flips
+ *
+ * The node region is checksummed a run of CHECKSUM_RUN_NODES nodes at a time,
+ * small enough to stay in the L1 cache: the run is checksummed as it was,
+ * flipped, and checksummed again as it now is, so neither checksum costs
+ * another pass over memory. Each chunk of a parallel flip checksums its own
+ * nodes, and the chunks' checksums are joined in order by
+ * brnflip_crc32c_combine. The words of the dictionary are the same before and
+ * after, so they are checksummed once and joined onto every checksum.
+ *
+ * A fingerprint is the checksum of the little-endian form of a brain. The
+ * fingerprint of a little-endian brain is just its checksum. The nodes of a
+ * big-endian one are decoded a field at a time with explicit big-endian
+ * loads into a scratch buffer on the stack, little-endian, and checksummed
+ * from there. The decoding never goes through the node kernels, so the
+ * fingerprints of the two sides of a flip are computed independently of the
+ * kernel that flipped it, and only match if it flipped every node correctly.
+ */
+
+#define CHECKSUM_RUN_NODES 400
+
+// The reflected CRC-32C polynomial.
+#define CRC32C_POLYNOMIAL 0x82f63b78
+
+typedef struct
+{
+    brnflip_checksums checksums;
+    size_t            length;
+} brnflip_chunk_checksums;
+
+/* dst is NULL when the nodes are only checksummed, not flipped. src_big and
+ * dst_big are set for a side that is big-endian, and so must be decoded to
+ * take its fingerprint.
+ */
+typedef struct
+{
+    const char*              src;
+    char*                    dst;
+    int                      src_big;
+    int                      dst_big;
+    brnflip_chunk_checksums* chunks;
+} brnflip_checksum_context;
+
+static uint32_t brnflip_gf2_times(const uint32_t* matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+
+    while (vector != 0) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+
+        vector >>= 1;
+        ++matrix;
+    }
+
+    return sum;
+}
+
+static void brnflip_gf2_square(uint32_t* square, const uint32_t* matrix)
+{
+    int n;
+    for (n = 0; n < 32; ++n) {
+        square[n] = brnflip_gf2_times(matrix, matrix[n]);
+    }
+}
+
+/* Returns the checksum of two runs of data joined together, given the
+ * checksum of each and the length of the second, by applying length2 zero
+ * bytes to crc1 with a matrix squared once per bit of the length, as zlib's
+ * crc32_combine does.
+ */
+static uint32_t brnflip_crc32c_combine(
+    uint32_t crc1,
+    uint32_t crc2,
+    size_t   length2
+)
+{
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    if (length2 == 0) {
+        return crc1;
+    }
+
+    // The operator for one zero bit.
+    odd[0] = CRC32C_POLYNOMIAL;
+
+    uint32_t row = 1;
+
+    int n;
+    for (n = 1; n < 32; ++n) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    // Two zero bits, then four.
+    brnflip_gf2_square(even, odd);
+    brnflip_gf2_square(odd, even);
+
+    // Each pass squares the operator again, for a byte, then two, and so on.
+    do {
+        brnflip_gf2_square(even, odd);
+
+        if (length2 & 1) {
+            crc1 = brnflip_gf2_times(even, crc1);
+        }
+
+        length2 >>= 1;
+
+        if (length2 == 0) {
+            break;
+        }
+
+        brnflip_gf2_square(odd, even);
+
+        if (length2 & 1) {
+            crc1 = brnflip_gf2_times(odd, crc1);
+        }
+
+        length2 >>= 1;
+    } while (length2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+/* Writes num_nodes big-endian nodes from src into dst in little-endian, a
+ * field at a time with explicit loads and stores. This is deliberately not
+ * brnflip_flip_nodes, so that a fingerprint checks the node kernels rather
+ * than trusting them.
+ */
+static void brnflip_decode_big_endian(
+    const char* src,
+    char*       dst,
+    size_t      num_nodes
+)
+{
+    const unsigned char* in  = (const unsigned char*) src;
+    unsigned char*       out = (unsigned char*) dst;
+
+    size_t i;
+    for (i = 0; i < num_nodes; ++i) {
+        uint16_t symbol = (uint16_t) (in[0] << 8 | in[1]);
+        uint32_t usage  = (uint32_t) in[2] << 24 | (uint32_t) in[3] << 16 |
+                          (uint32_t) in[4] << 8  | (uint32_t) in[5];
+        uint16_t count  = (uint16_t) (in[6] << 8 | in[7]);
+        uint16_t branch = (uint16_t) (in[8] << 8 | in[9]);
+
+        out[0] = (unsigned char) symbol;
+        out[1] = (unsigned char) (symbol >> 8);
+        out[2] = (unsigned char) usage;
+        out[3] = (unsigned char) (usage >> 8);
+        out[4] = (unsigned char) (usage >> 16);
+        out[5] = (unsigned char) (usage >> 24);
+        out[6] = (unsigned char) count;
+        out[7] = (unsigned char) (count >> 8);
+        out[8] = (unsigned char) branch;
+        out[9] = (unsigned char) (branch >> 8);
+
+        in  += BRNFLIP_NODE_LENGTH;
+        out += BRNFLIP_NODE_LENGTH;
+    }
+}
+
+/* Continues the fingerprint crc with the dictionary length at length, which is
+ * big-endian if big is set, as a little-endian value.
+ */
+static uint32_t brnflip_fingerprint_length(
+    uint32_t    crc,
+    const char* length,
+    int         big
+)
+{
+    const unsigned char* in = (const unsigned char*) length;
+    unsigned char        out[sizeof(uint32_t)];
+
+    int i;
+    for (i = 0; i < 4; ++i) {
+        out[i] = big ? in[3 - i] : in[i];
+    }
+
+    return brnflip_crc32c(crc, (const char*) out, sizeof(out));
+}
+
+/* Flips and checksums one chunk of the node region, a run at a time. */
+static void brnflip_checksum_chunk(
+    void*        context,
+    unsigned int chunk,
+    size_t       begin,
+    size_t       end
+)
+{
+    brnflip_checksum_context* checksum = (brnflip_checksum_context*) context;
+    brnflip_checksums*        sums     = &checksum->chunks[chunk].checksums;
+
+    char        run[CHECKSUM_RUN_NODES * BRNFLIP_NODE_LENGTH];
+    const char* src       = checksum->src + begin * brnflip_tree_node_length;
+    char*       dst       = NULL;
+    size_t      num_nodes = end - begin;
+
+    memset(sums, 0, sizeof(brnflip_checksums));
+
+    if (checksum->dst != NULL) {
+        dst = checksum->dst + begin * brnflip_tree_node_length;
+    }
+
+    while (num_nodes > 0) {
+        size_t run_nodes = num_nodes < CHECKSUM_RUN_NODES ?
+            num_nodes :
+            CHECKSUM_RUN_NODES;
+        size_t length    = run_nodes * brnflip_tree_node_length;
+
+        // In place, src is about to be overwritten.
+        if (dst != NULL) {
+            sums->input = brnflip_crc32c(sums->input, src, length);
+        }
+
+        if (checksum->src_big) {
+            brnflip_decode_big_endian(src, run, run_nodes);
+            sums->input_fingerprint = brnflip_crc32c(
+                sums->input_fingerprint,
+                run,
+                length
+            );
+        }
+
+        if (dst != NULL) {
+            brnflip_flip_nodes(src, dst, run_nodes);
+            sums->output = brnflip_crc32c(sums->output, dst, length);
+
+            if (checksum->dst_big) {
+                brnflip_decode_big_endian(dst, run, run_nodes);
+                sums->output_fingerprint = brnflip_crc32c(
+                    sums->output_fingerprint,
+                    run,
+                    length
+                );
+            }
+
+            dst += length;
+        }
+
+        src       += length;
+        num_nodes -= run_nodes;
+    }
+
+    checksum->chunks[chunk].length = (end - begin) * brnflip_tree_node_length;
+}
+
+/* Flips, or with dst NULL only checksums, the nodes from src, which end at
+ * dictionary_offset, on up to num_threads threads. The checksums and
+ * fingerprints of the nodes as they were and as they are flipped are joined
+ * onto those in sums. Returns invalid_file if memory for the chunks cannot be
+ * allocated.
+ */
+static brnflip_error brnflip_checksum_nodes(
+    const char*        src,
+    char*              dst,
+    off_t              dictionary_offset,
+    int                src_big,
+    int                dst_big,
+    unsigned int       num_threads,
+    brnflip_checksums* sums
+)
+{
+    size_t       num_nodes  = (dictionary_offset - brnflip_header_length) /
+        brnflip_tree_node_length;
+    unsigned int num_chunks = brnflip_parallel_chunks(num_nodes, num_threads);
+
+    brnflip_checksum_context context;
+    context.src     = src + brnflip_header_length;
+    context.dst     = dst != NULL ? dst + brnflip_header_length : NULL;
+    context.src_big = src_big;
+    context.dst_big = dst_big;
+    context.chunks  = (brnflip_chunk_checksums*) calloc(
+        num_chunks,
+        sizeof(brnflip_chunk_checksums)
+    );
+
+    if (context.chunks == NULL) {
+        return invalid_file;
+    }
+
+    uint64_t start = brnflip_stats_start();
+
+    brnflip_parallel_for(
+        num_nodes,
+        num_chunks,
+        brnflip_checksum_chunk,
+        &context
+    );
+
+    unsigned int i;
+    for (i = 0; i < num_chunks; ++i) {
+        const brnflip_checksums* chunk  = &context.chunks[i].checksums;
+        size_t                   length = context.chunks[i].length;
+
+        sums->input = brnflip_crc32c_combine(sums->input, chunk->input, length);
+        sums->output = brnflip_crc32c_combine(sums->output, chunk->output, length);
+        sums->input_fingerprint = brnflip_crc32c_combine(
+            sums->input_fingerprint,
+            chunk->input_fingerprint,
+            length
+        );
+        sums->output_fingerprint = brnflip_crc32c_combine(
+            sums->output_fingerprint,
+            chunk->output_fingerprint,
+            length
+        );
+    }
+
+    brnflip_stats_stop(
+        phase_flip,
+        start,
+        num_nodes * brnflip_tree_node_length,
+        num_nodes
+    );
+
+    free(context.chunks);
+    return no_error;
+}
+
+brnflip_error brnflip_flip_buffer_checksummed(
+    char*               brain,
+    size_t              brain_length,
+    brnflip_brain_info* info,
+    unsigned int        num_threads,
+    brnflip_checksums*  out_checksums
+)
+{
+    off_t dictionary_offset = 0;
+
+    memset(out_checksums, 0, sizeof(brnflip_checksums));
+
+    if (info == NULL) {
+        brnflip_error return_code = brnflip_verify_header(
+            brain,
+            brain_length
+        );
+
+        return_code = return_code || brnflip_find_dictionary_offset(
+            brain,
+            brain_length,
+            &dictionary_offset,
+            NULL
+        );
+
+        if (return_code != no_error) {
+            return invalid_file;
+        }
+    } else {
+        dictionary_offset = info->dictionary_offset;
+
+        if (dictionary_offset < brnflip_header_length ||
+            (size_t) dictionary_offset + brnflip_min_dict_length >
+                brain_length) {
+            return invalid_file;
+        }
+    }
+
+    if ((dictionary_offset - brnflip_header_length) %
+        brnflip_tree_node_length != 0) {
+        return invalid_file;
+    }
+
+    // Without info, the fingerprints are never used.
+    int src_big = info != NULL && info->file_type == big_endian;
+    int dst_big = info != NULL && info->file_type == little_endian;
+
+    brnflip_checksums sums;
+    sums.input              = brnflip_crc32c(0, brain, brnflip_header_length);
+    sums.output             = sums.input;
+    sums.input_fingerprint  = sums.input;
+    sums.output_fingerprint = sums.input;
+
+    if (brnflip_checksum_nodes(
+            brain,
+            brain,
+            dictionary_offset,
+            src_big,
+            dst_big,
+            num_threads,
+            &sums
+        ) != no_error) {
+        return invalid_file;
+    }
+
+    char*  num_words = brain + dictionary_offset;
+    off_t  words     = dictionary_offset + sizeof(uint32_t);
+    size_t length    = brain_length - words;
+
+    sums.input = brnflip_crc32c(sums.input, num_words, sizeof(uint32_t));
+    sums.input_fingerprint = brnflip_fingerprint_length(
+        sums.input_fingerprint,
+        num_words,
+        src_big
+    );
+
+    brnflip_flip_32_in_place(num_words);
+
+    sums.output = brnflip_crc32c(sums.output, num_words, sizeof(uint32_t));
+    sums.output_fingerprint = brnflip_fingerprint_length(
+        sums.output_fingerprint,
+        num_words,
+        dst_big
+    );
+
+    uint32_t dictionary = brnflip_crc32c(0, brain + words, length);
+
+    out_checksums->input  = brnflip_crc32c_combine(sums.input, dictionary, length);
+    out_checksums->output = brnflip_crc32c_combine(sums.output, dictionary, length);
+
+    if (info != NULL) {
+        // A little-endian side's fingerprint is its own checksum.
+        out_checksums->input_fingerprint = src_big ?
+            brnflip_crc32c_combine(sums.input_fingerprint, dictionary, length) :
+            out_checksums->input;
+        out_checksums->output_fingerprint = dst_big ?
+            brnflip_crc32c_combine(sums.output_fingerprint, dictionary, length) :
+            out_checksums->output;
+
+        info->file_type = info->file_type == big_endian ?
+            little_endian :
+            big_endian;
+    }
+
+    return no_error;
+}
+
+brnflip_error brnflip_fingerprint(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    unsigned int              num_threads,
+    uint32_t*                 out_fingerprint
+)
+{
+    off_t dictionary_offset = info->dictionary_offset;
+
+    *out_fingerprint = 0;
+
+    if (dictionary_offset < brnflip_header_length ||
+        (size_t) dictionary_offset + brnflip_min_dict_length > brain_length ||
+        (dictionary_offset - brnflip_header_length) %
+            brnflip_tree_node_length != 0 ||
+        (info->file_type != big_endian && info->file_type != little_endian)) {
+        return invalid_file;
+    }
+
+    if (info->file_type == little_endian) {
+        *out_fingerprint = brnflip_crc32c(0, brain, brain_length);
+        return no_error;
+    }
+
+    brnflip_checksums sums;
+    memset(&sums, 0, sizeof(brnflip_checksums));
+    sums.input_fingerprint = brnflip_crc32c(0, brain, brnflip_header_length);
+
+    if (brnflip_checksum_nodes(
+            brain,
+            NULL,
+            dictionary_offset,
+            1,
+            0,
+            num_threads,
+            &sums
+        ) != no_error) {
+        return invalid_file;
+    }
+
+    off_t    words       = dictionary_offset + sizeof(uint32_t);
+    uint32_t fingerprint = brnflip_fingerprint_length(
+        sums.input_fingerprint,
+        brain + dictionary_offset,
+        1
+    );
+
+    fingerprint = brnflip_crc32c(fingerprint, brain + words, brain_length - words);
+
+    *out_fingerprint = fingerprint;
+    return no_error;
+}
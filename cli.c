@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 
 #ifdef MINGW
@@ -27,22 +28,185 @@
 #endif
 
 #include "brnflip.h"
+#include "cli.h"
 
 #if defined(WIN32) || defined(DOS)
 #define strcasecmp stricmp
 #endif
 
+#if !defined(_WIN32) && !defined(DOS)
+#define BRNFLIP_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define STREAM_BUFFER_LENGTH (1 << 20)
+
+// The defaults for --window, in megabytes, and --queue-depth.
+#define PIPELINE_WINDOW_MB   16
+#define PIPELINE_QUEUE_DEPTH 4
+
 #ifndef EOVERFLOW
 #define EOVERFLOW E2BIG
 #endif
 
+// Seeks that reach past 2 GB, which long cannot on every system.
+#if defined(_WIN32)
+#define file_seek _fseeki64
+#define file_tell _ftelli64
+#elif defined(DOS)
+#define file_seek fseek
+#define file_tell ftell
+#else
+#define file_seek fseeko
+#define file_tell ftello
+#endif
+
 void print_usage(char* program_name);
 
+void print_stats(
+    const cli_stats* stats,
+    const char*      input,
+    const char*      output,
+    int              result
+);
+
+void print_json_string(const char* text);
+
+brnflip_error convert_copy(
+    const char*         brain,
+    size_t              brain_length,
+    const cli_options*  options,
+    char**              out_changed_bytes,
+    brnflip_range*      out_changed,
+    brnflip_brain_info* out_info
+);
+
+int write_output(const char* output, const char* buffer, size_t brain_length);
+
+char* read_input(FILE* f, const char* input, size_t* out_length);
+
+char* load_input(const char* input, size_t* out_length, int* out_mapped);
+
+void unload_input(char* brain, size_t brain_length, int mapped);
+
+int quick_detect(const char* input);
+
+int export_index(
+    const char*        input,
+    const char*        output,
+    int                skips,
+    const cli_options* options
+);
+
+int recall_info(
+    const char*         brain,
+    size_t              brain_length,
+    const cli_options*  options,
+    brnflip_brain_info* out_info
+);
+
+brnflip_error flip_with_info(
+    char*               buffer,
+    size_t              brain_length,
+    const cli_options*  options,
+    brnflip_brain_info* info
+);
+
+int print_fingerprint(const char* input, unsigned int num_threads);
+
+void print_checksums(const brnflip_checksums* checksums, int force);
+
+int import_index(
+    const char*        input,
+    const char*        output,
+    const cli_options* options
+);
+
+int convert_buffered(
+    const char*        input,
+    const char*        output,
+    const cli_options* options
+);
+
+int convert_streaming(
+    const char*        input,
+    const char*        output,
+    const cli_options* options
+);
+
+int convert(
+    const char*        input,
+    const char*        output,
+    int                use_mmap,
+    size_t             window_length,
+    unsigned int       queue_depth,
+    const cli_options* options
+);
+
+int run_cli(int argc, char* argv[], char** paths);
+
+#ifdef BRNFLIP_HAVE_MMAP
+int same_file(const char* input, const char* output);
+
+int stat_stream(const char* path, int std_fd, struct stat* out_stat);
+
+int convert_mapped(
+    const char*        input,
+    const char*        output,
+    const cli_options* options,
+    int                in_place,
+    int*               out_result
+);
+#endif
+
 int main(int argc, char* argv[]) {
+    char** paths = (char**) calloc(argc, sizeof(char*));
+
+    if (paths == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+    int result = run_cli(argc, argv, paths);
+
+    free(paths);
+    return result;
+}
+
+/* Parses the command line and carries it out, collecting every path named on
+ * it into paths, which has room for argc of them.
+ */
+int run_cli(int argc, char* argv[], char** paths) {
     char* input = NULL;
     char* output = NULL;
     megahal_filetype target = unknown_filetype;
     int force = 0;
+    int use_mmap = 0;
+    int pipelined = 0;
+    unsigned int window_mb = 0;
+    unsigned int queue_depth = 0;
+    unsigned int num_threads = 1;
+    int quick = 0;
+    int fingerprint = 0;
+    int checksum = 0;
+    stats_format stats_format = stats_off;
+    int batch = 0;
+    int watch = 0;
+    char* socket_path = NULL;
+    unsigned int debounce_ms = 500;
+    int debounce_set = 0;
+    int exporting = 0;
+    int exporting_skips = 0;
+    char* skips_path = NULL;
+    int no_cache = 0;
+    int importing = 0;
+    int recursive = 0;
+    unsigned int num_jobs = 0;
+    int num_paths = 0;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-o") == 0) {
@@ -82,23 +246,135 @@ int main(int argc, char* argv[]) {
             }
         } else if(strcmp(argv[i], "--force") == 0) {
             force = 1;
+        } else if(strcmp(argv[i], "--mmap") == 0) {
+            use_mmap = 1;
+        } else if(strcmp(argv[i], "--pipeline") == 0) {
+            pipelined = 1;
+        } else if(strcmp(argv[i], "--window") == 0) {
+            if (i + 1 >= argc || window_mb != 0 || atoi(argv[i + 1]) < 1) {
+                print_usage(argv[0]);
+                return 0;
+            } else {
+                ++i;
+                window_mb = (unsigned int) atoi(argv[i]);
+            }
+        } else if(strcmp(argv[i], "--queue-depth") == 0) {
+            if (i + 1 >= argc || queue_depth != 0 || atoi(argv[i + 1]) < 2) {
+                print_usage(argv[0]);
+                return 0;
+            } else {
+                ++i;
+                queue_depth = (unsigned int) atoi(argv[i]);
+            }
+        } else if(strcmp(argv[i], "--stats") == 0) {
+            stats_format = stats_text;
+        } else if(strcmp(argv[i], "--stats-json") == 0) {
+            stats_format = stats_json;
+        } else if(strcmp(argv[i], "--quick-detect") == 0) {
+            quick = 1;
+        } else if(strcmp(argv[i], "--fingerprint") == 0) {
+            fingerprint = 1;
+        } else if(strcmp(argv[i], "--checksum") == 0) {
+            checksum = 1;
+        } else if(strcmp(argv[i], "--export-index") == 0) {
+            exporting = 1;
+        } else if(strcmp(argv[i], "--export-skips") == 0) {
+            exporting_skips = 1;
+        } else if(strcmp(argv[i], "--skips") == 0) {
+            if (i + 1 >= argc || skips_path != NULL) {
+                print_usage(argv[0]);
+                return 0;
+            } else {
+                ++i;
+                skips_path = argv[i];
+            }
+        } else if(strcmp(argv[i], "--no-cache") == 0) {
+            no_cache = 1;
+        } else if(strcmp(argv[i], "--import-index") == 0) {
+            importing = 1;
+        } else if(strcmp(argv[i], "--batch") == 0) {
+            batch = 1;
+        } else if(strcmp(argv[i], "--watch") == 0) {
+            watch = 1;
+        } else if(strcmp(argv[i], "--socket") == 0) {
+            if (i + 1 >= argc || socket_path != NULL) {
+                print_usage(argv[0]);
+                return 0;
+            } else {
+                ++i;
+                socket_path = argv[i];
+            }
+        } else if(strcmp(argv[i], "--debounce") == 0) {
+            if (i + 1 >= argc || debounce_set || atoi(argv[i + 1]) < 0) {
+                print_usage(argv[0]);
+                return 0;
+            } else {
+                ++i;
+                debounce_ms  = (unsigned int) atoi(argv[i]);
+                debounce_set = 1;
+            }
+        } else if(strcmp(argv[i], "--recursive") == 0) {
+            recursive = 1;
+        } else if(strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                print_usage(argv[0]);
+                return 0;
+            } else {
+                ++i;
+                num_jobs = (unsigned int) atoi(argv[i]);
+            }
+        } else if(strcmp(argv[i], "--threads") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                print_usage(argv[0]);
+                return 0;
+            } else {
+                ++i;
+                num_threads = (unsigned int) atoi(argv[i]);
+            }
         } else if (strcmp(argv[i], "--help") == 0) {
             print_usage(argv[0]);
             return 0;
         } else {
-            if (input != NULL) {
-                print_usage(argv[0]);
-                return 0;
-            } else {
+            if (input == NULL) {
                 input = argv[i];
             }
+
+            paths[num_paths++] = argv[i];
         }
     }
 
+    // Only --batch and --watch take more than one path, wherever they appear.
+    if ((num_paths > 1 && !batch && !watch) ||
+        ((batch || watch) && (output != NULL || stats_format != stats_off)) ||
+        (watch && (batch || exporting || exporting_skips || importing ||
+                   num_paths == 0)) ||
+        (!watch && (socket_path != NULL || debounce_set)) ||
+        (!pipelined && (window_mb != 0 || queue_depth != 0)) ||
+        (pipelined && (use_mmap || batch || watch || exporting ||
+                       exporting_skips || importing)) ||
+        ((exporting || exporting_skips || importing) &&
+         (output == NULL || batch ||
+          exporting + exporting_skips + importing != 1)) ||
+        (skips_path != NULL && (batch || watch || exporting ||
+                                exporting_skips || importing)) ||
+        (checksum && (use_mmap || pipelined || batch || watch || exporting ||
+                      exporting_skips || importing))) {
+        print_usage(argv[0]);
+        return 0;
+    }
+
     if (input == NULL) {
         input = "megahal.brn";
     }
 
+    if (quick) {
+        return quick_detect(input);
+    }
+
+    if (fingerprint) {
+        return print_fingerprint(input, num_threads);
+    }
+
     if (output == NULL) {
         output = "megahal.brn";
     }
@@ -111,14 +387,469 @@ int main(int argc, char* argv[]) {
         #endif
     }
 
-    FILE* f = fopen(input, "rb");
+    if (force != 1) {
+        #if !BYTE_ORDER == BIG_ENDIAN && !BYTE_ORDER == LITTLE_ENDIAN
+        perror("Your machine appears to be neither big nor little-endian.\n");
+        perror("This program will only run on big or little-endian machines.\n");
+        perror("You can use the --force option to force a conversion.\n");
+        perror("This will only convert between big and little-endian.\n");
+        return 0;
+        #endif
+    }
+
+    cli_options options;
+    options.target      = target;
+    options.force       = force;
+    options.num_threads = num_threads;
+    options.stats       = NULL;
+    options.skips       = NULL;
+    options.checksums   = NULL;
+    options.cache       = !no_cache;
+    options.cached      = NULL;
+
+    if (batch) {
+        return convert_batch(paths, num_paths, recursive, num_jobs, &options);
+    }
+
+    if (watch) {
+        return convert_watch(
+            paths,
+            num_paths,
+            recursive,
+            num_jobs,
+            debounce_ms,
+            socket_path,
+            &options
+        );
+    }
+
+    cli_stats stats;
+
+    if (stats_format != stats_off) {
+        memset(&stats, 0, sizeof(cli_stats));
+        stats.format  = stats_format;
+        options.stats = &stats;
+        stats.start   = stats_start(&options);
+
+        brnflip_collect_stats(&stats.library);
+    }
+
+    int               result        = 0;
+    size_t            window_length = 0;
+    brnflip_checksums checksums;
+
+    if (checksum) {
+        memset(&checksums, 0, sizeof(brnflip_checksums));
+        options.checksums = &checksums;
+    }
+
+    brnflip_skip_index skips;
+    size_t             skips_length = 0;
+    int                skips_mapped = 0;
+    char*              sidecar      = NULL;
+
+    if (skips_path != NULL) {
+        sidecar = load_input(skips_path, &skips_length, &skips_mapped);
+
+        if (sidecar == NULL) {
+            return 1;
+        }
+
+        if (brnflip_open_skip_index(sidecar, skips_length, &skips) != no_error) {
+            fprintf(stderr, "Skip index is damaged: %s\n", skips_path);
+            unload_input(sidecar, skips_length, skips_mapped);
+            return 1;
+        }
+
+        options.skips = &skips;
+    }
+
+    if (pipelined) {
+        window_mb     = window_mb > 0 ? window_mb : PIPELINE_WINDOW_MB;
+        window_length = (size_t) window_mb << 20;
+        queue_depth   = queue_depth > 0 ? queue_depth : PIPELINE_QUEUE_DEPTH;
+    }
+
+    if (exporting || exporting_skips) {
+        result = export_index(input, output, exporting_skips, &options);
+    } else if (importing) {
+        result = import_index(input, output, &options);
+    } else {
+        result = convert(
+            input,
+            output,
+            use_mmap,
+            window_length,
+            queue_depth,
+            &options
+        );
+    }
+
+    if (options.checksums != NULL && result == 0) {
+        print_checksums(&checksums, force);
+    }
+
+    if (options.stats != NULL) {
+        brnflip_collect_stats(NULL);
+        print_stats(&stats, input, output, result);
+    }
+
+    if (sidecar != NULL) {
+        unload_input(sidecar, skips_length, skips_mapped);
+    }
+
+    return result;
+}
+
+/* Converts input to output by whichever of the ways below suits them,
+ * returning 0 on success. A window_length other than 0 asks for
+ * convert_pipelined, which is not used in place, where convert_mapped only
+ * writes back what changed. A brain the detection cache knows to be in the
+ * target endianess already is not even opened to be converted in place.
+ */
+int convert(
+    const char*        input,
+    const char*        output,
+    int                use_mmap,
+    size_t             window_length,
+    unsigned int       queue_depth,
+    const cli_options* options
+)
+{
+    // Compressed brains are converted on the fly, never whole in memory.
+    int compressed = compression_of_file(input) != compression_none ||
+        compression_for_extension(output) != compression_none;
+
+    #ifdef BRNFLIP_HAVE_MMAP
+    int in_place = same_file(input, output);
+
+    if (compressed && in_place) {
+        fprintf(stderr, "A compressed brain cannot be converted in place: %s\n", input);
+        return 1;
+    }
+    #endif
+
+    if (strcmp(input, "-") == 0 || strcmp(output, "-") == 0 || compressed) {
+        if (options->checksums != NULL) {
+            fprintf(stderr, "Checksums are not computed while streaming: %s\n", input);
+            return 1;
+        }
+
+        return convert_streaming(input, output, options);
+    }
+
+    #ifdef BRNFLIP_HAVE_MMAP
+    int                result;
+    brnflip_brain_info cached;
+    cli_options        cached_options;
+
+    if (options->cache && options->force != 1 && cache_lookup(input, &cached)) {
+        if (in_place && cached.file_type == options->target &&
+            options->checksums == NULL) {
+            fputs("Conversion completed successfully.\n", stderr);
+            return 0;
+        }
+
+        cached_options        = *options;
+        cached_options.cached = &cached;
+        options               = &cached_options;
+    }
+
+    if (window_length > 0 && !in_place &&
+        convert_pipelined(
+            input,
+            output,
+            window_length,
+            queue_depth,
+            options,
+            &result
+        )) {
+        return result;
+    }
+
+    if ((use_mmap || in_place) &&
+        convert_mapped(input, output, options, in_place, &result)) {
+        return result;
+    }
+    #endif
+
+    return convert_buffered(input, output, options);
+}
+
+brnflip_error convert_buffer(
+    char*               buffer,
+    size_t              brain_length,
+    const cli_options*  options,
+    int*                flipped,
+    brnflip_range*      out_changed,
+    brnflip_brain_info* out_info
+)
+{
+    brnflip_error      error;
+    brnflip_range      changed;
+    brnflip_brain_info info;
+
+    *flipped = 0;
+    memset(&info, 0, sizeof(brnflip_brain_info));
+
+    // Without the dictionary offset, any byte may have changed.
+    changed.offset = 0;
+    changed.length = brain_length;
+
+    if (options->force == 1 && options->checksums != NULL) {
+        error = brnflip_flip_buffer_checksummed(
+            buffer,
+            brain_length,
+            NULL,
+            options->num_threads,
+            options->checksums
+        );
+        *flipped = error == no_error;
+    } else if (options->force == 1) {
+        error = brnflip_flip_buffer_parallel(
+            buffer,
+            brain_length,
+            NULL,
+            options->num_threads
+        );
+        *flipped = error == no_error;
+    } else {
+        // Checksums are taken as the nodes are flipped, not as they are walked.
+        if (recall_info(buffer, brain_length, options, &info)) {
+            error = flip_with_info(buffer, brain_length, options, &info);
+        } else if (options->checksums != NULL) {
+            error = brnflip_inspect_brain_parallel(
+                buffer,
+                brain_length,
+                options->num_threads,
+                &info
+            );
+
+            if (error == no_error) {
+                error = flip_with_info(buffer, brain_length, options, &info);
+            }
+        } else {
+            error = brnflip_convert_parallel(
+                buffer,
+                brain_length,
+                options->target,
+                options->num_threads,
+                &info
+            );
+        }
+
+        *flipped = error == no_error && info.file_type != info.detected_file_type;
+
+        if (!*flipped) {
+            changed.length = 0;
+        } else if (brnflip_changed_range(brain_length, &info, &changed)) {
+            changed.offset = 0;
+            changed.length = brain_length;
+        }
+    }
+
+    if (out_changed != NULL) {
+        *out_changed = changed;
+    }
+
+    if (out_info != NULL) {
+        *out_info = info;
+    }
+
+    return error;
+}
+
+/* Flips a brain described by info if it is not in the target endianess,
+ * computing the checksums asked for by --checksum, if any, as it goes. A brain
+ * that needs no flipping is only checksummed.
+ */
+brnflip_error flip_with_info(
+    char*               buffer,
+    size_t              brain_length,
+    const cli_options*  options,
+    brnflip_brain_info* info
+)
+{
+    brnflip_checksums* checksums = options->checksums;
+
+    if (info->file_type != options->target && checksums != NULL) {
+        return brnflip_flip_buffer_checksummed(
+            buffer,
+            brain_length,
+            info,
+            options->num_threads,
+            checksums
+        );
+    } else if (info->file_type != options->target) {
+        return brnflip_flip_buffer_parallel(
+            buffer,
+            brain_length,
+            info,
+            options->num_threads
+        );
+    } else if (checksums == NULL) {
+        return no_error;
+    }
+
+    checksums->input  = brnflip_crc32c(0, buffer, brain_length);
+    checksums->output = checksums->input;
+
+    brnflip_error error = brnflip_fingerprint(
+        buffer,
+        brain_length,
+        info,
+        options->num_threads,
+        &checksums->input_fingerprint
+    );
+
+    checksums->output_fingerprint = checksums->input_fingerprint;
+
+    return error;
+}
+
+/* Fills in out_info from the detection cache, or from the skip index given by
+ * --skips if the brain matches it, returning 1 so that the trees need not be
+ * walked again. Returns 0 otherwise, and the brain is then inspected as usual.
+ */
+int recall_info(
+    const char*         brain,
+    size_t              brain_length,
+    const cli_options*  options,
+    brnflip_brain_info* out_info
+)
+{
+    if (options->cached != NULL) {
+        *out_info = *options->cached;
+        return 1;
+    }
+
+    return options->skips != NULL &&
+        brnflip_match_skip_index(
+            options->skips,
+            brain,
+            brain_length,
+            out_info
+        ) == no_error;
+}
+
+/* Converts a brain that must not be modified. The bytes that change are
+ * flipped into a new buffer, which is placed into *out_changed_bytes and must
+ * be freed, and where they belong in the brain is placed into *out_changed.
+ * With force, that is the whole brain. If the brain needs no flipping,
+ * *out_changed_bytes is NULL and the range is empty. What was learned about
+ * the brain, once converted, is placed into *out_info, which is cleared with
+ * force.
+ */
+brnflip_error convert_copy(
+    const char*         brain,
+    size_t              brain_length,
+    const cli_options*  options,
+    char**              out_changed_bytes,
+    brnflip_range*      out_changed,
+    brnflip_brain_info* out_info
+)
+{
+    brnflip_brain_info info;
+    brnflip_error      error;
+
+    *out_changed_bytes  = NULL;
+    out_changed->offset = 0;
+    out_changed->length = 0;
+    memset(out_info, 0, sizeof(brnflip_brain_info));
+
+    if (options->force != 1) {
+        error = recall_info(brain, brain_length, options, &info) ?
+            no_error :
+            brnflip_inspect_brain_parallel(
+                brain,
+                brain_length,
+                options->num_threads,
+                &info
+            );
+
+        if (error != no_error) {
+            return error;
+        }
+
+        if (info.file_type == options->target) {
+            *out_info = info;
+            return no_error;
+        }
+
+        error = brnflip_changed_range(brain_length, &info, out_changed);
+
+        if (error != no_error) {
+            return error;
+        }
+    } else {
+        out_changed->length = brain_length;
+    }
+
+    char* changed_bytes = (char*) brnflip_alloc_buffer(out_changed->length);
+
+    if (changed_bytes == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the output.\n");
+        return invalid_file;
+    }
+
+    if (options->force != 1) {
+        error = brnflip_flip_changed_copy(
+            brain,
+            changed_bytes,
+            brain_length,
+            &info,
+            options->num_threads
+        );
+    } else {
+        error = brnflip_flip_copy(
+            brain,
+            changed_bytes,
+            brain_length,
+            NULL,
+            options->num_threads
+        );
+    }
+
+    if (error != no_error) {
+        brnflip_free_buffer(changed_bytes, out_changed->length);
+        return error;
+    }
+
+    if (options->force != 1) {
+        *out_info = info;
+    }
+
+    *out_changed_bytes = changed_bytes;
+    return no_error;
+}
+
+/* Writes a converted brain to the output file, returning 0 on failure. */
+int write_output(const char* output, const char* buffer, size_t brain_length)
+{
+    FILE* f = fopen(output, "wb");
 
     if (f == NULL) {
-        fprintf(stderr, "Unable to open input file: %s\n", input);
+        fprintf(stderr, "Unable to open output file: %s\n", output);
         return 0;
     }
 
-    if (fseek(f, 0, SEEK_END) < 0) {
+    size_t written = brain_length > 0 ? fwrite(buffer, brain_length, 1, f) : 1;
+
+    if (fclose(f) != 0 || written != 1) {
+        fprintf(stderr, "Unable to write output file: %s\n", output);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Reads the whole of an open input file into a buffer from
+ * brnflip_alloc_buffer, placing its length into *out_length. Returns NULL,
+ * having printed why, if it cannot be read.
+ */
+char* read_input(FILE* f, const char* input, size_t* out_length)
+{
+    if (file_seek(f, 0, SEEK_END) != 0) {
         if (errno == EOVERFLOW) {
             fprintf(stderr, "The input file is too large: %s\n", input);
         } else if (errno == ESPIPE) {
@@ -126,63 +857,1088 @@ int main(int argc, char* argv[]) {
         } else {
             fprintf(stderr, "Unknown error opening input file: %s\n", input);
         }
+
+        return NULL;
     }
 
-    long brainLen = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char* buffer = (char*) malloc(brainLen);
-    fread(buffer, brainLen, 1, f);
-    fclose(f);
+    int64_t length = (int64_t) file_tell(f);
 
-    brnflip_error error;
+    if (length <= 0 || file_seek(f, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Unable to read input file: %s\n", input);
+        return NULL;
+    }
 
-    if (force == 1) {
-        error = brnflip_flip_buffer(buffer, brainLen);
-    }else{
-        #if !BYTE_ORDER == BIG_ENDIAN && !BYTE_ORDER == LITTLE_ENDIAN
-        perror("Your machine appears to be neither big nor little-endian.\n");
-        perror("This program will only run on big or little-endian machines.\n");
-        perror("You can use the --force option to force a conversion.\n");
-        perror("This will only convert between big and little-endian.\n");
-        return 0;
-        #else
-        megahal_filetype endianess;
-        error = brnflip_detect_endianess(buffer, brainLen, &endianess);
-        if (endianess != target) {
-            error = brnflip_flip_buffer(buffer, brainLen);
-        }
-        #endif
+    if ((uint64_t) length > SIZE_MAX) {
+        fprintf(stderr, "The input file is too large: %s\n", input);
+        return NULL;
     }
 
-    switch (error) {
-        case no_error:
+    size_t brain_length = (size_t) length;
+    char*  brain        = (char*) brnflip_alloc_buffer(brain_length);
+
+    if (brain == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the input: %s\n", input);
+        return NULL;
+    }
+
+    // A single fread of many gigabytes may come back short, so loop.
+    size_t done = 0;
+
+    while (done < brain_length) {
+        size_t count = fread(brain + done, 1, brain_length - done, f);
+
+        if (count == 0) {
             break;
+        }
 
-        case invalid_file:
-            fprintf(stderr, "Input file does not appear to be a brain: %s\n", input);
-            return 0;
+        done += count;
     }
 
-    f = fopen(output, "wb");
+    if (done != brain_length) {
+        fprintf(stderr, "Unable to read input file: %s\n", input);
+        brnflip_free_buffer(brain, brain_length);
+        return NULL;
+    }
 
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open output file: %s\n", output);
-        return 0;
+    *out_length = brain_length;
+    return brain;
+}
+
+/* Maps the input file read-only where possible, or else reads it into memory,
+ * placing its length into *out_length and whether it was mapped into
+ * *out_mapped. Returns NULL, having printed why, if it cannot be read.
+ */
+char* load_input(const char* input, size_t* out_length, int* out_mapped)
+{
+    char*  brain        = NULL;
+    size_t brain_length = 0;
+
+    *out_mapped = 0;
+
+    #ifdef BRNFLIP_HAVE_MMAP
+    struct stat input_stat;
+
+    int fd = open(input, O_RDONLY);
+
+    if (fd >= 0 &&
+        fstat(fd, &input_stat) == 0 &&
+        S_ISREG(input_stat.st_mode) &&
+        input_stat.st_size > 0 &&
+        (uintmax_t) input_stat.st_size <= SIZE_MAX) {
+        brain_length = (size_t) input_stat.st_size;
+        brain = mmap(NULL, brain_length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (brain == MAP_FAILED) {
+            brain = NULL;
+        } else {
+            brnflip_advise_sequential(brain, brain_length);
+            *out_mapped = 1;
+        }
     }
 
-    fwrite(buffer, brainLen, 1, f);
-    fclose(f);
+    if (fd >= 0) {
+        close(fd);
+    }
+    #endif
 
-    perror("Conversion completed successfully.\n");
-    return 0;
+    if (brain == NULL) {
+        FILE* f = fopen(input, "rb");
+
+        if (f == NULL) {
+            fprintf(stderr, "Unable to open input file: %s\n", input);
+            return NULL;
+        }
+
+        brain = read_input(f, input, &brain_length);
+        fclose(f);
+
+        if (brain == NULL) {
+            return NULL;
+        }
+    }
+
+    *out_length = brain_length;
+    return brain;
+}
+
+/* Releases an input file loaded by load_input. */
+void unload_input(char* brain, size_t brain_length, int mapped)
+{
+    #ifdef BRNFLIP_HAVE_MMAP
+    if (mapped) {
+        munmap(brain, brain_length);
+        return;
+    }
+    #endif
+
+    brnflip_free_buffer(brain, brain_length);
+}
+
+/* Detects the endianess of the input file with brnflip_quick_detect_endianess
+ * and prints it along with the confidence of the answer, returning 1 if the
+ * file is not a brain. Where possible, the file is mapped rather than read, so
+ * that only the pages holding the evidence are touched.
+ */
+int quick_detect(const char* input)
+{
+    static const char* confidences[] = { "no", "low", "high", "full" };
+
+    size_t brain_length;
+    int    mapped;
+    char*  brain = load_input(input, &brain_length, &mapped);
+
+    if (brain == NULL) {
+        return 1;
+    }
+
+    megahal_filetype   file_type;
+    brnflip_confidence confidence;
+
+    brnflip_error error = brnflip_quick_detect_endianess(
+        brain,
+        brain_length,
+        &file_type,
+        &confidence
+    );
+
+    unload_input(brain, brain_length, mapped);
+
+    if (error != no_error) {
+        fprintf(stderr, "Input file does not appear to be a brain: %s\n", input);
+        return 1;
+    }
+
+    printf(
+        "%s: %s endian, %s confidence\n",
+        input,
+        file_type == big_endian ? "big" : "little",
+        confidences[confidence]
+    );
+
+    return 0;
+}
+
+/* Prints the fingerprint of the input, which is the same in either
+ * endianess, along with the CRC-32C of its bytes. Returns 0 on success and 1
+ * on failure.
+ */
+int print_fingerprint(const char* input, unsigned int num_threads)
+{
+    size_t brain_length;
+    int    mapped;
+    char*  brain = load_input(input, &brain_length, &mapped);
+
+    if (brain == NULL) {
+        return 1;
+    }
+
+    brnflip_brain_info info;
+    uint32_t           fingerprint = 0;
+
+    brnflip_error error = brnflip_inspect_brain_parallel(
+        brain,
+        brain_length,
+        num_threads,
+        &info
+    );
+
+    error = error || brnflip_fingerprint(
+        brain,
+        brain_length,
+        &info,
+        num_threads,
+        &fingerprint
+    );
+
+    uint32_t crc = brnflip_crc32c(0, brain, brain_length);
+
+    unload_input(brain, brain_length, mapped);
+
+    if (error != no_error) {
+        fprintf(stderr, "Input file does not appear to be a brain: %s\n", input);
+        return 1;
+    }
+
+    printf("%s: fingerprint %08x, CRC-32C %08x\n", input, fingerprint, crc);
+
+    return 0;
+}
+
+/* Prints the checksums taken by --checksum. With force, the endianess of the
+ * brain was never known, so neither was its fingerprint.
+ */
+void print_checksums(const brnflip_checksums* checksums, int force)
+{
+    if (!force) {
+        printf("Input fingerprint:  %08x\n", checksums->input_fingerprint);
+        printf("Output fingerprint: %08x\n", checksums->output_fingerprint);
+    }
+
+    printf("Input CRC-32C:      %08x\n", checksums->input);
+    printf("Output CRC-32C:     %08x\n", checksums->output);
+}
+
+/* Writes an index of the input brain to the output file with
+ * brnflip_export_index, or its skip index with brnflip_build_skip_index if
+ * skips is set. Returns 0 on success and 1 on failure.
+ */
+int export_index(
+    const char*        input,
+    const char*        output,
+    int                skips,
+    const cli_options* options
+)
+{
+    size_t   brain_length;
+    int      mapped;
+    uint64_t start = stats_start(options);
+    char*    brain = load_input(input, &brain_length, &mapped);
+
+    if (brain == NULL) {
+        return 1;
+    }
+
+    stats_stop(options, cli_phase_read, start, brain_length);
+    start = stats_start(options);
+
+    brnflip_brain_info info;
+    char*              index        = NULL;
+    size_t             index_length = 0;
+
+    brnflip_error error = brnflip_inspect_brain_parallel(
+        brain,
+        brain_length,
+        options->num_threads,
+        &info
+    );
+
+    if (error == no_error) {
+        index_length = skips ?
+            brnflip_skip_index_length(&info) :
+            brnflip_index_length(brain, brain_length, &info);
+        error = index_length == 0 ? invalid_file : no_error;
+    }
+
+    if (error == no_error) {
+        index = (char*) brnflip_alloc_buffer(index_length);
+
+        if (index == NULL) {
+            fprintf(stderr, "Unable to allocate memory for the index.\n");
+            unload_input(brain, brain_length, mapped);
+            return 1;
+        }
+
+        error = skips ?
+            brnflip_build_skip_index(brain, brain_length, &info, index) :
+            brnflip_export_index(brain, brain_length, &info, index);
+    }
+
+    stats_stop(options, cli_phase_convert, start, brain_length);
+
+    unload_input(brain, brain_length, mapped);
+
+    if (error != no_error) {
+        fprintf(stderr, "Input file does not appear to be a brain: %s\n", input);
+        brnflip_free_buffer(index, index_length);
+        return 1;
+    }
+
+    start = stats_start(options);
+
+    int written = write_output(output, index, index_length);
+    brnflip_free_buffer(index, index_length);
+
+    stats_stop(options, cli_phase_write, start, index_length);
+
+    if (!written) {
+        return 1;
+    }
+
+    fputs("Export completed successfully.\n", stderr);
+    return 0;
+}
+
+/* Writes the brain held by the input index to the output file in the target
+ * endianess with brnflip_import_index. Returns 0 on success and 1 on failure.
+ */
+int import_index(
+    const char*        input,
+    const char*        output,
+    const cli_options* options
+)
+{
+    size_t        index_length;
+    int           mapped;
+    char*         brain        = NULL;
+    size_t        brain_length = 0;
+    brnflip_index index;
+
+    uint64_t start = stats_start(options);
+    char*    data  = load_input(input, &index_length, &mapped);
+
+    if (data == NULL) {
+        return 1;
+    }
+
+    stats_stop(options, cli_phase_read, start, index_length);
+    start = stats_start(options);
+
+    brnflip_error error = brnflip_open_index(data, index_length, &index);
+
+    if (error == no_error &&
+        index.header->brain_length <= SIZE_MAX) {
+        brain_length = (size_t) index.header->brain_length;
+        brain        = (char*) brnflip_alloc_buffer(brain_length);
+    }
+
+    if (error == no_error && brain == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the brain.\n");
+        unload_input(data, index_length, mapped);
+        return 1;
+    }
+
+    if (error == no_error) {
+        error = brnflip_import_index(&index, options->target, brain);
+    }
+
+    stats_stop(
+        options,
+        cli_phase_convert,
+        start,
+        error == no_error ? brain_length : 0
+    );
+
+    unload_input(data, index_length, mapped);
+
+    if (error != no_error) {
+        fprintf(stderr, "Input file does not appear to be an index: %s\n", input);
+        brnflip_free_buffer(brain, brain_length);
+        return 1;
+    }
+
+    start = stats_start(options);
+
+    int written = write_output(output, brain, brain_length);
+    brnflip_free_buffer(brain, brain_length);
+
+    stats_stop(options, cli_phase_write, start, brain_length);
+
+    if (!written) {
+        return 1;
+    }
+
+    fputs("Import completed successfully.\n", stderr);
+    return 0;
+}
+
+/* Reads the whole input file into memory, converts it, and writes it back out
+ * to the output file. Returns 0 on success and 1 on failure.
+ */
+int convert_buffered(
+    const char*        input,
+    const char*        output,
+    const cli_options* options
+)
+{
+    uint64_t start = stats_start(options);
+    FILE*    f     = fopen(input, "rb");
+
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open input file: %s\n", input);
+        return 1;
+    }
+
+    size_t brainLen;
+    char*  buffer = read_input(f, input, &brainLen);
+
+    if (buffer == NULL) {
+        fclose(f);
+        return 1;
+    }
+
+    stats_stop(options, cli_phase_read, start, brainLen);
+    start = stats_start(options);
+
+    int                flipped;
+    brnflip_range      changed;
+    brnflip_brain_info info;
+    brnflip_error      error = convert_buffer(
+        buffer,
+        brainLen,
+        options,
+        &flipped,
+        &changed,
+        &info
+    );
+
+    stats_stop(options, cli_phase_convert, start, brainLen);
+
+    switch (error) {
+        case no_error:
+            break;
+
+        case invalid_file:
+        case unknown_endianess:
+            fprintf(stderr, "Input file does not appear to be a brain: %s\n", input);
+            fclose(f);
+            brnflip_free_buffer(buffer, brainLen);
+            return 1;
+    }
+
+    start = stats_start(options);
+
+    // The input is still open, so the unchanged bytes can come from it.
+    #ifdef BRNFLIP_HAVE_MMAP
+    int written = same_file(input, output) ?
+        write_output(output, buffer, brainLen) :
+        write_regions(
+            fileno(f),
+            output,
+            buffer,
+            brainLen,
+            &changed,
+            buffer + changed.offset
+        );
+    if (written && options->cache) {
+        cache_store(output, &info);
+    }
+    #else
+    int written = write_output(output, buffer, brainLen);
+    #endif
+
+    stats_stop(options, cli_phase_write, start, brainLen);
+
+    if (written) {
+        fputs("Conversion completed successfully.\n", stderr);
+    }
+
+    fclose(f);
+    brnflip_free_buffer(buffer, brainLen);
+    return !written;
+}
+
+/* Converts a brain through a fixed-size buffer, so that memory use does not
+ * depend on the size of the brain and either end may be a pipe. An input or
+ * output of "-" means stdin or stdout. A gzip or zstd input is decompressed on
+ * the way in, and an output ending in .gz or .zst is compressed on the way
+ * out, so the uncompressed brain is never held in memory or written to disk.
+ * The endianess is detected from the first buffer's worth of data. Returns 0
+ * on success and 1 on failure, which may be discovered only after part of the
+ * output has been written, in which case a regular output file is removed.
+ */
+int convert_streaming(
+    const char*        input,
+    const char*        output,
+    const cli_options* options
+)
+{
+    brain_file* in  = NULL;
+    brain_file* out = NULL;
+
+    char* buffer = (char*) malloc(STREAM_BUFFER_LENGTH);
+
+    if (buffer == NULL) {
+        fprintf(stderr, "Unable to allocate the stream buffer.\n");
+        return 1;
+    }
+
+    uint64_t start = stats_start(options);
+
+    in = brain_file_open_read(input);
+
+    if (in == NULL) {
+        fprintf(stderr, "Unable to open input file: %s\n", input);
+        free(buffer);
+        return 1;
+    }
+
+    size_t filled = brain_file_read(in, buffer, STREAM_BUFFER_LENGTH);
+    int    at_end = filled < STREAM_BUFFER_LENGTH;
+
+    stats_stop(options, cli_phase_read, start, filled);
+    start = stats_start(options);
+
+    megahal_filetype source;
+    brnflip_error error = brnflip_stream_detect(
+        buffer,
+        filled,
+        at_end,
+        &source
+    );
+
+    stats_stop(options, cli_phase_convert, start, 0);
+
+    if (brain_file_failed(in)) {
+        fprintf(stderr, "Unable to read input file: %s\n", input);
+        error = invalid_file;
+    } else if (error == unknown_endianess) {
+        fprintf(stderr, "Unable to determine the endianess of: %s\n", input);
+        fprintf(stderr, "Try converting it from a regular file instead.\n");
+    } else if (error != no_error) {
+        fprintf(stderr, "Input file does not appear to be a brain: %s\n", input);
+    }
+
+    int remove_output = 0;
+    int write_failed  = 0;
+
+    #ifdef BRNFLIP_HAVE_MMAP
+    struct stat input_stat;
+    struct stat output_stat;
+
+    // Opening the output truncates it, which would lose the brain being read.
+    if (error == no_error &&
+        stat_stream(input, STDIN_FILENO, &input_stat) == 0 &&
+        stat_stream(output, STDOUT_FILENO, &output_stat) == 0 &&
+        S_ISREG(input_stat.st_mode) &&
+        input_stat.st_dev == output_stat.st_dev &&
+        input_stat.st_ino == output_stat.st_ino) {
+        fprintf(stderr, "The output is the same file as the input: %s\n", output);
+        error = invalid_file;
+    }
+    #endif
+
+    if (error == no_error) {
+        out = brain_file_open_write(
+            output,
+            strcmp(output, "-") == 0 ?
+                compression_none : compression_for_extension(output)
+        );
+
+        if (out == NULL) {
+            fprintf(stderr, "Unable to open output file: %s\n", output);
+            error = invalid_file;
+        }
+
+        #ifdef BRNFLIP_HAVE_MMAP
+        remove_output = out != NULL && strcmp(output, "-") != 0 &&
+            stat(output, &output_stat) == 0 && S_ISREG(output_stat.st_mode);
+        #endif
+    }
+
+    if (error == no_error) {
+        brnflip_stream stream;
+
+        megahal_filetype target = options->target;
+
+        if (options->force == 1) {
+            target = source == big_endian ? little_endian : big_endian;
+        }
+
+        brnflip_stream_init(&stream, source, target);
+
+        for (;;) {
+            size_t converted;
+
+            start = stats_start(options);
+            error = brnflip_stream_convert(&stream, buffer, filled, &converted);
+            stats_stop(options, cli_phase_convert, start, converted);
+
+            if (error != no_error) {
+                break;
+            }
+
+            start = stats_start(options);
+
+            int written = brain_file_write(out, buffer, converted);
+
+            stats_stop(options, cli_phase_write, start, converted);
+
+            if (!written) {
+                write_failed = 1;
+                break;
+            }
+
+            filled -= converted;
+            memmove(buffer, buffer + converted, filled);
+
+            if (at_end) {
+                break;
+            }
+
+            size_t wanted = STREAM_BUFFER_LENGTH - filled;
+
+            start = stats_start(options);
+
+            size_t read = brain_file_read(in, buffer + filled, wanted);
+
+            stats_stop(options, cli_phase_read, start, read);
+
+            filled += read;
+            at_end  = read == 0 || read < wanted;
+        }
+
+        if (write_failed) {
+            fprintf(stderr, "Unable to write output file: %s\n", output);
+            error = invalid_file;
+        } else if (error == no_error && filled == 0 && !brain_file_failed(in)) {
+            error = brnflip_stream_finish(&stream);
+        } else if (error == no_error) {
+            error = invalid_file;
+        }
+
+        if (error != no_error && !write_failed) {
+            fprintf(stderr, "Input file does not appear to be a brain: %s\n", input);
+        }
+    }
+
+    brain_file_close(in);
+
+    // Closing the output finishes any compressed stream and flushes it.
+    start = stats_start(options);
+
+    if (out != NULL && !brain_file_close(out) && !write_failed) {
+        fprintf(stderr, "Unable to write output file: %s\n", output);
+        error = invalid_file;
+    }
+
+    stats_stop(options, cli_phase_write, start, 0);
+
+    free(buffer);
+
+    if (error != no_error) {
+        // Part of a brain is no use to anyone.
+        if (remove_output) {
+            remove(output);
+        }
+
+        return 1;
+    }
+
+    fputs("Conversion completed successfully.\n", stderr);
+    return 0;
+}
+
+#ifdef BRNFLIP_HAVE_MMAP
+
+/* Returns 1 if both paths name the same existing file. */
+int same_file(const char* input, const char* output)
+{
+    struct stat input_stat;
+    struct stat output_stat;
+
+    if (stat(input, &input_stat) != 0 || stat(output, &output_stat) != 0) {
+        return 0;
+    }
+
+    return input_stat.st_dev == output_stat.st_dev &&
+           input_stat.st_ino == output_stat.st_ino;
+}
+
+/* Fills in out_stat for path, or for std_fd if path is "-". Returns 0 on
+ * success, as stat does.
+ */
+int stat_stream(const char* path, int std_fd, struct stat* out_stat)
+{
+    if (strcmp(path, "-") == 0) {
+        return fstat(std_fd, out_stat);
+    }
+
+    return stat(path, out_stat);
+}
+
+/* Converts the input file through a memory mapping rather than reading it into
+ * a buffer. When converting in place, the mapping is shared with the file, so
+ * only the pages holding tree nodes are dirtied and written back, and nothing
+ * at all is written if the brain is already in the target endianess.
+ * Otherwise, the mapping is read-only, only the bytes that change are flipped
+ * into a separate buffer by convert_copy, and write_regions takes the rest of
+ * the output straight from the input file.
+ *
+ * Returns 0 without touching anything if the input cannot be mapped, in which
+ * case the caller should fall back to convert_buffered. Otherwise returns 1
+ * and sets *out_result to 0 on success and 1 on failure.
+ */
+int convert_mapped(
+    const char*        input,
+    const char*        output,
+    const cli_options* options,
+    int                in_place,
+    int*               out_result
+)
+{
+    struct stat input_stat;
+    uint64_t    start = stats_start(options);
+
+    int fd = open(input, in_place ? O_RDWR : O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    if (fstat(fd, &input_stat) != 0 ||
+        !S_ISREG(input_stat.st_mode) ||
+        input_stat.st_size <= 0 ||
+        (uintmax_t) input_stat.st_size > SIZE_MAX) {
+        close(fd);
+        return 0;
+    }
+
+    size_t brain_length = (size_t) input_stat.st_size;
+
+    char* brain = mmap(
+        NULL,
+        brain_length,
+        in_place ? PROT_READ | PROT_WRITE : PROT_READ,
+        in_place ? MAP_SHARED : MAP_PRIVATE,
+        fd,
+        0
+    );
+
+    if (brain == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    brnflip_advise_sequential(brain, brain_length);
+
+    // The pages are only read once they are touched, so this is mostly setup.
+    stats_stop(options, cli_phase_read, start, brain_length);
+    start = stats_start(options);
+
+    int                flipped;
+    char*              changed_bytes = NULL;
+    brnflip_range      changed;
+    brnflip_brain_info info;
+    brnflip_error      error;
+
+    if (in_place) {
+        error = convert_buffer(
+            brain,
+            brain_length,
+            options,
+            &flipped,
+            NULL,
+            &info
+        );
+    } else {
+        error = convert_copy(
+            brain,
+            brain_length,
+            options,
+            &changed_bytes,
+            &changed,
+            &info
+        );
+    }
+
+    stats_stop(options, cli_phase_convert, start, brain_length);
+
+    switch (error) {
+        case no_error:
+            break;
+
+        case invalid_file:
+        case unknown_endianess:
+            fprintf(stderr, "Input file does not appear to be a brain: %s\n", input);
+            munmap(brain, brain_length);
+            close(fd);
+            *out_result = 1;
+            return 1;
+    }
+
+    start = stats_start(options);
+
+    int written = in_place || write_regions(
+        fd,
+        output,
+        brain,
+        brain_length,
+        &changed,
+        changed_bytes
+    );
+
+    brnflip_free_buffer(changed_bytes, changed.length);
+
+    // Unmapping writes back the pages flipped in place.
+    munmap(brain, brain_length);
+    close(fd);
+
+    if (written && options->cache) {
+        cache_store(output, &info);
+    }
+
+    stats_stop(options, cli_phase_write, start, brain_length);
+
+    if (written) {
+        fputs("Conversion completed successfully.\n", stderr);
+    }
+
+    *out_result = !written;
+    return 1;
+}
+
+#endif // BRNFLIP_HAVE_MMAP
+
+/* Returns the monotonic clock in nanoseconds. */
+uint64_t clock_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Returns the time for a phase started now, or 0 if --stats was not given, in
+ * which case the clock is never read.
+ */
+uint64_t stats_start(const cli_options* options)
+{
+    return options->stats == NULL ? 0 : clock_now();
+}
+
+/* Adds the time since start and the bytes it handled to a phase. */
+void stats_stop(
+    const cli_options* options,
+    cli_phase          phase,
+    uint64_t           start,
+    uint64_t           bytes
+)
+{
+    if (options->stats == NULL || start == 0) {
+        return;
+    }
+
+    brnflip_phase_stats* phase_stats = &options->stats->phases[phase];
+
+    phase_stats->calls       += 1;
+    phase_stats->nanoseconds += clock_now() - start;
+    phase_stats->bytes       += bytes;
+}
+
+/* Prints a JSON string literal, escaping what JSON requires. */
+void print_json_string(const char* text)
+{
+    fputc('"', stderr);
+
+    for (; *text != '\0'; ++text) {
+        unsigned char c = (unsigned char) *text;
+
+        if (c == '"' || c == '\\') {
+            fprintf(stderr, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(stderr, "\\u%04x", c);
+        } else {
+            fputc(c, stderr);
+        }
+    }
+
+    fputc('"', stderr);
+}
+
+/* Prints what --stats collected to stderr, as a table or, for --stats-json, as
+ * a single JSON object on one line. The library's phases are part of convert.
+ */
+void print_stats(
+    const cli_stats* stats,
+    const char*      input,
+    const char*      output,
+    int              result
+)
+{
+    static const char* cli_phase_names[num_cli_phases] = {
+        "read",
+        "convert",
+        "write"
+    };
+
+    const int num_phases = num_cli_phases + num_brnflip_phases;
+
+    double total_seconds = (clock_now() - stats->start) / 1e9;
+
+    long peak_rss_kb  = -1;
+    long minor_faults = -1;
+    long major_faults = -1;
+
+    #ifdef BRNFLIP_HAVE_MMAP
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        // Linux reports kilobytes, but macOS reports bytes.
+        #ifdef __APPLE__
+        peak_rss_kb = usage.ru_maxrss / 1024;
+        #else
+        peak_rss_kb = usage.ru_maxrss;
+        #endif
+        minor_faults = usage.ru_minflt;
+        major_faults = usage.ru_majflt;
+    }
+    #endif
+
+    if (stats->format == stats_json) {
+        fputs("{\"input\":", stderr);
+        print_json_string(input);
+        fputs(",\"output\":", stderr);
+        print_json_string(output);
+        fprintf(
+            stderr,
+            ",\"status\":\"%s\",\"total_seconds\":%.6f,\"phases\":[",
+            result == 0 ? "ok" : "failed",
+            total_seconds
+        );
+    } else {
+        fprintf(
+            stderr,
+            "%-12s %8s %12s %16s %14s %10s\n",
+            "phase",
+            "calls",
+            "seconds",
+            "bytes",
+            "nodes",
+            "MB/s"
+        );
+    }
+
+    int i;
+    for (i = 0; i < num_phases; ++i) {
+        const brnflip_phase_stats* phase;
+        const char*                name;
+
+        if (i < num_cli_phases) {
+            phase = &stats->phases[i];
+            name  = cli_phase_names[i];
+        } else {
+            phase = &stats->library.phases[i - num_cli_phases];
+            name  = brnflip_phase_name((brnflip_phase) (i - num_cli_phases));
+        }
+
+        double seconds = phase->nanoseconds / 1e9;
+        double rate    = seconds > 0 ? phase->bytes / seconds / 1e6 : 0;
+
+        if (stats->format == stats_json) {
+            fprintf(
+                stderr,
+                "%s{\"phase\":\"%s\",\"calls\":%llu,\"seconds\":%.6f,"
+                "\"bytes\":%llu,\"nodes\":%llu,\"mb_per_s\":%.1f}",
+                i > 0 ? "," : "",
+                name,
+                (unsigned long long) phase->calls,
+                seconds,
+                (unsigned long long) phase->bytes,
+                (unsigned long long) phase->nodes,
+                rate
+            );
+        } else {
+            fprintf(
+                stderr,
+                "%s%-*s %8llu %12.6f %16llu %14llu %10.1f\n",
+                i < num_cli_phases ? "" : "  ",
+                i < num_cli_phases ? 12 : 10,
+                name,
+                (unsigned long long) phase->calls,
+                seconds,
+                (unsigned long long) phase->bytes,
+                (unsigned long long) phase->nodes,
+                rate
+            );
+        }
+    }
+
+    if (stats->format == stats_json) {
+        fprintf(
+            stderr,
+            "],\"peak_rss_kb\":%ld,\"minor_faults\":%ld,\"major_faults\":%ld}\n",
+            peak_rss_kb,
+            minor_faults,
+            major_faults
+        );
+        return;
+    }
+
+    fprintf(stderr, "total: %.6f seconds\n", total_seconds);
+
+    if (peak_rss_kb >= 0) {
+        fprintf(
+            stderr,
+            "peak RSS: %ld KB, page faults: %ld minor, %ld major\n",
+            peak_rss_kb,
+            minor_faults,
+            major_faults
+        );
+    }
 }
 
 void print_usage(char* program_name) {
-    printf("Usage: %s [input] [-o output] [--target target] [--force]\n", program_name);
+    printf("Usage: %s [input] [-o output] [--target target] [--force] [--mmap]\n", program_name);
+    printf("       [--threads count] [--stats | --stats-json]\n");
+    printf("       [--pipeline [--window mb] [--queue-depth count]]\n");
+    printf("       [--skips sidecar] [--no-cache]\n");
+    printf("       [--checksum]\n");
+    printf("       %s --quick-detect [input]\n", program_name);
+    printf("       %s --fingerprint [input] [--threads count]\n", program_name);
+    printf("       %s --export-index [input] -o index [--threads count]\n", program_name);
+    printf("       %s --export-skips [input] -o sidecar [--threads count]\n", program_name);
+    printf("       %s --import-index index -o output [--target target]\n", program_name);
+    printf("       %s --batch [--recursive] [--jobs count] [--target target]\n", program_name);
+    printf("       [--force] [--no-cache] path...\n");
+    printf("       %s --watch [--recursive] [--jobs count] [--debounce ms]\n", program_name);
+    printf("       [--socket path] [--target target] [--force] directory...\n");
 
     puts("Each parameter may only be specified once.");
     puts("Input and output are the filenames of the input and output files.");
     puts("Target is the target endianess. It defaults to your machine's.");
+    puts("An input or output of - means stdin or stdout. The brain is then");
+    puts("converted in a single pass through a fixed-size buffer, as it also");
+    puts("is when the input is compressed with gzip or zstd, or the output ends");
+    puts("in .gz or .zst, in which case it is compressed the same way.");
+    puts("--threads flips the brain with up to count threads. Small brains are");
+    puts("always flipped on a single thread.");
+    puts("--quick-detect prints the endianess of the input without converting");
+    puts("it, judged from the dictionary and a sample of nodes, along with its");
+    puts("confidence: low, high, or full if the whole brain had to be checked.");
+    puts("--fingerprint prints a checksum of the input that is the same in");
+    puts("either endianess, along with the CRC-32C of its bytes. --checksum");
+    puts("prints the fingerprints and CRC-32Cs of the brain before and after");
+    puts("converting it, taken while it is flipped. A conversion that changed");
+    puts("nothing but the endianess leaves the fingerprint the same, on any");
+    puts("machine. --checksum may not be used with --mmap or --pipeline, or");
+    puts("when streaming.");
+    puts("--export-index writes the brain as an index, with the nodes in");
+    puts("separate page-aligned arrays in your machine's byte order, which a");
+    puts("bot can map and use without parsing. --import-index converts an index");
+    puts("back into a brain in the target endianess.");
+    puts("--export-skips writes a skip index of the brain, which holds the");
+    puts("size of every node's subtree so that tools can jump straight to its");
+    puts("children, along with a checksum of the brain. Converting with");
+    puts("--skips and a skip index that matches the input trusts the index");
+    puts("instead of checking the trees again. An index that does not match is");
+    puts("ignored, and the trees are checked as usual.");
+    puts("What was learned about a brain is cached with the file it was");
+    puts("written to, and with each brain --batch converts, in an extended");
+    puts("attribute, or where there are none in a hidden .name.brnflip file");
+    puts("beside it. While the file is unchanged, later runs trust the cache");
+    puts("instead of checking the trees again, and leave a brain already in");
+    puts("the target endianess untouched. --no-cache neither reads nor writes");
+    puts("the cache.");
+    puts("--batch converts every file named on the command line in place, on");
+    puts("--jobs workers (one per CPU by default). A directory converts the");
+    puts("files in it, and --recursive those in its subdirectories too.");
+    puts("Symbolic links found in directories, and brnflip's own hidden");
+    puts("cache and temporary files, are skipped. An input of - reads more");
+    puts("names from stdin, one per line. A summary is printed at the end,");
+    puts("and the exit status is 1 if any file failed.");
+    puts("Each brain is replaced by renaming a converted copy over it, so one");
+    puts("is never left half converted.");
+    puts("--watch stays running and converts each brain written into the");
+    puts("directories, and with --recursive those below them, in place. A");
+    puts("brain is converted once it has been left alone for --debounce");
+    puts("milliseconds (500 by default), and replaced by renaming a converted");
+    puts("copy over it. Lines of the form \"convert path\" on stdin, or on the");
+    puts("Unix socket given by --socket, convert a brain straight away and are");
+    puts("answered once it is done. \"quit\" stops watching.");
+    puts("--stats prints to stderr how long reading, converting and writing");
+    puts("took, with the dictionary, walk and flip phases of the conversion");
+    puts("broken out, followed by the peak memory use and page faults.");
+    puts("--stats-json prints the same as one line of JSON. Neither may be used");
+    puts("with --batch.");
+    puts("--mmap converts through a memory mapping instead of reading the whole");
+    puts("file into memory. This is the default when input and output are the");
+    puts("same file, in which case only the changed pages are written back.");
+    puts("--pipeline converts the brain a window of --window megabytes (16 by");
+    puts("default) at a time, reading the next window and writing the last one");
+    puts("while converting this one, with up to --queue-depth windows (4 by");
+    puts("default, and at least 2) in memory at once. This keeps a slow disk");
+    puts("busy without holding the whole brain in memory. It is not used when");
+    puts("converting in place.");
     puts("Supported targets are:");
     puts("\tbig\tbig-endian");
     puts("\tlittle\tlittle-endian");
@@ -0,0 +1,273 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BRNFLIP_CLI_H__
+#define __BRNFLIP_CLI_H__
+
+#include "brnflip.h"
+
+typedef enum
+{
+    stats_off = 0,
+    stats_text,
+    stats_json
+} stats_format;
+
+// The phases of a conversion timed by the CLI around the library's own.
+typedef enum
+{
+    cli_phase_read = 0,
+    cli_phase_convert,
+    cli_phase_write,
+    num_cli_phases
+} cli_phase;
+
+/* What --stats collects over a conversion. library holds the phases the
+ * library timed within cli_phase_convert.
+ */
+typedef struct
+{
+    stats_format        format;
+    uint64_t            start;
+    brnflip_phase_stats phases[num_cli_phases];
+    brnflip_stats       library;
+} cli_stats;
+
+/* The settings that apply to every conversion. stats is NULL unless --stats
+ * was given, skips is NULL unless --skips was, and checksums is NULL unless
+ * --checksum was, in which case convert_buffer fills it in. cache is cleared
+ * by --no-cache, and cached is what the detection cache holds for the brain
+ * being converted, if anything.
+ */
+typedef struct
+{
+    megahal_filetype          target;
+    int                       force;
+    unsigned int              num_threads;
+    cli_stats*                stats;
+    const brnflip_skip_index* skips;
+    brnflip_checksums*        checksums;
+    int                       cache;
+    const brnflip_brain_info* cached;
+} cli_options;
+
+/* Returns the monotonic clock in nanoseconds. Defined in cli.c. */
+uint64_t clock_now(void);
+
+/* Returns the time a phase starts, or 0 if --stats was not given. Defined in
+ * cli.c.
+ */
+uint64_t stats_start(const cli_options* options);
+
+/* Adds the time since start and the bytes it handled to a phase. Defined in
+ * cli.c.
+ */
+void stats_stop(
+    const cli_options* options,
+    cli_phase          phase,
+    uint64_t           start,
+    uint64_t           bytes
+);
+
+/* Detects the endianess of a brain in memory and flips it if it is not already
+ * in the target endianess, or flips it unconditionally if force is set.
+ * *flipped is set to 1 if the buffer was modified. If out_changed is not NULL,
+ * it is set to the bytes that may have changed, which is all of them if force
+ * is set. If out_info is not NULL, it is set to what was learned about the
+ * brain, which is nothing if force is set. Defined in cli.c.
+ */
+brnflip_error convert_buffer(
+    char*               buffer,
+    size_t              brain_length,
+    const cli_options*  options,
+    int*                flipped,
+    brnflip_range*      out_changed,
+    brnflip_brain_info* out_info
+);
+
+/* Writes a converted brain to a new output file, which must not be the input.
+ * The changed range comes from changed_bytes, and everything else is cloned or
+ * copied in the kernel from the original brain, open as input_fd, or else
+ * written from brain, which holds it in memory. Returns 0 on failure. Defined
+ * in regions.c, on systems with POSIX file APIs.
+ */
+int write_regions(
+    int                  input_fd,
+    const char*          output,
+    const char*          brain,
+    size_t               brain_length,
+    const brnflip_range* changed,
+    const char*          changed_bytes
+);
+
+/* Converts a regular file to a new output file a window of window_length bytes
+ * at a time, reading, converting and writing different windows at once on
+ * three threads through a ring of queue_depth windows. window_length is
+ * rounded down to a whole number of nodes. Returns 0 without writing anything
+ * if the input cannot be read this way, or its endianess cannot be told from
+ * the first window, in which case the caller should fall back to
+ * convert_buffered. Otherwise returns 1 and sets *out_result to 0 on success
+ * and 1 on failure, having removed any partial output. Defined in pipeline.c,
+ * on systems with POSIX file APIs.
+ */
+int convert_pipelined(
+    const char*        input,
+    const char*        output,
+    size_t             window_length,
+    unsigned int       queue_depth,
+    const cli_options* options,
+    int*               out_result
+);
+
+// The suffix of the hidden detection cache sidecars written beside brains.
+#define CACHE_SIDECAR_SUFFIX ".brnflip"
+
+/* What follows a brain's name in the hidden temporary files that converted
+ * brains are written to before they replace the originals.
+ */
+#define TEMP_FILE_INFIX ".brnflip-"
+
+/* Returns 1 if name, the last component of a path, is one of the files brnflip
+ * writes beside brains for itself: a detection cache sidecar, .<name>.brnflip,
+ * or a temporary file, .<name>.brnflip-XXXXXX. These are never brains, and
+ * are skipped when looking for them. Defined in cache.c, on systems with POSIX
+ * file APIs.
+ */
+int cache_is_own_file(const char* name);
+
+/* Fills in out_info from the detection cache kept with the brain file at path,
+ * returning 1, if there is a record and the file has not changed since it was
+ * made. Returns 0 otherwise. Defined in cache.c, on systems with POSIX file
+ * APIs.
+ */
+int cache_lookup(const char* path, brnflip_brain_info* out_info);
+
+/* Records info, which must describe the brain file at path as it is now, in
+ * its detection cache. Failing to do so is not an error, since the cache is
+ * only ever an optimization. Defined in cache.c, on systems with POSIX file
+ * APIs.
+ */
+void cache_store(const char* path, const brnflip_brain_info* info);
+
+struct stat;
+
+/* Reads the first length bytes of fd into *buffer, replacing it with a larger
+ * one from brnflip_alloc_buffer, and updating *capacity, if it does not fit.
+ * Returns 0 on failure. Defined in files.c, on systems with POSIX file APIs.
+ */
+int read_file(int fd, size_t length, char** buffer, size_t* capacity);
+
+/* Writes a converted brain to a temporary file beside the original at path and
+ * renames it over the original, keeping its owner and permissions where it
+ * can. If path is a symbolic link, the link is kept and the brain it points
+ * to is replaced. original is what the original was when it was read, and
+ * out_temp_stat is filled in with what the copy is, as renamed into place.
+ * Returns NULL on success, or why the original was left alone: because
+ * something failed, or because it changed since it was read. Defined in
+ * files.c, on systems with POSIX file APIs.
+ */
+const char* replace_file(
+    const char*        path,
+    const char*        buffer,
+    size_t             length,
+    const struct stat* original,
+    struct stat*       out_temp_stat
+);
+
+/* Converts every file in paths in place on a pool of num_jobs workers, or one
+ * per CPU if num_jobs is 0, and prints a summary. Directories are expanded,
+ * recursively if recursive is set, and a path of "-" reads more paths from
+ * stdin. Returns 0 if every file was converted. Defined in batch.c.
+ */
+int convert_batch(
+    char**             paths,
+    int                num_paths,
+    int                recursive,
+    unsigned int       num_jobs,
+    const cli_options* options
+);
+
+/* Watches the directories in paths, recursively if recursive is set, and
+ * converts each brain written into them once it has been left alone for
+ * debounce_ms, replacing it atomically. Conversions run on a pool of num_jobs
+ * workers, or one per CPU if num_jobs is 0. More conversions can be requested
+ * by path on stdin, or on a Unix socket at socket_path if it is not NULL.
+ * Runs until interrupted or sent "quit", and returns 0 unless it could not
+ * start. Defined in watch.c, and only supported on Linux.
+ */
+int convert_watch(
+    char**             paths,
+    int                num_paths,
+    int                recursive,
+    unsigned int       num_jobs,
+    unsigned int       debounce_ms,
+    const char*        socket_path,
+    const cli_options* options
+);
+
+typedef enum
+{
+    compression_none = 0,
+    compression_gzip,
+    compression_zstd
+} brain_compression;
+
+/* A brain being read or written through an optional gzip or zstd stream.
+ * Defined in compress.c.
+ */
+typedef struct brain_file brain_file;
+
+/* Returns the compression implied by a path ending in .gz or .zst. */
+brain_compression compression_for_extension(const char* path);
+
+/* Returns the compression of an existing file, judged by its magic bytes. */
+brain_compression compression_of_file(const char* path);
+
+/* Opens path, or stdin if it is "-", for reading, decompressing it if it
+ * starts with gzip or zstd magic bytes. Returns NULL if the file cannot be
+ * opened or its compression is not supported by this build.
+ */
+brain_file* brain_file_open_read(const char* path);
+
+/* Opens path, or stdout if it is "-", for writing with the given compression.
+ * Returns NULL if the file cannot be opened or the compression is not
+ * supported by this build.
+ */
+brain_file* brain_file_open_write(
+    const char*       path,
+    brain_compression compression
+);
+
+/* Reads up to length uncompressed bytes into data, returning fewer only at the
+ * end of the brain or on failure.
+ */
+size_t brain_file_read(brain_file* file, char* data, size_t length);
+
+/* Writes length uncompressed bytes, returning 0 on failure. */
+int brain_file_write(brain_file* file, const char* data, size_t length);
+
+/* Returns 1 if a read or write has failed, including when compressed input
+ * ended in the middle of its stream.
+ */
+int brain_file_failed(const brain_file* file);
+
+/* Ends any compressed stream, closes the file and frees it. Returns 0 if
+ * anything failed along the way.
+ */
+int brain_file_close(brain_file* file);
+
+#endif // __BRNFLIP_CLI_H__
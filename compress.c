@@ -0,0 +1,504 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef BRNFLIP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef BRNFLIP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "cli.h"
+
+/* Compressed Brains
+ *
+ * A brain_file reads or writes a brain that may be compressed with gzip or
+ * zstd, so that convert_streaming can decompress, convert and recompress a
+ * brain a buffer at a time, without the uncompressed brain ever being held in
+ * memory or written to disk. Compressed input is recognized by its magic
+ * bytes, which are read ahead and then handed to the decompressor, or, for a
+ * plain brain, returned by the first read. Compressed output is chosen by the
+ * output file's extension. Support for each format is only compiled in when
+ * its library was found at build time, and plain brains never touch either.
+ */
+
+#define BRAIN_FILE_BUFFER_LENGTH (1 << 16)
+
+static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+static const size_t magic_length = 4;
+
+struct brain_file
+{
+    FILE*             file;
+    int               writing;
+    brain_compression compression;
+
+    // Compressed data waiting to be decompressed, or the magic bytes of a
+    // plain brain waiting to be read.
+    char*             buffer;
+    size_t            buffer_filled;
+    size_t            buffer_position;
+
+    int               at_end;
+    int               finished;
+    int               failed;
+
+    #ifdef BRNFLIP_HAVE_ZLIB
+    z_stream          zlib;
+    #endif
+
+    #ifdef BRNFLIP_HAVE_ZSTD
+    ZSTD_DStream*     zstd_in;
+    ZSTD_CStream*     zstd_out;
+    #endif
+};
+
+static const char* brain_compression_name(brain_compression compression)
+{
+    return compression == compression_gzip ? "gzip" : "zstd";
+}
+
+static brain_compression brain_compression_of_magic(
+    const char* magic,
+    size_t      length
+)
+{
+    if (length >= sizeof(gzip_magic) &&
+        memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0) {
+        return compression_gzip;
+    }
+
+    if (length >= sizeof(zstd_magic) &&
+        memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0) {
+        return compression_zstd;
+    }
+
+    return compression_none;
+}
+
+/* Sets up the decompressor or compressor for file->compression, returning 0 if
+ * it is not supported by this build.
+ */
+static int brain_file_start(brain_file* file)
+{
+    switch (file->compression) {
+        case compression_none:
+            return 1;
+
+        case compression_gzip:
+            #ifdef BRNFLIP_HAVE_ZLIB
+            memset(&file->zlib, 0, sizeof(z_stream));
+
+            // 15 + 32 accepts gzip and zlib headers, 15 + 16 writes gzip.
+            if (file->writing) {
+                return deflateInit2(
+                    &file->zlib,
+                    Z_DEFAULT_COMPRESSION,
+                    Z_DEFLATED,
+                    15 + 16,
+                    8,
+                    Z_DEFAULT_STRATEGY
+                ) == Z_OK;
+            }
+
+            return inflateInit2(&file->zlib, 15 + 32) == Z_OK;
+            #else
+            break;
+            #endif
+
+        case compression_zstd:
+            #ifdef BRNFLIP_HAVE_ZSTD
+            if (file->writing) {
+                file->zstd_out = ZSTD_createCStream();
+
+                return file->zstd_out != NULL &&
+                    !ZSTD_isError(ZSTD_initCStream(file->zstd_out, 3));
+            }
+
+            file->zstd_in = ZSTD_createDStream();
+
+            return file->zstd_in != NULL &&
+                !ZSTD_isError(ZSTD_initDStream(file->zstd_in));
+            #else
+            break;
+            #endif
+    }
+
+    fprintf(
+        stderr,
+        "brnflip was built without %s support.\n",
+        brain_compression_name(file->compression)
+    );
+
+    return 0;
+}
+
+static void brain_file_free(brain_file* file)
+{
+    #ifdef BRNFLIP_HAVE_ZLIB
+    if (file->compression == compression_gzip) {
+        if (file->writing) {
+            deflateEnd(&file->zlib);
+        } else {
+            inflateEnd(&file->zlib);
+        }
+    }
+    #endif
+
+    #ifdef BRNFLIP_HAVE_ZSTD
+    ZSTD_freeDStream(file->zstd_in);
+    ZSTD_freeCStream(file->zstd_out);
+    #endif
+
+    if (file->file != NULL && file->file != stdin && file->file != stdout) {
+        fclose(file->file);
+    }
+
+    free(file->buffer);
+    free(file);
+}
+
+brain_compression compression_for_extension(const char* path)
+{
+    size_t length = strlen(path);
+
+    if (length > 3 && strcmp(path + length - 3, ".gz") == 0) {
+        return compression_gzip;
+    }
+
+    if (length > 4 && strcmp(path + length - 4, ".zst") == 0) {
+        return compression_zstd;
+    }
+
+    return compression_none;
+}
+
+brain_compression compression_of_file(const char* path)
+{
+    char  magic[4];
+    FILE* f = fopen(path, "rb");
+
+    if (f == NULL) {
+        return compression_none;
+    }
+
+    size_t length = fread(magic, 1, magic_length, f);
+    fclose(f);
+
+    return brain_compression_of_magic(magic, length);
+}
+
+brain_file* brain_file_open_read(const char* path)
+{
+    brain_file* file = (brain_file*) calloc(1, sizeof(brain_file));
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    file->file   = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    file->buffer = (char*) malloc(BRAIN_FILE_BUFFER_LENGTH);
+
+    if (file->file == NULL || file->buffer == NULL) {
+        brain_file_free(file);
+        return NULL;
+    }
+
+    file->buffer_filled = fread(file->buffer, 1, magic_length, file->file);
+    file->compression   = brain_compression_of_magic(
+        file->buffer,
+        file->buffer_filled
+    );
+
+    if (!brain_file_start(file)) {
+        file->compression = compression_none;
+        brain_file_free(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+brain_file* brain_file_open_write(
+    const char*       path,
+    brain_compression compression
+)
+{
+    brain_file* file = (brain_file*) calloc(1, sizeof(brain_file));
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    file->file        = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    file->writing     = 1;
+    file->compression = compression;
+    file->buffer      = (char*) malloc(BRAIN_FILE_BUFFER_LENGTH);
+
+    if (file->file == NULL || file->buffer == NULL || !brain_file_start(file)) {
+        file->compression = compression_none;
+        brain_file_free(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+/* Decompresses as much of the buffered input as fits into data, returning the
+ * number of bytes produced.
+ */
+static size_t brain_file_decompress(brain_file* file, char* data, size_t length)
+{
+    size_t available = file->buffer_filled - file->buffer_position;
+    size_t produced  = 0;
+
+    // Every stream read so far has ended, and there is nothing to start another.
+    if (file->finished && available == 0) {
+        return 0;
+    }
+
+    #ifdef BRNFLIP_HAVE_ZLIB
+    if (file->compression == compression_gzip) {
+        // A gzip file may hold several members, which are read one after another.
+        if (file->finished && available > 0) {
+            inflateReset(&file->zlib);
+            file->finished = 0;
+        }
+
+        file->zlib.next_in   = (Bytef*) (file->buffer + file->buffer_position);
+        file->zlib.avail_in  = (uInt) available;
+        file->zlib.next_out  = (Bytef*) data;
+        file->zlib.avail_out = (uInt) length;
+
+        int result = inflate(&file->zlib, Z_NO_FLUSH);
+
+        if (result == Z_STREAM_END) {
+            file->finished = 1;
+        } else if (result != Z_OK && result != Z_BUF_ERROR) {
+            file->failed = 1;
+        }
+
+        produced = length - file->zlib.avail_out;
+        file->buffer_position = file->buffer_filled - file->zlib.avail_in;
+    }
+    #endif
+
+    #ifdef BRNFLIP_HAVE_ZSTD
+    if (file->compression == compression_zstd) {
+        ZSTD_inBuffer  in  = { file->buffer + file->buffer_position, available, 0 };
+        ZSTD_outBuffer out = { data, length, 0 };
+
+        size_t result = ZSTD_decompressStream(file->zstd_in, &out, &in);
+
+        if (ZSTD_isError(result)) {
+            file->failed = 1;
+        } else {
+            // Zero means that a frame has ended and been flushed in full.
+            file->finished = result == 0;
+        }
+
+        produced = out.pos;
+        file->buffer_position += in.pos;
+    }
+    #endif
+
+    return produced;
+}
+
+size_t brain_file_read(brain_file* file, char* data, size_t length)
+{
+    size_t done = 0;
+
+    while (done < length && !file->failed) {
+        size_t available = file->buffer_filled - file->buffer_position;
+
+        if (file->compression == compression_none) {
+            size_t count;
+
+            if (available > 0) {
+                count = available < length - done ? available : length - done;
+                memcpy(data + done, file->buffer + file->buffer_position, count);
+                file->buffer_position += count;
+            } else {
+                count = fread(data + done, 1, length - done, file->file);
+                file->failed = ferror(file->file);
+            }
+
+            done += count;
+
+            if (count == 0) {
+                break;
+            }
+
+            continue;
+        }
+
+        if (available == 0 && !file->at_end) {
+            file->buffer_position = 0;
+            file->buffer_filled   = fread(
+                file->buffer,
+                1,
+                BRAIN_FILE_BUFFER_LENGTH,
+                file->file
+            );
+
+            file->at_end = file->buffer_filled == 0;
+            file->failed = ferror(file->file);
+            continue;
+        }
+
+        size_t produced = brain_file_decompress(
+            file,
+            data + done,
+            length - done
+        );
+
+        done += produced;
+
+        if (produced == 0 && file->at_end &&
+            file->buffer_position == file->buffer_filled) {
+            // The compressed data ended in the middle of a stream.
+            file->failed = file->failed || !file->finished;
+            break;
+        }
+    }
+
+    return done;
+}
+
+#if defined(BRNFLIP_HAVE_ZLIB) || defined(BRNFLIP_HAVE_ZSTD)
+
+/* Passes the compressed data the compressor has produced so far on to the
+ * file.
+ */
+static int brain_file_flush_buffer(brain_file* file, size_t length)
+{
+    if (length > 0 && fwrite(file->buffer, 1, length, file->file) != length) {
+        file->failed = 1;
+    }
+
+    return !file->failed;
+}
+
+#endif
+
+/* Compresses data into the file. If finish is set, the compressed stream is
+ * then ended.
+ */
+static int brain_file_compress(
+    brain_file* file,
+    const char* data,
+    size_t      length,
+    int         finish
+)
+{
+    #ifdef BRNFLIP_HAVE_ZLIB
+    if (file->compression == compression_gzip) {
+        file->zlib.next_in  = (Bytef*) data;
+        file->zlib.avail_in = (uInt) length;
+
+        int result;
+
+        do {
+            file->zlib.next_out  = (Bytef*) file->buffer;
+            file->zlib.avail_out = BRAIN_FILE_BUFFER_LENGTH;
+
+            result = deflate(&file->zlib, finish ? Z_FINISH : Z_NO_FLUSH);
+
+            if (result == Z_STREAM_ERROR ||
+                !brain_file_flush_buffer(
+                    file,
+                    BRAIN_FILE_BUFFER_LENGTH - file->zlib.avail_out
+                )) {
+                return 0;
+            }
+        } while (file->zlib.avail_in > 0 ||
+                 (finish && result != Z_STREAM_END));
+    }
+    #endif
+
+    #ifdef BRNFLIP_HAVE_ZSTD
+    if (file->compression == compression_zstd) {
+        ZSTD_inBuffer in = { data, length, 0 };
+        size_t remaining;
+
+        do {
+            ZSTD_outBuffer out = { file->buffer, BRAIN_FILE_BUFFER_LENGTH, 0 };
+
+            remaining = ZSTD_compressStream2(
+                file->zstd_out,
+                &out,
+                &in,
+                finish ? ZSTD_e_end : ZSTD_e_continue
+            );
+
+            if (ZSTD_isError(remaining) ||
+                !brain_file_flush_buffer(file, out.pos)) {
+                file->failed = 1;
+                return 0;
+            }
+        } while (in.pos < in.size || (finish && remaining != 0));
+    }
+    #endif
+
+    return !file->failed;
+}
+
+int brain_file_write(brain_file* file, const char* data, size_t length)
+{
+    if (file->compression == compression_none) {
+        file->failed = fwrite(data, 1, length, file->file) != length;
+        return !file->failed;
+    }
+
+    return brain_file_compress(file, data, length, 0);
+}
+
+int brain_file_failed(const brain_file* file)
+{
+    return file->failed;
+}
+
+int brain_file_close(brain_file* file)
+{
+    int succeeded = !file->failed;
+
+    if (file->writing && succeeded && file->compression != compression_none) {
+        succeeded = brain_file_compress(file, NULL, 0, 1);
+    }
+
+    if (file->writing && fflush(file->file) != 0) {
+        succeeded = 0;
+    }
+
+    if (file->file != stdin && file->file != stdout &&
+        fclose(file->file) != 0) {
+        succeeded = 0;
+    }
+
+    file->file = NULL;
+    brain_file_free(file);
+
+    return succeeded;
+}
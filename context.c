@@ -0,0 +1,252 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "brnflip.h"
+#include "brnflip_internal.h"
+
+/* Contexts and Batches
+ *
+ * The scratch memory of a context only ever grows, and comes from
+ * brnflip_alloc_buffer, so a server converting brains of similar sizes
+ * allocates once and then reuses huge pages.
+ *
+ * brnflip_flip_many splits a batch by size. A brain with enough nodes for
+ * brnflip_parallel_chunks to split it gets every thread to itself, and the
+ * rest are handed out one at a time to workers started by
+ * brnflip_parallel_for, so that a worker given a larger brain does not hold
+ * up the others. Which brains are left for the workers is kept in a list of
+ * their indexes, rather than marked in the caller's error fields.
+ */
+
+// The small brains of a batch, shared between its workers.
+typedef struct
+{
+    brnflip_batch_brain* brains;
+    const size_t*        pending;
+    size_t               num_pending;
+    size_t               next_pending;
+    megahal_filetype     target;
+    pthread_mutex_t      lock;
+} brnflip_batch;
+
+static unsigned int brnflip_context_threads(const brnflip_context* context)
+{
+    return context->num_threads > 0 ? context->num_threads : 1;
+}
+
+// Returns 1 if a brain is large enough to be split between threads.
+static int brnflip_is_large(
+    const brnflip_batch_brain* brain,
+    unsigned int               num_threads
+)
+{
+    size_t num_nodes = brain->brain_length / (size_t) brnflip_tree_node_length;
+
+    return brnflip_parallel_chunks(num_nodes, num_threads) > 1;
+}
+
+static void brnflip_convert_batch_brain(
+    brnflip_batch_brain* brain,
+    megahal_filetype     target,
+    unsigned int         num_threads
+)
+{
+    brain->error = brnflip_convert_parallel(
+        brain->brain,
+        brain->brain_length,
+        target,
+        num_threads,
+        &brain->info
+    );
+}
+
+/* Converts small brains of a batch until there are none left. Each worker is
+ * a chunk of one "node" for brnflip_parallel_for.
+ */
+static void brnflip_batch_worker(
+    void*        context,
+    unsigned int chunk,
+    size_t       begin,
+    size_t       end
+)
+{
+    brnflip_batch* batch = (brnflip_batch*) context;
+
+    (void) chunk;
+    (void) begin;
+    (void) end;
+
+    for (;;) {
+        brnflip_batch_brain* brain = NULL;
+
+        pthread_mutex_lock(&batch->lock);
+        if (batch->next_pending < batch->num_pending) {
+            brain = &batch->brains[batch->pending[batch->next_pending]];
+            ++batch->next_pending;
+        }
+        pthread_mutex_unlock(&batch->lock);
+
+        if (brain == NULL) {
+            break;
+        }
+
+        brnflip_convert_batch_brain(brain, batch->target, 1);
+    }
+}
+
+void brnflip_context_init(brnflip_context* context, unsigned int num_threads)
+{
+    context->num_threads    = num_threads > 0 ? num_threads : 1;
+    context->scratch        = NULL;
+    context->scratch_length = 0;
+}
+
+void brnflip_context_close(brnflip_context* context)
+{
+    brnflip_free_buffer(context->scratch, context->scratch_length);
+
+    context->scratch        = NULL;
+    context->scratch_length = 0;
+}
+
+brnflip_error brnflip_context_convert(
+    brnflip_context*    context,
+    const char*         brain,
+    size_t              brain_length,
+    megahal_filetype    target,
+    const char**        out_brain,
+    brnflip_brain_info* out_info
+)
+{
+    unsigned int num_threads = brnflip_context_threads(context);
+
+    *out_brain = NULL;
+
+    brnflip_error return_code = brnflip_inspect_brain_parallel(
+        brain,
+        brain_length,
+        num_threads,
+        out_info
+    );
+
+    if (return_code != no_error) {
+        return return_code;
+    }
+
+    if (target == unknown_filetype || out_info->file_type == target) {
+        *out_brain = brain;
+        return no_error;
+    }
+
+    // The old contents need not survive, so there is nothing to realloc.
+    if (brain_length > context->scratch_length) {
+        brnflip_free_buffer(context->scratch, context->scratch_length);
+
+        context->scratch_length = 0;
+        context->scratch        = (char*) brnflip_alloc_buffer(brain_length);
+
+        if (context->scratch == NULL) {
+            return invalid_file;
+        }
+
+        context->scratch_length = brain_length;
+    }
+
+    return_code = brnflip_flip_copy(
+        brain,
+        context->scratch,
+        brain_length,
+        out_info,
+        num_threads
+    );
+
+    if (return_code == no_error) {
+        *out_brain = context->scratch;
+    }
+
+    return return_code;
+}
+
+brnflip_error brnflip_flip_many(
+    brnflip_context*     context,
+    brnflip_batch_brain* brains,
+    size_t               num_brains,
+    megahal_filetype     target
+)
+{
+    unsigned int num_threads = brnflip_context_threads(context);
+    size_t       num_small   = 0;
+    size_t*      pending     = NULL;
+
+    if (num_threads > 1 && num_brains > 1) {
+        pending = (size_t*) malloc(num_brains * sizeof(size_t));
+    }
+
+    size_t i;
+    for (i = 0; i < num_brains; ++i) {
+        memset(&brains[i].info, 0, sizeof(brnflip_brain_info));
+
+        // Without a list to hand them out from, every brain is converted here.
+        if (pending == NULL || brnflip_is_large(&brains[i], num_threads)) {
+            brnflip_convert_batch_brain(&brains[i], target, num_threads);
+        } else {
+            pending[num_small++] = i;
+        }
+    }
+
+    if (num_small > 0) {
+        brnflip_batch batch;
+        batch.brains       = brains;
+        batch.pending      = pending;
+        batch.num_pending  = num_small;
+        batch.next_pending = 0;
+        batch.target       = target;
+        pthread_mutex_init(&batch.lock, NULL);
+
+        unsigned int num_workers = num_threads;
+
+        if (num_workers > num_small) {
+            num_workers = (unsigned int) num_small;
+        }
+
+        brnflip_parallel_for(
+            num_workers,
+            num_workers,
+            brnflip_batch_worker,
+            &batch
+        );
+
+        pthread_mutex_destroy(&batch.lock);
+    }
+
+    free(pending);
+
+    brnflip_error return_code = no_error;
+
+    for (i = 0; i < num_brains; ++i) {
+        if (brains[i].error != no_error) {
+            return_code = invalid_file;
+        }
+    }
+
+    return return_code;
+}
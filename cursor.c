@@ -0,0 +1,236 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "brnflip.h"
+#include "brnflip_internal.h"
+
+/* Node Cursors
+ *
+ * A cursor walks the node region front to back, so the nodes come out in
+ * pre-order for free. The shape of the trees is followed the same way as in
+ * stream.c, by a running count of the nodes the current tree still owes, so
+ * the walk is always exact. Depth needs a stack of the children still to come
+ * at each level, which the cursor keeps in a fixed array so that it never
+ * allocates. Consecutive levels that have no children left, such as a long
+ * chain of only children, share one entry, so the depth of every node is
+ * known unless more than BRNFLIP_CURSOR_MAX_LEVELS levels above it still have
+ * children to come. Past that point, the depth is reported as
+ * BRNFLIP_UNKNOWN_DEPTH until the tree ends.
+ */
+
+// Nodes decoded at a time on the stack by brnflip_visit_nodes.
+#define VISIT_BATCH_NODES 256
+
+static uint16_t brnflip_cursor_read_16(const char* data, int flipped)
+{
+    uint16_t value;
+
+    memcpy(&value, data, sizeof(uint16_t));
+
+    if (flipped) {
+        brnflip_flip_16_in_place((char*) &value);
+    }
+
+    return value;
+}
+
+static uint32_t brnflip_cursor_read_32(const char* data, int flipped)
+{
+    uint32_t value;
+
+    memcpy(&value, data, sizeof(uint32_t));
+
+    if (flipped) {
+        brnflip_flip_32_in_place((char*) &value);
+    }
+
+    return value;
+}
+
+/* Places a node with the given number of branches on the cursor's level stack
+ * and returns its depth.
+ */
+static uint32_t brnflip_cursor_track_depth(
+    brnflip_cursor* cursor,
+    uint16_t        branch
+)
+{
+    uint32_t depth = cursor->depth_lost ? BRNFLIP_UNKNOWN_DEPTH : cursor->depth;
+
+    if (cursor->depth_lost) {
+        return depth;
+    }
+
+    if (cursor->num_levels > 0) {
+        uint32_t top = cursor->num_levels - 1;
+
+        // The parent's level has children left, or it would have been popped.
+        if (--cursor->level_pending[top] == 0 &&
+            top > 0 && cursor->level_pending[top - 1] == 0) {
+            cursor->level_run[top - 1] += cursor->level_run[top];
+            --cursor->num_levels;
+        }
+    }
+
+    if (branch > 0) {
+        if (cursor->num_levels == BRNFLIP_CURSOR_MAX_LEVELS) {
+            cursor->depth_lost = 1;
+            return depth;
+        }
+
+        cursor->level_pending[cursor->num_levels] = branch;
+        cursor->level_run[cursor->num_levels]     = 1;
+        ++cursor->num_levels;
+        ++cursor->depth;
+    } else {
+        // A leaf completes every level above it that has no children left.
+        while (cursor->num_levels > 0 &&
+               cursor->level_pending[cursor->num_levels - 1] == 0) {
+            --cursor->num_levels;
+            cursor->depth -= cursor->level_run[cursor->num_levels];
+        }
+    }
+
+    return depth;
+}
+
+brnflip_error brnflip_cursor_init(
+    brnflip_cursor*           cursor,
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info
+)
+{
+    memset(cursor, 0, sizeof(brnflip_cursor));
+
+    if (info->dictionary_offset < brnflip_header_length ||
+        (size_t) info->dictionary_offset > brain_length ||
+        (info->file_type != big_endian && info->file_type != little_endian)) {
+        cursor->error = invalid_file;
+        return invalid_file;
+    }
+
+    cursor->brain           = brain;
+    cursor->position        = brnflip_header_length;
+    cursor->end             = info->dictionary_offset;
+    cursor->flipped         = info->file_type != megahal_native_endianess;
+    cursor->trees_remaining = brnflip_num_trees;
+    cursor->pending_nodes   = 1;
+
+    return no_error;
+}
+
+brnflip_error brnflip_cursor_next(
+    brnflip_cursor* cursor,
+    brnflip_node*   out_nodes,
+    size_t          max_nodes,
+    size_t*         out_num_nodes
+)
+{
+    size_t num_nodes = 0;
+
+    *out_num_nodes = 0;
+
+    if (cursor->error != no_error) {
+        return cursor->error;
+    }
+
+    while (num_nodes < max_nodes && cursor->trees_remaining > 0) {
+        if (cursor->position > cursor->end - brnflip_tree_node_length) {
+            cursor->error = invalid_file;
+            break;
+        }
+
+        const char*   data = cursor->brain + cursor->position;
+        brnflip_node* node = &out_nodes[num_nodes++];
+        int           flipped = cursor->flipped;
+
+        node->symbol = brnflip_cursor_read_16(data, flipped);
+        node->usage  = brnflip_cursor_read_32(data + 2, flipped);
+        node->count  = brnflip_cursor_read_16(data + 6, flipped);
+        node->branch = brnflip_cursor_read_16(data + 8, flipped);
+        node->offset = cursor->position;
+        node->depth  = brnflip_cursor_track_depth(cursor, node->branch);
+
+        cursor->position      += brnflip_tree_node_length;
+        cursor->pending_nodes += node->branch;
+        --cursor->pending_nodes;
+
+        if (cursor->pending_nodes == 0) {
+            --cursor->trees_remaining;
+
+            cursor->pending_nodes = 1;
+            cursor->depth         = 0;
+            cursor->num_levels    = 0;
+            cursor->depth_lost    = 0;
+        }
+    }
+
+    // The trees must end exactly where the dictionary begins.
+    if (cursor->trees_remaining == 0 && cursor->position != cursor->end) {
+        cursor->error = invalid_file;
+    }
+
+    *out_num_nodes = num_nodes;
+
+    // Nodes read before an error are still returned, and the error comes next.
+    if (num_nodes == 0) {
+        return cursor->error;
+    }
+
+    return no_error;
+}
+
+brnflip_error brnflip_visit_nodes(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    brnflip_visit_fn          fn,
+    void*                     context
+)
+{
+    brnflip_cursor cursor;
+    brnflip_node   nodes[VISIT_BATCH_NODES];
+
+    brnflip_error return_code = brnflip_cursor_init(
+        &cursor,
+        brain,
+        brain_length,
+        info
+    );
+
+    while (return_code == no_error) {
+        size_t num_nodes;
+
+        return_code = brnflip_cursor_next(
+            &cursor,
+            nodes,
+            VISIT_BATCH_NODES,
+            &num_nodes
+        );
+
+        if (return_code != no_error || num_nodes == 0 ||
+            fn(context, nodes, num_nodes) != 0) {
+            break;
+        }
+    }
+
+    return return_code;
+}
@@ -0,0 +1,234 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "brnflip.h"
+#include "brnflip_internal.h"
+
+/* Dictionary Views
+ *
+ * A view never copies a word. It holds the offset of each word's length byte
+ * from the start of the dictionary, so a symbol is turned into its word with
+ * one lookup into the caller's buffer. Word lookups go through an open
+ * addressing hash table of symbols, kept at most half full and probed
+ * linearly, which holds nothing but the symbol and is compared against the
+ * brain itself. Both are single allocations however many words there are.
+ */
+
+// The table holds symbol + 1, so that 0 marks an empty slot.
+static const uint32_t empty_slot = 0;
+
+static uint64_t brnflip_dictionary_hash(const char* word, size_t length)
+{
+    // 64-bit FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    size_t i;
+    for (i = 0; i < length; ++i) {
+        hash ^= (unsigned char) word[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Returns the word for a symbol known to be in the dictionary.
+static const char* brnflip_dictionary_entry(
+    const brnflip_dictionary* dictionary,
+    uint32_t                  symbol,
+    size_t*                   out_length
+)
+{
+    const char* word = dictionary->words + dictionary->offsets[symbol];
+
+    *out_length = (unsigned char) *word;
+    return word + 1;
+}
+
+/* Adds a symbol to the hash table, unless the table already holds the same
+ * word, in which case the earlier symbol is kept, as MegaHAL would find it
+ * first.
+ */
+static void brnflip_dictionary_insert(
+    brnflip_dictionary* dictionary,
+    uint32_t            symbol
+)
+{
+    size_t      length;
+    const char* word = brnflip_dictionary_entry(dictionary, symbol, &length);
+    uint64_t    slot = brnflip_dictionary_hash(word, length) &
+        dictionary->table_mask;
+
+    while (dictionary->table[slot] != empty_slot) {
+        size_t      other_length;
+        const char* other = brnflip_dictionary_entry(
+            dictionary,
+            dictionary->table[slot] - 1,
+            &other_length
+        );
+
+        if (other_length == length && memcmp(other, word, length) == 0) {
+            return;
+        }
+
+        slot = (slot + 1) & dictionary->table_mask;
+    }
+
+    dictionary->table[slot] = symbol + 1;
+}
+
+brnflip_error brnflip_dictionary_open(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    int                       hashed,
+    brnflip_dictionary*       out_dictionary
+)
+{
+    memset(out_dictionary, 0, sizeof(brnflip_dictionary));
+
+    size_t position = (size_t) info->dictionary_offset;
+
+    if (info->dictionary_offset < brnflip_header_length ||
+        brain_length < sizeof(uint32_t) ||
+        position > brain_length - sizeof(uint32_t) ||
+        brain_length - position > UINT32_MAX ||
+        (info->file_type != big_endian && info->file_type != little_endian)) {
+        return invalid_file;
+    }
+
+    uint32_t num_words;
+    memcpy(&num_words, brain + position, sizeof(uint32_t));
+
+    if (info->file_type != megahal_native_endianess) {
+        brnflip_flip_32_in_place((char*) &num_words);
+    }
+
+    // Every word takes at least its length byte.
+    if (num_words == 0 ||
+        num_words > brain_length - position - sizeof(uint32_t) ||
+        num_words > SIZE_MAX / (2 * sizeof(uint32_t))) {
+        return invalid_file;
+    }
+
+    uint32_t* offsets = (uint32_t*) malloc(num_words * sizeof(uint32_t));
+
+    if (offsets == NULL) {
+        return invalid_file;
+    }
+
+    const char* words  = brain + position;
+    size_t      length = brain_length - position;
+    size_t      offset = sizeof(uint32_t);
+
+    uint32_t i;
+    for (i = 0; i < num_words && offset < length; ++i) {
+        offsets[i] = (uint32_t) offset;
+        offset += 1 + (unsigned char) words[offset];
+    }
+
+    if (i != num_words || offset != length) {
+        free(offsets);
+        return invalid_file;
+    }
+
+    out_dictionary->words     = words;
+    out_dictionary->num_words = num_words;
+    out_dictionary->offsets   = offsets;
+
+    if (!hashed) {
+        return no_error;
+    }
+
+    uint64_t table_length = 2;
+
+    while (table_length < (uint64_t) num_words * 2) {
+        table_length *= 2;
+    }
+
+    out_dictionary->table = (uint32_t*) calloc(table_length, sizeof(uint32_t));
+
+    if (out_dictionary->table == NULL) {
+        brnflip_dictionary_close(out_dictionary);
+        return invalid_file;
+    }
+
+    out_dictionary->table_mask = table_length - 1;
+
+    for (i = 0; i < num_words; ++i) {
+        brnflip_dictionary_insert(out_dictionary, i);
+    }
+
+    return no_error;
+}
+
+const char* brnflip_dictionary_word(
+    const brnflip_dictionary* dictionary,
+    uint32_t                  symbol,
+    size_t*                   out_length
+)
+{
+    if (symbol >= dictionary->num_words) {
+        return NULL;
+    }
+
+    return brnflip_dictionary_entry(dictionary, symbol, out_length);
+}
+
+int brnflip_dictionary_find(
+    const brnflip_dictionary* dictionary,
+    const char*               word,
+    size_t                    length,
+    uint32_t*                 out_symbol
+)
+{
+    if (dictionary->table == NULL) {
+        return 0;
+    }
+
+    uint64_t slot = brnflip_dictionary_hash(word, length) &
+        dictionary->table_mask;
+
+    while (dictionary->table[slot] != empty_slot) {
+        uint32_t    symbol = dictionary->table[slot] - 1;
+        size_t      other_length;
+        const char* other = brnflip_dictionary_entry(
+            dictionary,
+            symbol,
+            &other_length
+        );
+
+        if (other_length == length && memcmp(other, word, length) == 0) {
+            *out_symbol = symbol;
+            return 1;
+        }
+
+        slot = (slot + 1) & dictionary->table_mask;
+    }
+
+    return 0;
+}
+
+void brnflip_dictionary_close(brnflip_dictionary* dictionary)
+{
+    free(dictionary->offsets);
+    free(dictionary->table);
+    memset(dictionary, 0, sizeof(brnflip_dictionary));
+}
@@ -0,0 +1,180 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "brnflip.h"
+#include "cli.h"
+
+#if !defined(_WIN32) && !defined(DOS)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Brain Files in Place
+ *
+ * Batch conversion and the watcher both convert brains where they lie. Each
+ * worker reads a whole brain into a buffer it keeps from one brain to the
+ * next, and a brain that needs flipping is written to a hidden temporary
+ * file beside it, .<name>.brnflip-XXXXXX, which is then renamed over it. A
+ * crash or a full disk therefore never leaves a brain half converted, and a
+ * reader only ever sees the old brain or the new one.
+ */
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+int read_file(int fd, size_t length, char** buffer, size_t* capacity)
+{
+    // The old contents need not survive, so there is nothing to realloc.
+    if (length > *capacity) {
+        brnflip_free_buffer(*buffer, *capacity);
+        *capacity = 0;
+        *buffer   = (char*) brnflip_alloc_buffer(length);
+
+        if (*buffer == NULL) {
+            return 0;
+        }
+
+        *capacity = length;
+    }
+
+    #ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    #endif
+
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t count = pread(fd, *buffer + done, length - done, done);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            return 0;
+        }
+
+        done += (size_t) count;
+    }
+
+    return 1;
+}
+
+const char* replace_file(
+    const char*        path,
+    const char*        buffer,
+    size_t             length,
+    const struct stat* original,
+    struct stat*       out_temp_stat
+)
+{
+    char* target = realpath(path, NULL);
+
+    if (target == NULL) {
+        return "unable to resolve path";
+    }
+
+    const char* slash     = strrchr(target, '/');
+    const char* name      = slash != NULL ? slash + 1 : target;
+    int         directory = slash != NULL ? (int) (slash - target) : 1;
+    size_t      temp_size = strlen(target) + sizeof(TEMP_FILE_INFIX) + 16;
+    char*       temp      = (char*) malloc(temp_size);
+
+    if (temp == NULL) {
+        free(target);
+        return "out of memory";
+    }
+
+    snprintf(
+        temp,
+        temp_size,
+        "%.*s/.%s" TEMP_FILE_INFIX "XXXXXX",
+        directory,
+        slash != NULL ? target : ".",
+        name
+    );
+
+    int fd = mkstemp(temp);
+
+    if (fd < 0) {
+        free(temp);
+        free(target);
+        return "unable to create temporary file";
+    }
+
+    const char* message = NULL;
+    size_t      done    = 0;
+
+    while (done < length) {
+        ssize_t count = write(fd, buffer + done, length - done);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            break;
+        }
+
+        done += (size_t) count;
+    }
+
+    // Ownership can only be kept when running as the owner or root.
+    if (fchown(fd, original->st_uid, original->st_gid) != 0) {
+        errno = 0;
+    }
+
+    if (done != length ||
+        fchmod(fd, original->st_mode & 07777) != 0 ||
+        fsync(fd) != 0 ||
+        fstat(fd, out_temp_stat) != 0) {
+        message = "unable to write file";
+    }
+
+    if (close(fd) != 0 && message == NULL) {
+        message = "unable to write file";
+    }
+
+    struct stat current;
+
+    if (message == NULL &&
+        (stat(target, &current) != 0 ||
+         current.st_ino != original->st_ino ||
+         current.st_size != original->st_size ||
+         current.st_mtim.tv_sec != original->st_mtim.tv_sec ||
+         current.st_mtim.tv_nsec != original->st_mtim.tv_nsec)) {
+        message = "changed while converting";
+    }
+
+    if (message == NULL && rename(temp, target) != 0) {
+        message = "unable to replace file";
+    }
+
+    if (message != NULL) {
+        unlink(temp);
+    }
+
+    free(temp);
+    free(target);
+    return message;
+}
+
+#endif
@@ -0,0 +1,352 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "brnflip_internal.h"
+#include "generate.h"
+
+/* Brain Generation
+ *
+ * Each tree is given a budget of nodes and written in pre-order. A node passes
+ * what is left of its budget on to its children, splitting it evenly between
+ * them, and whatever a child's subtree does not use goes back to the next
+ * sibling. A node's branch count is drawn from the fanout distribution, but it
+ * is raised when fewer children could not hold the rest of its budget even if
+ * every subtree below them were full. This keeps the tree shaped by the
+ * distribution while still landing on the requested number of nodes.
+ */
+
+static const uint32_t max_generated_depth = 1 << 16;
+static const uint32_t max_branch          = 0xffff;
+static const uint32_t max_word_length     = 12;
+
+typedef struct
+{
+    uint32_t children_left;
+    uint64_t budget_left;
+} brngen_frame;
+
+typedef struct
+{
+    const brngen_options* options;
+    char*                 position;
+    uint64_t              state;
+    uint64_t              num_nodes;
+    const uint64_t*       subtree_capacity;
+} brngen_context;
+
+static uint64_t brngen_random(brngen_context* context)
+{
+    // xorshift64*, so that a seed produces the same brain on every platform.
+    context->state ^= context->state >> 12;
+    context->state ^= context->state << 25;
+    context->state ^= context->state >> 27;
+
+    return context->state * 0x2545f4914f6cdd1dULL;
+}
+
+static void brngen_store(
+    brngen_context* context,
+    uint64_t        value,
+    size_t          length
+)
+{
+    size_t i;
+    for (i = 0; i < length; ++i) {
+        size_t shift = context->options->byte_order == big_endian ?
+            length - 1 - i : i;
+
+        context->position[i] = (char) (value >> (shift * 8));
+    }
+
+    context->position += length;
+}
+
+static uint32_t brngen_draw_fanout(brngen_context* context)
+{
+    uint32_t max_fanout = context->options->max_fanout;
+
+    if (context->options->distribution == fanout_uniform) {
+        return (uint32_t) (brngen_random(context) % ((uint64_t) max_fanout + 1));
+    }
+
+    uint64_t bits   = brngen_random(context);
+    uint32_t fanout = 0;
+
+    while (fanout < max_fanout && (bits & 1)) {
+        ++fanout;
+        bits >>= 1;
+
+        if (bits == 0) {
+            bits = brngen_random(context);
+        }
+    }
+
+    return fanout;
+}
+
+/* Chooses the branch count of a node at depth with budget nodes left to give
+ * to its descendants.
+ */
+static uint32_t brngen_choose_branch(
+    brngen_context* context,
+    uint32_t        depth,
+    uint64_t        budget
+)
+{
+    if (budget == 0 || depth >= context->options->max_depth) {
+        return 0;
+    }
+
+    uint64_t capacity = context->subtree_capacity[depth + 1];
+    uint64_t needed   = budget / capacity + (budget % capacity != 0);
+    uint64_t branch   = brngen_draw_fanout(context);
+
+    if (branch < needed) {
+        branch = needed;
+    }
+
+    if (branch > budget) {
+        branch = budget;
+    }
+
+    if (branch > max_branch) {
+        branch = max_branch;
+    }
+
+    return (uint32_t) branch;
+}
+
+static void brngen_generate_tree(
+    brngen_context* context,
+    brngen_frame*   frames,
+    uint64_t        budget
+)
+{
+    uint32_t num_words = context->options->num_words;
+
+    // frames[0] stands in for the parent of the root.
+    frames[0].children_left = 1;
+    frames[0].budget_left   = budget;
+
+    uint32_t num_frames = 1;
+
+    while (num_frames > 0) {
+        brngen_frame* frame = &frames[num_frames - 1];
+
+        if (frame->children_left == 0) {
+            uint64_t unused = frame->budget_left;
+
+            --num_frames;
+
+            if (num_frames > 0) {
+                frames[num_frames - 1].budget_left += unused;
+            }
+
+            continue;
+        }
+
+        uint64_t child_budget = frame->budget_left / frame->children_left;
+
+        frame->budget_left -= child_budget;
+        --frame->children_left;
+
+        uint32_t depth  = num_frames - 1;
+        uint32_t branch = brngen_choose_branch(
+            context,
+            depth,
+            child_budget - 1
+        );
+
+        brngen_store(context, brngen_random(context) % num_words, 2);
+        brngen_store(context, brngen_random(context), 4);
+        brngen_store(context, brngen_random(context), 2);
+        brngen_store(context, branch, 2);
+        ++context->num_nodes;
+
+        frames[num_frames].children_left = branch;
+        frames[num_frames].budget_left   = child_budget - 1;
+        ++num_frames;
+    }
+}
+
+static void brngen_generate_dictionary(brngen_context* context)
+{
+    static const char* special_words[] = { "<ERROR>", "<FIN>" };
+
+    uint32_t num_words = context->options->num_words;
+
+    brngen_store(context, num_words, 4);
+
+    uint32_t i;
+    for (i = 0; i < num_words; ++i) {
+        if (i < 2) {
+            size_t length = strlen(special_words[i]);
+
+            *context->position++ = (char) length;
+            memcpy(context->position, special_words[i], length);
+            context->position += length;
+        } else {
+            uint32_t length = 1 + brngen_random(context) % max_word_length;
+
+            *context->position++ = (char) length;
+
+            uint32_t j;
+            for (j = 0; j < length; ++j) {
+                *context->position++ = 'a' + brngen_random(context) % 26;
+            }
+        }
+    }
+}
+
+void brngen_default_options(brngen_options* options)
+{
+    options->num_nodes    = 100000;
+    options->max_depth    = 6;
+    options->max_fanout   = 8;
+    options->distribution = fanout_skewed;
+    options->num_words    = 3000;
+    options->byte_order   = megahal_native_endianess;
+    options->seed         = 1;
+}
+
+uint64_t brngen_nodes_for_length(size_t brain_length, uint32_t num_words)
+{
+    // Random words average 6.5 characters, plus their length byte.
+    size_t dictionary_length = sizeof(uint32_t) + 14 +
+        (num_words > 2 ? (size_t) (num_words - 2) * 15 / 2 : 0);
+
+    size_t overhead = brnflip_header_length + dictionary_length;
+
+    if (brain_length <
+        overhead + brnflip_num_trees * brnflip_tree_node_length) {
+        return brnflip_num_trees;
+    }
+
+    return (brain_length - overhead) / brnflip_tree_node_length;
+}
+
+int brngen_parse_size(const char* text, uint64_t* out_size)
+{
+    char*    end;
+    uint64_t size = strtoull(text, &end, 10);
+
+    if (end == text) {
+        return 0;
+    }
+
+    switch (*end) {
+        case 'g': case 'G': size <<= 10; // Fall through
+        case 'm': case 'M': size <<= 10; // Fall through
+        case 'k': case 'K': size <<= 10; ++end; break;
+    }
+
+    if (*end != '\0') {
+        return 0;
+    }
+
+    *out_size = size;
+    return 1;
+}
+
+size_t brngen_max_length(const brngen_options* options)
+{
+    return brnflip_header_length +
+        options->num_nodes * brnflip_tree_node_length +
+        sizeof(uint32_t) + 14 +
+        (options->num_words > 2 ?
+            (size_t) (options->num_words - 2) * (1 + max_word_length) : 0);
+}
+
+brnflip_error brngen_generate(
+    const brngen_options* options,
+    char*                 brain,
+    size_t*               out_length,
+    uint64_t*             out_num_nodes
+)
+{
+    if (options->num_nodes < brnflip_num_trees ||
+        options->num_words < 2 || options->num_words > 0x10000 ||
+        options->max_depth > max_generated_depth ||
+        options->max_fanout > max_branch ||
+        (options->byte_order != big_endian &&
+         options->byte_order != little_endian)) {
+        return invalid_file;
+    }
+
+    uint32_t max_depth = options->max_depth;
+
+    brngen_frame* frames = (brngen_frame*) malloc(
+        (max_depth + 2) * sizeof(brngen_frame)
+    );
+
+    uint64_t* subtree_capacity = (uint64_t*) malloc(
+        (max_depth + 2) * sizeof(uint64_t)
+    );
+
+    if (frames == NULL || subtree_capacity == NULL) {
+        free(frames);
+        free(subtree_capacity);
+        return invalid_file;
+    }
+
+    /* subtree_capacity[depth] is the number of nodes in a full subtree rooted
+     * at depth, saturating rather than overflowing.
+     */
+    subtree_capacity[max_depth + 1] = 0;
+
+    uint32_t depth = max_depth + 1;
+    while (depth-- > 0) {
+        uint64_t below = subtree_capacity[depth + 1];
+        uint64_t fanout = options->max_fanout;
+
+        if (fanout != 0 && below > (UINT64_MAX - 1) / fanout) {
+            subtree_capacity[depth] = UINT64_MAX;
+        } else {
+            subtree_capacity[depth] = 1 + below * fanout;
+        }
+    }
+
+    brngen_context context;
+
+    context.options          = options;
+    context.position         = brain;
+    context.state            = options->seed * 0x9e3779b97f4a7c15ULL + 1;
+    context.num_nodes        = 0;
+    context.subtree_capacity = subtree_capacity;
+
+    memcpy(context.position, brnflip_cookie, brnflip_cookie_length);
+    context.position[brnflip_cookie_length] = brnflip_model_order;
+    context.position += brnflip_header_length;
+
+    uint64_t first_budget = options->num_nodes / brnflip_num_trees;
+
+    brngen_generate_tree(&context, frames, first_budget);
+    brngen_generate_tree(&context, frames, options->num_nodes - first_budget);
+    brngen_generate_dictionary(&context);
+
+    free(frames);
+    free(subtree_capacity);
+
+    *out_length    = context.position - brain;
+    *out_num_nodes = context.num_nodes;
+
+    return no_error;
+}
@@ -0,0 +1,88 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A generator for synthetic MegaHALv8 brains, shared by brngen and brnbench.
+ * It is not part of the brnflip library.
+ */
+
+#ifndef __BRNFLIP_GENERATE_H__
+#define __BRNFLIP_GENERATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "brnflip.h"
+
+typedef enum
+{
+    // Every branch count from 0 to max_fanout is equally likely.
+    fanout_uniform = 0,
+
+    // Each branch count is half as likely as the one before it, which is
+    // closer to the long tail of contexts in a brain learned from real text.
+    fanout_skewed
+} brngen_distribution;
+
+/* The shape of a generated brain. num_nodes is shared between the two trees.
+ * Every node above max_depth draws its branch count from distribution, raised
+ * where needed to fit its share of num_nodes. If the nodes cannot fit within
+ * max_depth levels of at most 65535 children, the brain comes out smaller. The
+ * same seed always produces the same brain.
+ */
+
+typedef struct
+{
+    uint64_t            num_nodes;
+    uint32_t            max_depth;
+    uint32_t            max_fanout;
+    brngen_distribution distribution;
+    uint32_t            num_words;
+    megahal_filetype    byte_order;
+    uint64_t            seed;
+} brngen_options;
+
+/* Fills options with the defaults: a brain shaped like one of order 5 in the
+ * native byte order.
+ */
+void brngen_default_options(brngen_options* options);
+
+/* Returns the number of nodes that fill a brain of about brain_length bytes
+ * once the header and a dictionary of num_words words are accounted for.
+ */
+uint64_t brngen_nodes_for_length(size_t brain_length, uint32_t num_words);
+
+/* Parses a size such as 4096, 64K, 16M or 2G into out_size, using powers of
+ * 1024. Returns 0 if text is not a size.
+ */
+int brngen_parse_size(const char* text, uint64_t* out_size);
+
+/* Returns an upper bound on the length of the brain described by options. */
+size_t brngen_max_length(const brngen_options* options);
+
+/* Writes the brain described by options into brain, which must hold at least
+ * brngen_max_length bytes, and places its actual length into out_length and
+ * its number of nodes into out_num_nodes. Returns invalid_file if the options
+ * do not describe a valid brain.
+ */
+brnflip_error brngen_generate(
+    const brngen_options* options,
+    char*                 brain,
+    size_t*               out_length,
+    uint64_t*             out_num_nodes
+);
+
+#endif // __BRNFLIP_GENERATE_H__
@@ -0,0 +1,684 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "brnflip.h"
+#include "brnflip_internal.h"
+
+/* Indexed Brains
+ *
+ * An index holds the same brain as a MegaHALv8 file, but laid out so that it
+ * can be mapped and used without being parsed. The nodes are stored in
+ * breadth-first order, with the two roots first, so that the children of
+ * every node are contiguous and can be binary searched by symbol the way
+ * MegaHAL searches them. Breadth-first order is the pre-order of the file
+ * stably sorted by depth, since the nodes at each depth appear in the file in
+ * the same order as their parents. brnflip_export_index therefore walks the
+ * trees twice: once to count the nodes at each depth, and once to drop every
+ * node into the next free slot of its depth. A node's first child is the next
+ * free slot of the depth below at the time it is visited, which also holds
+ * for leaves, so first_child always tiles the nodes below the roots in order.
+ */
+
+static const char     index_magic[8]   = { 'M', 'H', 'A', 'L', 'I', 'D', 'X', '1' };
+static const uint32_t index_version    = 1;
+static const uint32_t index_byte_order = 0x01020304;
+static const uint64_t index_num_roots  = 2;
+
+typedef struct
+{
+    uint64_t* level_count;
+    uint16_t* pending;
+    size_t    capacity;
+    size_t    depth;
+} brnflip_index_walk;
+
+typedef struct
+{
+    uint64_t next_child;
+    uint32_t children_left;
+} brnflip_import_frame;
+
+static uint64_t brnflip_index_align(uint64_t offset)
+{
+    return (offset + BRNFLIP_INDEX_ALIGNMENT - 1) &
+        ~((uint64_t) BRNFLIP_INDEX_ALIGNMENT - 1);
+}
+
+static uint16_t brnflip_index_read_16(const char* data, int flipped)
+{
+    uint16_t value;
+
+    memcpy(&value, data, sizeof(uint16_t));
+
+    if (flipped) {
+        brnflip_flip_16_in_place((char*) &value);
+    }
+
+    return value;
+}
+
+static uint32_t brnflip_index_read_32(const char* data, int flipped)
+{
+    uint32_t value;
+
+    memcpy(&value, data, sizeof(uint32_t));
+
+    if (flipped) {
+        brnflip_flip_32_in_place((char*) &value);
+    }
+
+    return value;
+}
+
+static void brnflip_index_write_16(char* data, uint16_t value, int flipped)
+{
+    memcpy(data, &value, sizeof(uint16_t));
+
+    if (flipped) {
+        brnflip_flip_16_in_place(data);
+    }
+}
+
+static void brnflip_index_write_32(char* data, uint32_t value, int flipped)
+{
+    memcpy(data, &value, sizeof(uint32_t));
+
+    if (flipped) {
+        brnflip_flip_32_in_place(data);
+    }
+}
+
+/* Fills in the lengths and array offsets of an index holding num_nodes nodes
+ * and num_words words, whose characters take up words_length bytes.
+ */
+static void brnflip_index_layout(
+    uint64_t              num_nodes,
+    uint32_t              num_words,
+    uint64_t              words_length,
+    brnflip_index_header* header
+)
+{
+    uint64_t offset = brnflip_index_align(sizeof(brnflip_index_header));
+
+    memset(header, 0, sizeof(brnflip_index_header));
+    memcpy(header->magic, index_magic, sizeof(index_magic));
+
+    header->byte_order  = index_byte_order;
+    header->version     = index_version;
+    header->model_order = (uint32_t) brnflip_model_order;
+    header->num_words   = num_words;
+    header->num_nodes   = num_nodes;
+
+    // Every word also has a length byte in the brain, and a NUL in the index.
+    header->brain_length = brnflip_header_length +
+        num_nodes * brnflip_tree_node_length +
+        sizeof(uint32_t) + num_words + words_length;
+
+    header->symbol_offset = offset;
+    offset = brnflip_index_align(offset + num_nodes * sizeof(uint16_t));
+
+    header->usage_offset = offset;
+    offset = brnflip_index_align(offset + num_nodes * sizeof(uint32_t));
+
+    header->count_offset = offset;
+    offset = brnflip_index_align(offset + num_nodes * sizeof(uint16_t));
+
+    header->branch_offset = offset;
+    offset = brnflip_index_align(offset + num_nodes * sizeof(uint16_t));
+
+    header->first_child_offset = offset;
+    offset = brnflip_index_align(offset + num_nodes * sizeof(uint64_t));
+
+    header->word_offset_offset = offset;
+    offset = brnflip_index_align(
+        offset + ((uint64_t) num_words + 1) * sizeof(uint64_t)
+    );
+
+    header->words_offset = offset;
+    header->index_length = offset + words_length + num_words;
+}
+
+/* Zeroes the padding that aligns each array of an index, so that no stale
+ * memory is written out with it.
+ */
+static void brnflip_index_zero_padding(
+    char*                       index,
+    const brnflip_index_header* header
+)
+{
+    uint64_t ends[7][2] = {
+        { sizeof(brnflip_index_header), header->symbol_offset },
+        {
+            header->symbol_offset + header->num_nodes * sizeof(uint16_t),
+            header->usage_offset
+        },
+        {
+            header->usage_offset + header->num_nodes * sizeof(uint32_t),
+            header->count_offset
+        },
+        {
+            header->count_offset + header->num_nodes * sizeof(uint16_t),
+            header->branch_offset
+        },
+        {
+            header->branch_offset + header->num_nodes * sizeof(uint16_t),
+            header->first_child_offset
+        },
+        {
+            header->first_child_offset + header->num_nodes * sizeof(uint64_t),
+            header->word_offset_offset
+        },
+        {
+            header->word_offset_offset +
+                ((uint64_t) header->num_words + 1) * sizeof(uint64_t),
+            header->words_offset
+        }
+    };
+
+    size_t i;
+    for (i = 0; i < sizeof(ends) / sizeof(ends[0]); ++i) {
+        memset(index + ends[i][0], 0, ends[i][1] - ends[i][0]);
+    }
+}
+
+/* Reads the dictionary of a brain, placing the number of words into
+ * out_num_words and the number of characters in them into out_words_length.
+ * Returns invalid_file if the words do not end exactly at the end of the
+ * brain.
+ */
+static brnflip_error brnflip_index_read_dictionary(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    uint32_t*                 out_num_words,
+    uint64_t*                 out_words_length
+)
+{
+    size_t position = (size_t) info->dictionary_offset;
+
+    if (info->dictionary_offset < brnflip_header_length ||
+        brain_length < sizeof(uint32_t) ||
+        position > brain_length - sizeof(uint32_t)) {
+        return invalid_file;
+    }
+
+    uint32_t num_words = brnflip_index_read_32(
+        brain + position,
+        info->file_type != megahal_native_endianess
+    );
+
+    position += sizeof(uint32_t);
+
+    uint32_t i;
+    for (i = 0; i < num_words && position < brain_length; ++i) {
+        position += 1 + (unsigned char) brain[position];
+    }
+
+    if (i != num_words || position != brain_length) {
+        return invalid_file;
+    }
+
+    *out_num_words    = num_words;
+    *out_words_length = brain_length - info->dictionary_offset -
+        sizeof(uint32_t) - num_words;
+
+    return no_error;
+}
+
+/* Visits the next node of a pre-order walk, which has num_branches children,
+ * placing its depth into out_depth. The walk's stack of children still to be
+ * visited grows as needed, along with its count of nodes at each depth.
+ * Returns 0 if it could not grow.
+ */
+static int brnflip_index_walk_node(
+    brnflip_index_walk* walk,
+    uint16_t            num_branches,
+    size_t*             out_depth
+)
+{
+    *out_depth = walk->depth;
+
+    if (num_branches == 0) {
+        // A leaf completes its parent's subtree if it was the last child.
+        while (walk->depth > 0 && --walk->pending[walk->depth - 1] == 0) {
+            --walk->depth;
+        }
+
+        return 1;
+    }
+
+    if (walk->depth + 1 >= walk->capacity) {
+        size_t    capacity = walk->capacity * 2;
+        uint16_t* pending  = (uint16_t*) realloc(
+            walk->pending,
+            capacity * sizeof(uint16_t)
+        );
+
+        if (pending == NULL) {
+            return 0;
+        }
+
+        walk->pending = pending;
+
+        uint64_t* level_count = (uint64_t*) realloc(
+            walk->level_count,
+            (capacity + 1) * sizeof(uint64_t)
+        );
+
+        if (level_count == NULL) {
+            return 0;
+        }
+
+        memset(
+            level_count + walk->capacity + 1,
+            0,
+            (capacity - walk->capacity) * sizeof(uint64_t)
+        );
+
+        walk->level_count = level_count;
+        walk->capacity    = capacity;
+    }
+
+    walk->pending[walk->depth] = num_branches;
+    ++walk->depth;
+
+    return 1;
+}
+
+size_t brnflip_index_length(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info
+)
+{
+    brnflip_index_header header;
+    uint32_t             num_words;
+    uint64_t             words_length;
+
+    if (brnflip_index_read_dictionary(
+            brain,
+            brain_length,
+            info,
+            &num_words,
+            &words_length
+        ) != no_error) {
+        return 0;
+    }
+
+    brnflip_index_layout(
+        (info->dictionary_offset - brnflip_header_length) /
+            brnflip_tree_node_length,
+        num_words,
+        words_length,
+        &header
+    );
+
+    return (size_t) header.index_length;
+}
+
+brnflip_error brnflip_export_index(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    char*                     index
+)
+{
+    brnflip_index_header header;
+    brnflip_index_walk   walk;
+    uint32_t             num_words;
+    uint64_t             words_length;
+
+    int flipped = info->file_type != megahal_native_endianess;
+
+    if ((info->file_type != big_endian && info->file_type != little_endian) ||
+        (info->dictionary_offset - brnflip_header_length) %
+            brnflip_tree_node_length != 0 ||
+        brnflip_index_read_dictionary(
+            brain,
+            brain_length,
+            info,
+            &num_words,
+            &words_length
+        ) != no_error) {
+        return invalid_file;
+    }
+
+    uint64_t num_nodes =
+        (info->dictionary_offset - brnflip_header_length) /
+            brnflip_tree_node_length;
+
+    brnflip_index_layout(num_nodes, num_words, words_length, &header);
+
+    walk.capacity    = 64;
+    walk.depth       = 0;
+    walk.pending     = (uint16_t*) malloc(walk.capacity * sizeof(uint16_t));
+    walk.level_count = (uint64_t*) calloc(walk.capacity + 1, sizeof(uint64_t));
+
+    brnflip_error return_code = no_error;
+
+    if (walk.pending == NULL || walk.level_count == NULL) {
+        return_code = invalid_file;
+    }
+
+    /* The first walk counts the nodes at each depth, and checks that the nodes
+     * form exactly two trees.
+     */
+    const char* node = brain + brnflip_header_length;
+    uint64_t    num_roots = 0;
+    uint64_t    i;
+
+    for (i = 0; i < num_nodes && return_code == no_error; ++i) {
+        size_t depth;
+
+        num_roots += walk.depth == 0;
+
+        if (!brnflip_index_walk_node(
+                &walk,
+                brnflip_index_read_16(node + 8, flipped),
+                &depth
+            )) {
+            return_code = invalid_file;
+        } else {
+            ++walk.level_count[depth];
+        }
+
+        node += brnflip_tree_node_length;
+    }
+
+    if (num_roots != index_num_roots || walk.depth != 0) {
+        return_code = invalid_file;
+    }
+
+    if (return_code != no_error) {
+        free(walk.pending);
+        free(walk.level_count);
+        return return_code;
+    }
+
+    // level_count now becomes the next free slot at each depth.
+    uint64_t next_slot = 0;
+
+    for (i = 0; i <= walk.capacity; ++i) {
+        uint64_t count = walk.level_count[i];
+
+        walk.level_count[i] = next_slot;
+        next_slot += count;
+    }
+
+    memcpy(index, &header, sizeof(brnflip_index_header));
+    brnflip_index_zero_padding(index, &header);
+
+    uint16_t* symbols     = (uint16_t*) (index + header.symbol_offset);
+    uint32_t* usages      = (uint32_t*) (index + header.usage_offset);
+    uint16_t* counts      = (uint16_t*) (index + header.count_offset);
+    uint16_t* branches    = (uint16_t*) (index + header.branch_offset);
+    uint64_t* first_child = (uint64_t*) (index + header.first_child_offset);
+
+    // The second walk places each node, which cannot fail after the first.
+    node = brain + brnflip_header_length;
+
+    for (i = 0; i < num_nodes; ++i) {
+        size_t   depth;
+        uint16_t num_branches = brnflip_index_read_16(node + 8, flipped);
+
+        brnflip_index_walk_node(&walk, num_branches, &depth);
+
+        uint64_t slot = walk.level_count[depth]++;
+
+        symbols[slot]     = brnflip_index_read_16(node, flipped);
+        usages[slot]      = brnflip_index_read_32(node + 2, flipped);
+        counts[slot]      = brnflip_index_read_16(node + 6, flipped);
+        branches[slot]    = num_branches;
+        first_child[slot] = walk.level_count[depth + 1];
+
+        node += brnflip_tree_node_length;
+    }
+
+    free(walk.pending);
+    free(walk.level_count);
+
+    // Each word is copied without its length byte and terminated with a NUL.
+    uint64_t* word_offsets = (uint64_t*) (index + header.word_offset_offset);
+    char*     words        = index + header.words_offset;
+    size_t    position     = info->dictionary_offset + sizeof(uint32_t);
+    uint64_t  word_offset  = 0;
+
+    for (i = 0; i < num_words; ++i) {
+        size_t length = (unsigned char) brain[position];
+
+        word_offsets[i] = word_offset;
+        memcpy(words + word_offset, brain + position + 1, length);
+        words[word_offset + length] = '\0';
+
+        word_offset += length + 1;
+        position    += length + 1;
+    }
+
+    word_offsets[num_words] = word_offset;
+
+    return no_error;
+}
+
+brnflip_error brnflip_open_index(
+    const char*    index,
+    size_t         index_length,
+    brnflip_index* out_index
+)
+{
+    const brnflip_index_header* header = (const brnflip_index_header*) index;
+    brnflip_index_header        layout;
+
+    memset(out_index, 0, sizeof(brnflip_index));
+
+    if (index_length < sizeof(brnflip_index_header) ||
+        memcmp(header->magic, index_magic, sizeof(index_magic)) != 0 ||
+        header->byte_order != index_byte_order ||
+        header->version != index_version ||
+        header->model_order != (uint32_t) brnflip_model_order ||
+        header->num_nodes < index_num_roots ||
+        header->num_nodes > index_length / brnflip_tree_node_length ||
+        header->num_words == 0 ||
+        header->num_words > index_length / sizeof(uint64_t)) {
+        return invalid_file;
+    }
+
+    /* The offsets must be exactly those of an index of this shape, so that
+     * they do not need to be checked one by one.
+     */
+    uint64_t words_length = header->index_length - header->words_offset;
+
+    if (header->index_length > index_length ||
+        header->words_offset > header->index_length ||
+        words_length < header->num_words) {
+        return invalid_file;
+    }
+
+    brnflip_index_layout(
+        header->num_nodes,
+        header->num_words,
+        words_length - header->num_words,
+        &layout
+    );
+
+    if (memcmp(header, &layout, sizeof(brnflip_index_header)) != 0) {
+        return invalid_file;
+    }
+
+    const uint64_t* word_offsets =
+        (const uint64_t*) (index + header->word_offset_offset);
+    const char*     words = index + header->words_offset;
+
+    uint32_t i;
+    for (i = 0; i < header->num_words; ++i) {
+        if (word_offsets[i + 1] <= word_offsets[i] ||
+            word_offsets[i + 1] - word_offsets[i] > 256 ||
+            word_offsets[i + 1] > words_length ||
+            words[word_offsets[i + 1] - 1] != '\0') {
+            return invalid_file;
+        }
+    }
+
+    if (word_offsets[0] != 0 || word_offsets[header->num_words] != words_length) {
+        return invalid_file;
+    }
+
+    out_index->header       = header;
+    out_index->symbols      = (const uint16_t*) (index + header->symbol_offset);
+    out_index->usages       = (const uint32_t*) (index + header->usage_offset);
+    out_index->counts       = (const uint16_t*) (index + header->count_offset);
+    out_index->branches     = (const uint16_t*) (index + header->branch_offset);
+    out_index->first_child  =
+        (const uint64_t*) (index + header->first_child_offset);
+    out_index->word_offsets = word_offsets;
+    out_index->words        = words;
+
+    return no_error;
+}
+
+/* Writes the node in slot of an index into brain in the given byte order. */
+static void brnflip_index_write_node(
+    const brnflip_index* index,
+    uint64_t             slot,
+    char*                brain,
+    int                  flipped
+)
+{
+    brnflip_index_write_16(brain, index->symbols[slot], flipped);
+    brnflip_index_write_32(brain + 2, index->usages[slot], flipped);
+    brnflip_index_write_16(brain + 6, index->counts[slot], flipped);
+    brnflip_index_write_16(brain + 8, index->branches[slot], flipped);
+}
+
+brnflip_error brnflip_import_index(
+    const brnflip_index* index,
+    megahal_filetype     target,
+    char*                brain
+)
+{
+    const brnflip_index_header* header = index->header;
+
+    if (target != big_endian && target != little_endian) {
+        return invalid_file;
+    }
+
+    int      flipped   = target != megahal_native_endianess;
+    uint64_t num_nodes = header->num_nodes;
+
+    size_t        capacity = 64;
+    size_t        depth    = 0;
+    brnflip_import_frame* frames   = (brnflip_import_frame*) malloc(
+        capacity * sizeof(brnflip_import_frame)
+    );
+
+    if (frames == NULL) {
+        return invalid_file;
+    }
+
+    memcpy(brain, brnflip_cookie, brnflip_cookie_length);
+    brain[brnflip_cookie_length] = brnflip_model_order;
+
+    /* The trees are written back in pre-order by a depth-first walk from each
+     * root. Since the trees of an untrusted index have not been checked, every
+     * node's children must come after it and within the index, and the walk
+     * must write exactly num_nodes nodes, so that it always terminates.
+     */
+    char*         node        = brain + brnflip_header_length;
+    uint64_t      written     = 0;
+    uint64_t      root        = 0;
+    brnflip_error return_code = no_error;
+
+    while (return_code == no_error && (depth > 0 || root < index_num_roots)) {
+        uint64_t slot;
+
+        if (depth == 0) {
+            slot = root++;
+        } else if (frames[depth - 1].children_left == 0) {
+            --depth;
+            continue;
+        } else {
+            slot = frames[depth - 1].next_child++;
+            --frames[depth - 1].children_left;
+        }
+
+        if (written == num_nodes) {
+            return_code = invalid_file;
+            break;
+        }
+
+        brnflip_index_write_node(index, slot, node, flipped);
+        node += brnflip_tree_node_length;
+        ++written;
+
+        uint16_t num_branches = index->branches[slot];
+
+        if (num_branches == 0) {
+            continue;
+        }
+
+        uint64_t first_child = index->first_child[slot];
+
+        if (first_child <= slot || first_child > num_nodes - num_branches) {
+            return_code = invalid_file;
+            break;
+        }
+
+        if (depth == capacity) {
+            brnflip_import_frame* grown = (brnflip_import_frame*) realloc(
+                frames,
+                capacity * 2 * sizeof(brnflip_import_frame)
+            );
+
+            if (grown == NULL) {
+                return_code = invalid_file;
+                break;
+            }
+
+            frames    = grown;
+            capacity *= 2;
+        }
+
+        frames[depth].next_child    = first_child;
+        frames[depth].children_left = num_branches;
+        ++depth;
+    }
+
+    free(frames);
+
+    if (return_code != no_error || written != num_nodes) {
+        return invalid_file;
+    }
+
+    brnflip_index_write_32(node, header->num_words, flipped);
+    node += sizeof(uint32_t);
+
+    uint32_t i;
+    for (i = 0; i < header->num_words; ++i) {
+        const char* word   = index->words + index->word_offsets[i];
+        size_t      length = index->word_offsets[i + 1] -
+            index->word_offsets[i] - 1;
+
+        *node++ = (char) length;
+        memcpy(node, word, length);
+        node += length;
+    }
+
+    return no_error;
+}
@@ -0,0 +1,963 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "brnflip_internal.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BRNFLIP_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+/* Node Kernels
+ *
+ * Every tree node is a fixed 10-byte record, so the node region of a brain is
+ * a flat array that can be flipped without looking at its contents. The
+ * kernels below all compute the same permutation:
+ *
+ * Byte in node | 0 1 | 2 3 4 5 | 6 7 | 8 9
+ * -------------+-----+---------+-----+-----
+ * Taken from   | 1 0 | 5 4 3 2 | 7 6 | 9 8
+ *
+ * The vector kernels work on blocks of 80 bytes (eight nodes, five 16-byte
+ * lanes), which is the smallest span after which the pattern repeats on a
+ * 16-byte boundary. Within a block, only the usage field of the seventh node
+ * (bytes 62-65) straddles a lane boundary; every other field can be swapped
+ * with a single in-lane shuffle. All of a block's loads happen before any of
+ * its stores, so the kernels are safe to run in place. Nodes left over after
+ * the last whole block are handled by the scalar kernel.
+ */
+
+static inline uint16_t brnflip_swap_16(uint16_t x)
+{
+    return (uint16_t) ((x >> 8) | (x << 8));
+}
+
+static inline uint32_t brnflip_swap_32(uint32_t x)
+{
+    return ((x >> 24) & 0x000000ff) |
+           ((x >>  8) & 0x0000ff00) |
+           ((x <<  8) & 0x00ff0000) |
+           ((x << 24) & 0xff000000);
+}
+
+static void brnflip_flip_nodes_scalar(
+    const char* src,
+    char*       dst,
+    size_t      num_nodes
+)
+{
+    uint16_t symbol;
+    uint32_t usage;
+    uint16_t count;
+    uint16_t branch;
+
+    size_t i;
+    for (i = 0; i < num_nodes; ++i) {
+        memcpy(&symbol, src,     sizeof(uint16_t));
+        memcpy(&usage,  src + 2, sizeof(uint32_t));
+        memcpy(&count,  src + 6, sizeof(uint16_t));
+        memcpy(&branch, src + 8, sizeof(uint16_t));
+
+        symbol = brnflip_swap_16(symbol);
+        usage  = brnflip_swap_32(usage);
+        count  = brnflip_swap_16(count);
+        branch = brnflip_swap_16(branch);
+
+        memcpy(dst,     &symbol, sizeof(uint16_t));
+        memcpy(dst + 2, &usage,  sizeof(uint32_t));
+        memcpy(dst + 6, &count,  sizeof(uint16_t));
+        memcpy(dst + 8, &branch, sizeof(uint16_t));
+
+        src += brnflip_tree_node_length;
+        dst += brnflip_tree_node_length;
+    }
+}
+
+#ifdef BRNFLIP_X86_KERNELS
+
+#define BLOCK_NODES 8
+#define BLOCK_BYTES 80
+
+/* In-lane shuffle masks for each of the five lanes of a block. A -1 produces
+ * a zero byte, which is later filled in from the neighbouring lane using
+ * cross_lane_masks.
+ */
+static const int8_t lane_masks[5][16] = {
+    {  1,  0,  5,  4,  3,  2,  7,  6,  9,  8, 11, 10, 15, 14, 13, 12 },
+    {  1,  0,  3,  2,  5,  4,  9,  8,  7,  6, 11, 10, 13, 12, 15, 14 },
+    {  3,  2,  1,  0,  5,  4,  7,  6,  9,  8, 13, 12, 11, 10, 15, 14 },
+    {  1,  0,  3,  2,  7,  6,  5,  4,  9,  8, 11, 10, 13, 12, -1, -1 },
+    { -1, -1,  3,  2,  5,  4,  7,  6, 11, 10,  9,  8, 13, 12, 15, 14 },
+};
+
+/* Lane 3 takes its last two bytes from the start of lane 4, and lane 4 takes
+ * its first two bytes from the end of lane 3.
+ */
+static const int8_t cross_lane_masks[5][16] = {
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  0 },
+    { 15, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+};
+
+/* SSE2 has no byte shuffle, so the SSE2 kernel treats a block as 40 16-bit
+ * words. It swaps the bytes of every word with shifts, then exchanges the two
+ * halves of each usage field: words 5n+1 take the following word, and words
+ * 5n+2 take the preceding word.
+ */
+static const int16_t take_next_word[5][8] = {
+    {  0, -1,  0,  0,  0,  0, -1,  0 },
+    {  0,  0,  0, -1,  0,  0,  0,  0 },
+    { -1,  0,  0,  0,  0, -1,  0,  0 },
+    {  0,  0, -1,  0,  0,  0,  0, -1 },
+    {  0,  0,  0,  0, -1,  0,  0,  0 },
+};
+
+static const int16_t take_previous_word[5][8] = {
+    {  0,  0, -1,  0,  0,  0,  0, -1 },
+    {  0,  0,  0,  0, -1,  0,  0,  0 },
+    {  0, -1,  0,  0,  0,  0, -1,  0 },
+    {  0,  0,  0, -1,  0,  0,  0,  0 },
+    { -1,  0,  0,  0,  0, -1,  0,  0 },
+};
+
+__attribute__((target("sse2")))
+static void brnflip_flip_nodes_sse2(
+    const char* src,
+    char*       dst,
+    size_t      num_nodes
+)
+{
+    __m128i next_masks[5];
+    __m128i previous_masks[5];
+
+    int lane;
+    for (lane = 0; lane < 5; ++lane) {
+        next_masks[lane] = _mm_loadu_si128(
+            (const __m128i*) take_next_word[lane]
+        );
+        previous_masks[lane] = _mm_loadu_si128(
+            (const __m128i*) take_previous_word[lane]
+        );
+    }
+
+    size_t num_blocks = num_nodes / BLOCK_NODES;
+    size_t i;
+    for (i = 0; i < num_blocks; ++i) {
+        __m128i words[7];
+
+        words[0] = _mm_setzero_si128();
+        words[6] = _mm_setzero_si128();
+
+        for (lane = 0; lane < 5; ++lane) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (src + lane * 16));
+            words[lane + 1] = _mm_or_si128(
+                _mm_slli_epi16(v, 8),
+                _mm_srli_epi16(v, 8)
+            );
+        }
+
+        for (lane = 0; lane < 5; ++lane) {
+            __m128i v = words[lane + 1];
+
+            __m128i next = _mm_or_si128(
+                _mm_srli_si128(v, 2),
+                _mm_slli_si128(words[lane + 2], 14)
+            );
+
+            __m128i previous = _mm_or_si128(
+                _mm_slli_si128(v, 2),
+                _mm_srli_si128(words[lane], 14)
+            );
+
+            __m128i moved = _mm_or_si128(
+                next_masks[lane],
+                previous_masks[lane]
+            );
+
+            v = _mm_or_si128(
+                _mm_andnot_si128(moved, v),
+                _mm_or_si128(
+                    _mm_and_si128(next, next_masks[lane]),
+                    _mm_and_si128(previous, previous_masks[lane])
+                )
+            );
+
+            _mm_storeu_si128((__m128i*) (dst + lane * 16), v);
+        }
+
+        src += BLOCK_BYTES;
+        dst += BLOCK_BYTES;
+    }
+
+    brnflip_flip_nodes_scalar(src, dst, num_nodes % BLOCK_NODES);
+}
+
+__attribute__((target("ssse3")))
+static void brnflip_flip_nodes_ssse3(
+    const char* src,
+    char*       dst,
+    size_t      num_nodes
+)
+{
+    __m128i masks[5];
+
+    int lane;
+    for (lane = 0; lane < 5; ++lane) {
+        masks[lane] = _mm_loadu_si128((const __m128i*) lane_masks[lane]);
+    }
+
+    __m128i cross_3 = _mm_loadu_si128((const __m128i*) cross_lane_masks[3]);
+    __m128i cross_4 = _mm_loadu_si128((const __m128i*) cross_lane_masks[4]);
+
+    size_t num_blocks = num_nodes / BLOCK_NODES;
+    size_t i;
+    for (i = 0; i < num_blocks; ++i) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*) (src));
+        __m128i v1 = _mm_loadu_si128((const __m128i*) (src + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i*) (src + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i*) (src + 48));
+        __m128i v4 = _mm_loadu_si128((const __m128i*) (src + 64));
+
+        __m128i o3 = _mm_or_si128(
+            _mm_shuffle_epi8(v3, masks[3]),
+            _mm_shuffle_epi8(v4, cross_3)
+        );
+
+        __m128i o4 = _mm_or_si128(
+            _mm_shuffle_epi8(v4, masks[4]),
+            _mm_shuffle_epi8(v3, cross_4)
+        );
+
+        _mm_storeu_si128((__m128i*) (dst),      _mm_shuffle_epi8(v0, masks[0]));
+        _mm_storeu_si128((__m128i*) (dst + 16), _mm_shuffle_epi8(v1, masks[1]));
+        _mm_storeu_si128((__m128i*) (dst + 32), _mm_shuffle_epi8(v2, masks[2]));
+        _mm_storeu_si128((__m128i*) (dst + 48), o3);
+        _mm_storeu_si128((__m128i*) (dst + 64), o4);
+
+        src += BLOCK_BYTES;
+        dst += BLOCK_BYTES;
+    }
+
+    brnflip_flip_nodes_scalar(src, dst, num_nodes % BLOCK_NODES);
+}
+
+__attribute__((target("avx2")))
+static __m256i brnflip_lane_pair_256(const int8_t (*masks)[16], int lo, int hi)
+{
+    return _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) masks[lo])),
+        _mm_loadu_si128((const __m128i*) masks[hi]),
+        1
+    );
+}
+
+/* The AVX2 kernel works on two blocks at a time, so that the 10 lanes fill
+ * five 256-bit registers. Lane 3 and lane 4 of the first block land in
+ * different registers, while both lanes of the second block land in the last
+ * register, so the cross-lane bytes are brought in with a 128-bit permute.
+ */
+__attribute__((target("avx2")))
+static void brnflip_flip_nodes_avx2(
+    const char* src,
+    char*       dst,
+    size_t      num_nodes
+)
+{
+    __m256i m0 = brnflip_lane_pair_256(lane_masks, 0, 1);
+    __m256i m1 = brnflip_lane_pair_256(lane_masks, 2, 3);
+    __m256i m2 = brnflip_lane_pair_256(lane_masks, 4, 0);
+    __m256i m3 = brnflip_lane_pair_256(lane_masks, 1, 2);
+    __m256i m4 = brnflip_lane_pair_256(lane_masks, 3, 4);
+
+    __m256i c1 = brnflip_lane_pair_256(cross_lane_masks, 0, 3);
+    __m256i c2 = brnflip_lane_pair_256(cross_lane_masks, 4, 0);
+    __m256i c4 = brnflip_lane_pair_256(cross_lane_masks, 3, 4);
+
+    size_t num_blocks = num_nodes / (BLOCK_NODES * 2);
+    size_t i;
+    for (i = 0; i < num_blocks; ++i) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*) (src));
+        __m256i v1 = _mm256_loadu_si256((const __m256i*) (src + 32));
+        __m256i v2 = _mm256_loadu_si256((const __m256i*) (src + 64));
+        __m256i v3 = _mm256_loadu_si256((const __m256i*) (src + 96));
+        __m256i v4 = _mm256_loadu_si256((const __m256i*) (src + 128));
+
+        __m256i x1 = _mm256_permute2x128_si256(v1, v2, 0x20);
+        __m256i x2 = _mm256_permute2x128_si256(v1, v2, 0x31);
+        __m256i x4 = _mm256_permute2x128_si256(v4, v4, 0x01);
+
+        __m256i o1 = _mm256_or_si256(
+            _mm256_shuffle_epi8(v1, m1),
+            _mm256_shuffle_epi8(x1, c1)
+        );
+
+        __m256i o2 = _mm256_or_si256(
+            _mm256_shuffle_epi8(v2, m2),
+            _mm256_shuffle_epi8(x2, c2)
+        );
+
+        __m256i o4 = _mm256_or_si256(
+            _mm256_shuffle_epi8(v4, m4),
+            _mm256_shuffle_epi8(x4, c4)
+        );
+
+        _mm256_storeu_si256((__m256i*) (dst),       _mm256_shuffle_epi8(v0, m0));
+        _mm256_storeu_si256((__m256i*) (dst + 32),  o1);
+        _mm256_storeu_si256((__m256i*) (dst + 64),  o2);
+        _mm256_storeu_si256((__m256i*) (dst + 96),  _mm256_shuffle_epi8(v3, m3));
+        _mm256_storeu_si256((__m256i*) (dst + 128), o4);
+
+        src += BLOCK_BYTES * 2;
+        dst += BLOCK_BYTES * 2;
+    }
+
+    brnflip_flip_nodes_ssse3(src, dst, num_nodes % (BLOCK_NODES * 2));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static __m512i brnflip_lane_quad_512(const int8_t (*masks)[16], int first)
+{
+    __m512i v = _mm512_castsi128_si512(
+        _mm_loadu_si128((const __m128i*) masks[first % 5])
+    );
+
+    v = _mm512_inserti32x4(
+        v, _mm_loadu_si128((const __m128i*) masks[(first + 1) % 5]), 1
+    );
+    v = _mm512_inserti32x4(
+        v, _mm_loadu_si128((const __m128i*) masks[(first + 2) % 5]), 2
+    );
+    v = _mm512_inserti32x4(
+        v, _mm_loadu_si128((const __m128i*) masks[(first + 3) % 5]), 3
+    );
+
+    return v;
+}
+
+/* The AVX-512 kernel works on four blocks at a time (20 lanes in five 512-bit
+ * registers). Each register's cross-lane bytes are gathered with a 64-bit
+ * permute that puts every straddling lane's neighbour into its slot.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static void brnflip_flip_nodes_avx512(
+    const char* src,
+    char*       dst,
+    size_t      num_nodes
+)
+{
+    __m512i m[5];
+    __m512i c[5];
+
+    int r;
+    for (r = 0; r < 5; ++r) {
+        m[r] = brnflip_lane_quad_512(lane_masks, r * 4);
+        c[r] = brnflip_lane_quad_512(cross_lane_masks, r * 4);
+    }
+
+    __m512i p0 = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 8, 9);
+    __m512i p1 = _mm512_setr_epi64(14, 15, 2, 3, 4, 5, 6, 7);
+    __m512i p2 = _mm512_setr_epi64(2, 3, 0, 1, 4, 5, 6, 7);
+    __m512i p3 = _mm512_setr_epi64(0, 1, 4, 5, 2, 3, 6, 7);
+    __m512i p4 = _mm512_setr_epi64(0, 1, 2, 3, 6, 7, 4, 5);
+
+    size_t num_blocks = num_nodes / (BLOCK_NODES * 4);
+    size_t i;
+    for (i = 0; i < num_blocks; ++i) {
+        __m512i v0 = _mm512_loadu_si512((const void*) (src));
+        __m512i v1 = _mm512_loadu_si512((const void*) (src + 64));
+        __m512i v2 = _mm512_loadu_si512((const void*) (src + 128));
+        __m512i v3 = _mm512_loadu_si512((const void*) (src + 192));
+        __m512i v4 = _mm512_loadu_si512((const void*) (src + 256));
+
+        __m512i x0 = _mm512_permutex2var_epi64(v0, p0, v1);
+        __m512i x1 = _mm512_permutex2var_epi64(v1, p1, v0);
+        __m512i x2 = _mm512_permutexvar_epi64(p2, v2);
+        __m512i x3 = _mm512_permutexvar_epi64(p3, v3);
+        __m512i x4 = _mm512_permutexvar_epi64(p4, v4);
+
+        _mm512_storeu_si512((void*) (dst), _mm512_or_si512(
+            _mm512_shuffle_epi8(v0, m[0]), _mm512_shuffle_epi8(x0, c[0])
+        ));
+        _mm512_storeu_si512((void*) (dst + 64), _mm512_or_si512(
+            _mm512_shuffle_epi8(v1, m[1]), _mm512_shuffle_epi8(x1, c[1])
+        ));
+        _mm512_storeu_si512((void*) (dst + 128), _mm512_or_si512(
+            _mm512_shuffle_epi8(v2, m[2]), _mm512_shuffle_epi8(x2, c[2])
+        ));
+        _mm512_storeu_si512((void*) (dst + 192), _mm512_or_si512(
+            _mm512_shuffle_epi8(v3, m[3]), _mm512_shuffle_epi8(x3, c[3])
+        ));
+        _mm512_storeu_si512((void*) (dst + 256), _mm512_or_si512(
+            _mm512_shuffle_epi8(v4, m[4]), _mm512_shuffle_epi8(x4, c[4])
+        ));
+
+        src += BLOCK_BYTES * 4;
+        dst += BLOCK_BYTES * 4;
+    }
+
+    brnflip_flip_nodes_avx2(src, dst, num_nodes % (BLOCK_NODES * 4));
+}
+
+#endif // BRNFLIP_X86_KERNELS
+
+/* Signature Search
+ *
+ * The dictionary starts with its first word, "<ERROR>", stored with its
+ * length byte as the 8-byte signature "\x07<ERROR>". The search kernels find
+ * the last occurrence of the signature in a buffer. Rather than stopping at
+ * every byte equal to 7, they compare a whole block of positions against the
+ * signature's first byte and, seven bytes further on, its last byte, and only
+ * compare all 8 bytes at the positions where both match. Blocks are scanned
+ * from the end of the buffer towards the start, and each block's second load
+ * reaches at most 7 bytes past it, so no load leaves the buffer.
+ */
+
+static const char   dictionary_signature[] = "\x07<ERROR>";
+static const size_t signature_length       = 8;
+
+/* Checks the positions in [begin, end) from last to first. */
+static off_t brnflip_find_signature_bytes(
+    const char* data,
+    size_t      begin,
+    size_t      end
+)
+{
+    while (end > begin) {
+        --end;
+
+        if (data[end] == dictionary_signature[0] &&
+            memcmp(data + end, dictionary_signature, signature_length) == 0) {
+            return (off_t) end;
+        }
+    }
+
+    return -1;
+}
+
+/* Marks each zero byte of x with its high bit, without false positives. */
+static inline uint64_t brnflip_zero_bytes(uint64_t x)
+{
+    const uint64_t low_bits = 0x7f7f7f7f7f7f7f7fULL;
+
+    return ~(((x & low_bits) + low_bits) | x | low_bits);
+}
+
+static off_t brnflip_find_signature_scalar(const char* data, size_t length)
+{
+    const uint64_t ones  = 0x0101010101010101ULL;
+    const uint64_t first = ones * (unsigned char) dictionary_signature[0];
+    const uint64_t last  = ones * (unsigned char) dictionary_signature[7];
+
+    if (length < signature_length) {
+        return -1;
+    }
+
+    size_t end = length - signature_length + 1;
+
+    while (end >= 8) {
+        uint64_t heads;
+        uint64_t tails;
+
+        memcpy(&heads, data + end - 8, sizeof(uint64_t));
+        memcpy(&tails, data + end - 1, sizeof(uint64_t));
+
+        if (brnflip_zero_bytes(heads ^ first) &
+            brnflip_zero_bytes(tails ^ last)) {
+            off_t found = brnflip_find_signature_bytes(data, end - 8, end);
+
+            if (found >= 0) {
+                return found;
+            }
+        }
+
+        end -= 8;
+    }
+
+    return brnflip_find_signature_bytes(data, 0, end);
+}
+
+#ifdef BRNFLIP_X86_KERNELS
+
+/* Checks the positions in the block starting at begin whose bits are set in
+ * matches, from last to first.
+ */
+static off_t brnflip_find_signature_in_mask(
+    const char* data,
+    size_t      begin,
+    uint32_t    matches
+)
+{
+    while (matches != 0) {
+        int bit = 31 - __builtin_clz(matches);
+
+        const char* candidate = data + begin + bit;
+
+        if (memcmp(candidate, dictionary_signature, signature_length) == 0) {
+            return (off_t) (begin + bit);
+        }
+
+        matches &= ~(1u << bit);
+    }
+
+    return -1;
+}
+
+__attribute__((target("sse2")))
+static off_t brnflip_find_signature_sse2(const char* data, size_t length)
+{
+    const __m128i first = _mm_set1_epi8(dictionary_signature[0]);
+    const __m128i last  = _mm_set1_epi8(dictionary_signature[7]);
+
+    if (length < signature_length) {
+        return -1;
+    }
+
+    size_t end = length - signature_length + 1;
+
+    while (end >= 16) {
+        __m128i heads = _mm_loadu_si128((const __m128i*) (data + end - 16));
+        __m128i tails = _mm_loadu_si128((const __m128i*) (data + end - 9));
+
+        uint32_t matches = (uint32_t) _mm_movemask_epi8(
+            _mm_and_si128(
+                _mm_cmpeq_epi8(heads, first),
+                _mm_cmpeq_epi8(tails, last)
+            )
+        );
+
+        off_t found = brnflip_find_signature_in_mask(data, end - 16, matches);
+
+        if (found >= 0) {
+            return found;
+        }
+
+        end -= 16;
+    }
+
+    return brnflip_find_signature_bytes(data, 0, end);
+}
+
+__attribute__((target("avx2")))
+static off_t brnflip_find_signature_avx2(const char* data, size_t length)
+{
+    const __m256i first = _mm256_set1_epi8(dictionary_signature[0]);
+    const __m256i last  = _mm256_set1_epi8(dictionary_signature[7]);
+
+    if (length < signature_length) {
+        return -1;
+    }
+
+    size_t end = length - signature_length + 1;
+
+    while (end >= 32) {
+        __m256i heads = _mm256_loadu_si256((const __m256i*) (data + end - 32));
+        __m256i tails = _mm256_loadu_si256((const __m256i*) (data + end - 25));
+
+        uint32_t matches = (uint32_t) _mm256_movemask_epi8(
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(heads, first),
+                _mm256_cmpeq_epi8(tails, last)
+            )
+        );
+
+        off_t found = brnflip_find_signature_in_mask(data, end - 32, matches);
+
+        if (found >= 0) {
+            return found;
+        }
+
+        end -= 32;
+    }
+
+    return brnflip_find_signature_bytes(data, 0, end);
+}
+
+#endif // BRNFLIP_X86_KERNELS
+
+/* Non-temporal Copy
+ *
+ * When a converted brain is written to a different buffer than the one it was
+ * read from, the destination is not read again before it is written out, so
+ * there is no point in pulling it into the cache. The streaming copy writes
+ * whole 16-byte lines around the cache with non-temporal stores, and only
+ * uses ordinary stores for the unaligned bytes at either end.
+ */
+
+static void brnflip_copy_memcpy(char* dst, const char* src, size_t length)
+{
+    memcpy(dst, src, length);
+}
+
+#ifdef BRNFLIP_X86_KERNELS
+__attribute__((target("sse2")))
+static void brnflip_copy_nontemporal_sse2(
+    char*       dst,
+    const char* src,
+    size_t      length
+)
+{
+    size_t head = (16 - ((uintptr_t) dst & 15)) & 15;
+
+    if (head > length) {
+        head = length;
+    }
+
+    memcpy(dst, src, head);
+    dst    += head;
+    src    += head;
+    length -= head;
+
+    while (length >= 64) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*) (src));
+        __m128i v1 = _mm_loadu_si128((const __m128i*) (src + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i*) (src + 32));
+        __m128i v3 = _mm_loadu_si128((const __m128i*) (src + 48));
+
+        _mm_stream_si128((__m128i*) (dst),      v0);
+        _mm_stream_si128((__m128i*) (dst + 16), v1);
+        _mm_stream_si128((__m128i*) (dst + 32), v2);
+        _mm_stream_si128((__m128i*) (dst + 48), v3);
+
+        dst    += 64;
+        src    += 64;
+        length -= 64;
+    }
+
+    while (length >= 16) {
+        _mm_stream_si128(
+            (__m128i*) dst,
+            _mm_loadu_si128((const __m128i*) src)
+        );
+
+        dst    += 16;
+        src    += 16;
+        length -= 16;
+    }
+
+    memcpy(dst, src, length);
+
+    // Non-temporal stores are weakly ordered, so make them visible first.
+    _mm_sfence();
+}
+#endif // BRNFLIP_X86_KERNELS
+
+/* Checksums
+ *
+ * Brains are checksummed with CRC-32C, the Castagnoli polynomial, because
+ * x86 has had an instruction for it since SSE4.2 which checksums eight bytes
+ * at a time, many times faster than the trees can be walked. Elsewhere, the
+ * checksum is computed a byte at a time from a table. Many CPUs have SSE4.2
+ * but not AVX2, so the checksum is chosen on its own rather than along with
+ * the node kernel, and BRNFLIP_CRC_KERNEL, set to "sse42" or "table",
+ * overrides the choice as BRNFLIP_KERNEL does for the node kernels.
+ */
+
+static const uint32_t crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+static uint32_t brnflip_crc32c_table(uint32_t crc, const char* data, size_t length)
+{
+    uint32_t c = ~crc;
+
+    size_t i;
+    for (i = 0; i < length; ++i) {
+        c = crc32c_table[(c ^ (unsigned char) data[i]) & 0xff] ^ (c >> 8);
+    }
+
+    return ~c;
+}
+
+#ifdef BRNFLIP_X86_KERNELS
+__attribute__((target("sse4.2")))
+static uint32_t brnflip_crc32c_sse42(uint32_t crc, const char* data, size_t length)
+{
+    uint32_t c = ~crc;
+
+    // Up to alignment, so that the wide loads below are aligned.
+    while (length > 0 && ((uintptr_t) data & 7) != 0) {
+        c = _mm_crc32_u8(c, (unsigned char) *data);
+        ++data;
+        --length;
+    }
+
+    #ifdef __x86_64__
+    uint64_t c64 = c;
+
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(uint64_t));
+
+        c64 = _mm_crc32_u64(c64, word);
+
+        data   += 8;
+        length -= 8;
+    }
+
+    c = (uint32_t) c64;
+    #endif
+
+    while (length >= 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(uint32_t));
+
+        c = _mm_crc32_u32(c, word);
+
+        data   += 4;
+        length -= 4;
+    }
+
+    while (length > 0) {
+        c = _mm_crc32_u8(c, (unsigned char) *data);
+        ++data;
+        --length;
+    }
+
+    return ~c;
+}
+#endif // BRNFLIP_X86_KERNELS
+
+// Kernel selection
+
+typedef struct
+{
+    const char*           name;
+    brnflip_node_kernel   kernel;
+    brnflip_search_kernel search;
+    brnflip_copy_kernel   copy;
+    int                   (*supported)(void);
+} brnflip_kernel_entry;
+
+static int brnflip_always_supported(void)
+{
+    return 1;
+}
+
+#ifdef BRNFLIP_X86_KERNELS
+static int brnflip_sse2_supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static int brnflip_ssse3_supported(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+
+static int brnflip_avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static int brnflip_sse42_supported(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static int brnflip_avx512_supported(void)
+{
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+/* Ordered from most to least preferred. Each entry pairs a node kernel with
+ * the best search and copy kernels for the same instruction set, so that
+ * BRNFLIP_KERNEL selects all of them.
+ */
+static const brnflip_kernel_entry kernels[] = {
+#ifdef BRNFLIP_X86_KERNELS
+    {
+        "avx512",
+        brnflip_flip_nodes_avx512,
+        brnflip_find_signature_avx2,
+        brnflip_copy_nontemporal_sse2,
+        brnflip_avx512_supported
+    },
+    {
+        "avx2",
+        brnflip_flip_nodes_avx2,
+        brnflip_find_signature_avx2,
+        brnflip_copy_nontemporal_sse2,
+        brnflip_avx2_supported
+    },
+    {
+        "ssse3",
+        brnflip_flip_nodes_ssse3,
+        brnflip_find_signature_sse2,
+        brnflip_copy_nontemporal_sse2,
+        brnflip_ssse3_supported
+    },
+    {
+        "sse2",
+        brnflip_flip_nodes_sse2,
+        brnflip_find_signature_sse2,
+        brnflip_copy_nontemporal_sse2,
+        brnflip_sse2_supported
+    },
+#endif
+    {
+        "scalar",
+        brnflip_flip_nodes_scalar,
+        brnflip_find_signature_scalar,
+        brnflip_copy_memcpy,
+        brnflip_always_supported
+    },
+};
+
+static const size_t num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+
+// Written once under kernel_once, which also orders it before every read.
+static const brnflip_kernel_entry* selected_kernel = NULL;
+static pthread_once_t              kernel_once     = PTHREAD_ONCE_INIT;
+
+/* Picks the fastest kernel this CPU supports. Setting the BRNFLIP_KERNEL
+ * environment variable to the name of a supported kernel overrides the choice,
+ * which is useful for benchmarking and for comparing kernels' output.
+ */
+static void brnflip_choose_kernel(void)
+{
+    const brnflip_kernel_entry* kernel    = NULL;
+    const char*                 requested = getenv("BRNFLIP_KERNEL");
+
+    size_t i;
+    for (i = 0; i < num_kernels && kernel == NULL; ++i) {
+        if (!kernels[i].supported()) {
+            continue;
+        }
+
+        if (requested == NULL ||
+            strcmp(requested, kernels[i].name) == 0) {
+            kernel = &kernels[i];
+        }
+    }
+
+    if (kernel == NULL) {
+        kernel = &kernels[num_kernels - 1];
+    }
+
+    selected_kernel = kernel;
+}
+
+/* Returns the chosen kernel, choosing it on the first call. The first call may
+ * come from several threads at once, such as the workers of
+ * brnflip_flip_many, so the choice is made under pthread_once.
+ */
+static const brnflip_kernel_entry* brnflip_select_kernel(void)
+{
+    pthread_once(&kernel_once, brnflip_choose_kernel);
+
+    return selected_kernel;
+}
+
+static brnflip_crc_kernel selected_crc = NULL;
+static pthread_once_t     crc_once     = PTHREAD_ONCE_INIT;
+
+/* Picks the SSE4.2 checksum where the CPU has it, unless BRNFLIP_CRC_KERNEL
+ * asks for the table.
+ */
+static void brnflip_choose_crc_kernel(void)
+{
+    const char* requested = getenv("BRNFLIP_CRC_KERNEL");
+
+    selected_crc = brnflip_crc32c_table;
+
+    #ifdef BRNFLIP_X86_KERNELS
+    if (brnflip_sse42_supported() &&
+        (requested == NULL || strcmp(requested, "sse42") == 0)) {
+        selected_crc = brnflip_crc32c_sse42;
+    }
+    #else
+    (void) requested;
+    #endif
+}
+
+void brnflip_flip_nodes(const char* src, char* dst, size_t num_nodes)
+{
+    brnflip_select_kernel()->kernel(src, dst, num_nodes);
+}
+
+off_t brnflip_find_signature(const char* data, size_t length)
+{
+    return brnflip_select_kernel()->search(data, length);
+}
+
+void brnflip_copy_nontemporal(char* dst, const char* src, size_t length)
+{
+    brnflip_select_kernel()->copy(dst, src, length);
+}
+
+uint32_t brnflip_crc32c(uint32_t crc, const char* data, size_t length)
+{
+    pthread_once(&crc_once, brnflip_choose_crc_kernel);
+
+    return selected_crc(crc, data, length);
+}
+
+const char* brnflip_kernel_name(void)
+{
+    return brnflip_select_kernel()->name;
+}
@@ -0,0 +1,221 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "brnflip_internal.h"
+
+/* Parallel Work
+ *
+ * The node region is a flat array of fixed-size nodes, so work over it can be
+ * split into contiguous, node-aligned chunks with no coordination between
+ * them. brnflip_parallel_for posts the chunks as a job to a pool of worker
+ * threads that lives as long as the process, so that the phases of a
+ * conversion, and the conversions after it, do not each pay to start and join
+ * threads. The pool starts empty and grows the first time a call has more
+ * chunks than it has workers.
+ *
+ * The calling thread claims chunks of its own job alongside the workers, and
+ * only waits once every chunk has been claimed. A job therefore finishes even
+ * if no worker is free, or none could be started, and a chunk may itself call
+ * brnflip_parallel_for. Calls from several threads at once queue their jobs,
+ * and the workers take chunks from the oldest first.
+ */
+
+// Below this many nodes per thread, starting a thread costs more than it saves.
+const size_t brnflip_parallel_min_nodes_per_thread = 1 << 18;
+
+// One call to brnflip_parallel_for. Everything but fn and context is guarded.
+typedef struct brnflip_job
+{
+    brnflip_chunk_fn    fn;
+    void*               context;
+    size_t              num_nodes;
+    unsigned int        num_chunks;
+    unsigned int        next_chunk;
+    unsigned int        num_done;
+    pthread_cond_t      done;
+    struct brnflip_job* next;
+} brnflip_job;
+
+/* The pool. jobs lists the jobs with chunks still to be claimed, oldest
+ * first, and work is signalled whenever one is added.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_work = PTHREAD_COND_INITIALIZER;
+static brnflip_job*    pool_jobs = NULL;
+static unsigned int    pool_size = 0;
+
+/* Claims the next chunk of job, taking the job off the list once its last
+ * chunk is claimed. The pool lock must be held.
+ */
+static unsigned int brnflip_claim_chunk(brnflip_job* job)
+{
+    unsigned int chunk = job->next_chunk++;
+
+    if (job->next_chunk == job->num_chunks) {
+        brnflip_job** link = &pool_jobs;
+
+        while (*link != job) {
+            link = &(*link)->next;
+        }
+
+        *link = job->next;
+    }
+
+    return chunk;
+}
+
+/* Runs a claimed chunk of job without the pool lock, which must be held on
+ * entry and is held again on return.
+ */
+static void brnflip_run_chunk(brnflip_job* job, unsigned int chunk)
+{
+    pthread_mutex_unlock(&pool_lock);
+
+    job->fn(
+        job->context,
+        chunk,
+        brnflip_chunk_begin(job->num_nodes, job->num_chunks, chunk),
+        brnflip_chunk_begin(job->num_nodes, job->num_chunks, chunk + 1)
+    );
+
+    pthread_mutex_lock(&pool_lock);
+
+    if (++job->num_done == job->num_chunks) {
+        pthread_cond_signal(&job->done);
+    }
+}
+
+static void* brnflip_pool_worker(void* argument)
+{
+    (void) argument;
+
+    pthread_mutex_lock(&pool_lock);
+
+    for (;;) {
+        while (pool_jobs == NULL) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+
+        brnflip_job* job = pool_jobs;
+
+        brnflip_run_chunk(job, brnflip_claim_chunk(job));
+    }
+
+    return NULL;
+}
+
+/* Starts workers until the pool has num_workers of them, or one cannot be
+ * started. The pool lock must be held. Signals are blocked in the workers, so
+ * that they are only ever delivered to the program's own threads.
+ */
+static void brnflip_grow_pool(unsigned int num_workers)
+{
+    if (pool_size >= num_workers) {
+        return;
+    }
+
+    sigset_t all;
+    sigset_t old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    while (pool_size < num_workers) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, brnflip_pool_worker, NULL) != 0) {
+            break;
+        }
+
+        pthread_detach(thread);
+        ++pool_size;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+unsigned int brnflip_parallel_chunks(size_t num_nodes, unsigned int num_threads)
+{
+    size_t max_chunks = num_nodes / brnflip_parallel_min_nodes_per_thread;
+
+    if (num_threads > max_chunks) {
+        num_threads = (unsigned int) max_chunks;
+    }
+
+    return num_threads > 1 ? num_threads : 1;
+}
+
+size_t brnflip_chunk_begin(
+    size_t       num_nodes,
+    unsigned int num_chunks,
+    unsigned int chunk
+)
+{
+    return num_nodes * chunk / num_chunks;
+}
+
+void brnflip_parallel_for(
+    size_t           num_nodes,
+    unsigned int     num_chunks,
+    brnflip_chunk_fn fn,
+    void*            context
+)
+{
+    if (num_chunks <= 1) {
+        fn(context, 0, 0, num_nodes);
+        return;
+    }
+
+    brnflip_job job;
+    job.fn         = fn;
+    job.context    = context;
+    job.num_nodes  = num_nodes;
+    job.num_chunks = num_chunks;
+    job.next_chunk = 0;
+    job.num_done   = 0;
+    job.next       = NULL;
+    pthread_cond_init(&job.done, NULL);
+
+    pthread_mutex_lock(&pool_lock);
+
+    brnflip_grow_pool(num_chunks - 1);
+
+    brnflip_job** link = &pool_jobs;
+
+    while (*link != NULL) {
+        link = &(*link)->next;
+    }
+
+    *link = &job;
+    pthread_cond_broadcast(&pool_work);
+
+    while (job.next_chunk < job.num_chunks) {
+        brnflip_run_chunk(&job, brnflip_claim_chunk(&job));
+    }
+
+    while (job.num_done < job.num_chunks) {
+        pthread_cond_wait(&job.done, &pool_lock);
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+
+    pthread_cond_destroy(&job.done);
+}
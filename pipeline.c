@@ -0,0 +1,518 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "brnflip.h"
+#include "cli.h"
+
+#if !defined(_WIN32) && !defined(DOS)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Pipelined Conversion
+ *
+ * A brain is converted in windows of a fixed length, by three threads at once:
+ * a reader that preads window N + 1, the calling thread, which converts window
+ * N with a brnflip_stream, and a writer that pwrites window N - 1. The windows
+ * are a ring of queue_depth buffers that each pass from one thread to the
+ * next, so memory use is bounded by the ring however large the brain is, and
+ * the disk is kept busy while the CPU flips. This suits spinning disks and
+ * network filesystems, where faulting in a mapping page by page is slow.
+ *
+ * Every window is a whole number of BRNFLIP_NODE_LENGTH bytes, so a window
+ * never ends in the middle of the header, a node or the dictionary length, and
+ * the stream always converts it whole.
+ *
+ * Each thread times its own phase for --stats, so no two threads ever add to
+ * the same phase.
+ */
+
+typedef enum
+{
+    window_free = 0,
+    window_read,
+    window_converted
+} window_state;
+
+typedef enum
+{
+    pipeline_ok = 0,
+    pipeline_read_failed,
+    pipeline_convert_failed,
+    pipeline_write_failed
+} pipeline_status;
+
+typedef struct
+{
+    char*        data;
+    size_t       length;
+    off_t        offset;
+    int          last;
+    window_state state;
+} pipeline_window;
+
+typedef struct
+{
+    int                input_fd;
+    int                output_fd;
+    int                seekable;
+    off_t              input_length;
+    size_t             window_length;
+    unsigned int       queue_depth;
+    pipeline_window*   windows;
+    const cli_options* options;
+    pipeline_status    status;
+    pthread_mutex_t    lock;
+    pthread_cond_t     changed;
+} pipeline;
+
+/* Waits until a window reaches state, returning 0 if another thread has
+ * failed in the meantime.
+ */
+static int pipeline_wait(pipeline* p, pipeline_window* window, window_state state)
+{
+    pthread_mutex_lock(&p->lock);
+
+    while (window->state != state && p->status == pipeline_ok) {
+        pthread_cond_wait(&p->changed, &p->lock);
+    }
+
+    int ok = p->status == pipeline_ok;
+
+    pthread_mutex_unlock(&p->lock);
+
+    return ok;
+}
+
+// Passes a window on to the next thread.
+static void pipeline_pass(pipeline* p, pipeline_window* window, window_state state)
+{
+    pthread_mutex_lock(&p->lock);
+    window->state = state;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Stops every thread, keeping the first failure.
+static void pipeline_fail(pipeline* p, pipeline_status status)
+{
+    pthread_mutex_lock(&p->lock);
+
+    if (p->status == pipeline_ok) {
+        p->status = status;
+    }
+
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Reads a window, returning 0 unless all of it was read.
+static int pipeline_read(pipeline* p, pipeline_window* window)
+{
+    size_t done = 0;
+
+    while (done < window->length) {
+        ssize_t count = pread(
+            p->input_fd,
+            window->data + done,
+            window->length - done,
+            window->offset + (off_t) done
+        );
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            return 0;
+        }
+
+        done += (size_t) count;
+    }
+
+    return 1;
+}
+
+// Writes a window, returning 0 unless all of it was written.
+static int pipeline_write(pipeline* p, pipeline_window* window)
+{
+    size_t done = 0;
+
+    while (done < window->length) {
+        ssize_t count = p->seekable ?
+            pwrite(
+                p->output_fd,
+                window->data + done,
+                window->length - done,
+                window->offset + (off_t) done
+            ) :
+            write(p->output_fd, window->data + done, window->length - done);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            return 0;
+        }
+
+        done += (size_t) count;
+    }
+
+    return 1;
+}
+
+// Fills in the window that starts at offset.
+static void pipeline_place(pipeline* p, pipeline_window* window, off_t offset)
+{
+    off_t remaining = p->input_length - offset;
+
+    window->offset = offset;
+    window->length = remaining < (off_t) p->window_length ?
+        (size_t) remaining :
+        p->window_length;
+    window->last   = offset + (off_t) window->length == p->input_length;
+}
+
+/* Reads every window after the first, which convert_pipelined reads itself
+ * to detect the endianess.
+ */
+static void* pipeline_reader(void* argument)
+{
+    pipeline* p    = (pipeline*) argument;
+    int       last = p->windows[0].last;
+    off_t     next = (off_t) p->windows[0].length;
+
+    uint64_t i;
+    for (i = 1; !last; ++i) {
+        pipeline_window* window = &p->windows[i % p->queue_depth];
+
+        if (!pipeline_wait(p, window, window_free)) {
+            break;
+        }
+
+        pipeline_place(p, window, next);
+
+        uint64_t start = stats_start(p->options);
+
+        if (!pipeline_read(p, window)) {
+            pipeline_fail(p, pipeline_read_failed);
+            break;
+        }
+
+        stats_stop(p->options, cli_phase_read, start, window->length);
+
+        last  = window->last;
+        next += (off_t) window->length;
+
+        pipeline_pass(p, window, window_read);
+    }
+
+    return NULL;
+}
+
+// Writes every window once it has been converted.
+static void* pipeline_writer(void* argument)
+{
+    pipeline* p    = (pipeline*) argument;
+    int       last = 0;
+
+    uint64_t i;
+    for (i = 0; !last; ++i) {
+        pipeline_window* window = &p->windows[i % p->queue_depth];
+
+        if (!pipeline_wait(p, window, window_converted)) {
+            break;
+        }
+
+        uint64_t start = stats_start(p->options);
+
+        if (!pipeline_write(p, window)) {
+            pipeline_fail(p, pipeline_write_failed);
+            break;
+        }
+
+        stats_stop(p->options, cli_phase_write, start, window->length);
+
+        last = window->last;
+
+        pipeline_pass(p, window, window_free);
+    }
+
+    return NULL;
+}
+
+/* Converts every window as it is read, on the calling thread, so that the
+ * library's own statistics are collected. The stream is finished before the
+ * last window is passed on, so that a brain found to be damaged at its very
+ * end is never written out whole.
+ */
+static void pipeline_convert(pipeline* p, brnflip_stream* stream)
+{
+    int last = 0;
+
+    uint64_t i;
+    for (i = 0; !last; ++i) {
+        pipeline_window* window = &p->windows[i % p->queue_depth];
+
+        if (!pipeline_wait(p, window, window_read)) {
+            break;
+        }
+
+        size_t   converted;
+        uint64_t start = stats_start(p->options);
+
+        brnflip_error error = brnflip_stream_convert(
+            stream,
+            window->data,
+            window->length,
+            &converted
+        );
+
+        last = window->last;
+
+        if (error == no_error && converted != window->length) {
+            error = invalid_file;
+        }
+
+        if (error == no_error && last) {
+            error = brnflip_stream_finish(stream);
+        }
+
+        stats_stop(p->options, cli_phase_convert, start, converted);
+
+        if (error != no_error) {
+            pipeline_fail(p, pipeline_convert_failed);
+            break;
+        }
+
+        pipeline_pass(p, window, window_converted);
+    }
+}
+
+// Frees the windows that were allocated, which are those with data.
+static void pipeline_free_windows(pipeline* p)
+{
+    unsigned int i;
+    for (i = 0; i < p->queue_depth; ++i) {
+        brnflip_free_buffer(p->windows[i].data, p->window_length);
+    }
+
+    free(p->windows);
+}
+
+int convert_pipelined(
+    const char*        input,
+    const char*        output,
+    size_t             window_length,
+    unsigned int       queue_depth,
+    const cli_options* options,
+    int*               out_result
+)
+{
+    struct stat input_stat;
+    struct stat output_stat;
+    pipeline    p;
+
+    memset(&p, 0, sizeof(pipeline));
+
+    // Every window but the last must end on a node boundary.
+    window_length -= window_length % BRNFLIP_NODE_LENGTH;
+
+    if (window_length == 0 || queue_depth < 2) {
+        return 0;
+    }
+
+    uint64_t start = stats_start(options);
+
+    p.input_fd = open(input, O_RDONLY);
+
+    if (p.input_fd < 0) {
+        return 0;
+    }
+
+    if (fstat(p.input_fd, &input_stat) != 0 ||
+        !S_ISREG(input_stat.st_mode) ||
+        input_stat.st_size == 0) {
+        close(p.input_fd);
+        return 0;
+    }
+
+    #ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(p.input_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    #endif
+
+    p.input_length  = input_stat.st_size;
+    p.window_length = window_length;
+    p.queue_depth   = queue_depth;
+    p.options       = options;
+    p.windows       = (pipeline_window*) calloc(
+        queue_depth,
+        sizeof(pipeline_window)
+    );
+
+    unsigned int i;
+    for (i = 0; p.windows != NULL && i < queue_depth; ++i) {
+        p.windows[i].data = (char*) brnflip_alloc_buffer(window_length);
+
+        if (p.windows[i].data == NULL) {
+            break;
+        }
+    }
+
+    if (p.windows == NULL || i < queue_depth) {
+        fprintf(stderr, "Unable to allocate the pipeline's windows.\n");
+
+        if (p.windows != NULL) {
+            pipeline_free_windows(&p);
+        }
+
+        close(p.input_fd);
+        *out_result = 1;
+        return 1;
+    }
+
+    // The first window is read up front to detect the endianess.
+    pipeline_window* first = &p.windows[0];
+
+    pipeline_place(&p, first, 0);
+
+    int read = pipeline_read(&p, first);
+
+    stats_stop(options, cli_phase_read, start, first->length);
+    start = stats_start(options);
+
+    megahal_filetype source = unknown_filetype;
+    brnflip_error    error  = read ?
+        brnflip_stream_detect(first->data, first->length, first->last, &source) :
+        invalid_file;
+
+    stats_stop(options, cli_phase_convert, start, 0);
+
+    // A brain the first window cannot decide is converted whole instead.
+    if (error == unknown_endianess) {
+        pipeline_free_windows(&p);
+        close(p.input_fd);
+        return 0;
+    }
+
+    if (!read) {
+        fprintf(stderr, "Unable to read input file: %s\n", input);
+    } else if (error != no_error) {
+        fprintf(stderr, "Input file does not appear to be a brain: %s\n", input);
+    }
+
+    if (error == no_error) {
+        p.output_fd = open(output, O_WRONLY | O_CREAT, 0666);
+
+        if (p.output_fd < 0) {
+            fprintf(stderr, "Unable to open output file: %s\n", output);
+            error = invalid_file;
+        }
+    }
+
+    // Truncating the input to write over it would lose the brain.
+    if (error == no_error &&
+        (fstat(p.output_fd, &output_stat) != 0 ||
+         (input_stat.st_dev == output_stat.st_dev &&
+          input_stat.st_ino == output_stat.st_ino) ||
+         (S_ISREG(output_stat.st_mode) && ftruncate(p.output_fd, 0) != 0))) {
+        fprintf(stderr, "Unable to write output file: %s\n", output);
+        close(p.output_fd);
+        error = invalid_file;
+    }
+
+    if (error != no_error) {
+        pipeline_free_windows(&p);
+        close(p.input_fd);
+        *out_result = 1;
+        return 1;
+    }
+
+    p.seekable = S_ISREG(output_stat.st_mode);
+
+    brnflip_stream stream;
+
+    megahal_filetype target = options->target;
+
+    if (options->force == 1) {
+        target = source == big_endian ? little_endian : big_endian;
+    }
+
+    brnflip_stream_init(&stream, source, target);
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.changed, NULL);
+
+    first->state = window_read;
+
+    pthread_t reader;
+    pthread_t writer;
+
+    int reader_started = pthread_create(&reader, NULL, pipeline_reader, &p) == 0;
+    int writer_started = pthread_create(&writer, NULL, pipeline_writer, &p) == 0;
+
+    if (reader_started && writer_started) {
+        pipeline_convert(&p, &stream);
+    } else {
+        pipeline_fail(&p, pipeline_write_failed);
+    }
+
+    if (reader_started) {
+        pthread_join(reader, NULL);
+    }
+
+    if (writer_started) {
+        pthread_join(writer, NULL);
+    }
+
+    pthread_cond_destroy(&p.changed);
+    pthread_mutex_destroy(&p.lock);
+
+    if (close(p.output_fd) != 0 && p.status == pipeline_ok) {
+        p.status = pipeline_write_failed;
+    }
+
+    if (p.status == pipeline_read_failed) {
+        fprintf(stderr, "Unable to read input file: %s\n", input);
+    } else if (p.status == pipeline_convert_failed) {
+        fprintf(stderr, "Input file does not appear to be a brain: %s\n", input);
+    } else if (p.status == pipeline_write_failed) {
+        fprintf(stderr, "Unable to write output file: %s\n", output);
+    }
+
+    // Part of a brain is no use to anyone.
+    if (p.status != pipeline_ok && p.seekable) {
+        unlink(output);
+    }
+
+    pipeline_free_windows(&p);
+    close(p.input_fd);
+
+    if (p.status == pipeline_ok) {
+        fputs("Conversion completed successfully.\n", stderr);
+    }
+
+    *out_result = p.status != pipeline_ok;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// copy_file_range is a GNU extension in glibc.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "brnflip.h"
+#include "cli.h"
+
+#if !defined(_WIN32) && !defined(DOS)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+/* Writing by Region
+ *
+ * Flipping a brain changes nothing but its nodes and the dictionary length,
+ * and the dictionary of a well-trained brain can be a large part of it. So a
+ * converted brain is written as the changed range from memory, with the rest
+ * left to the kernel. On a filesystem that shares blocks between files, such
+ * as Btrfs or XFS, the whole input is first cloned with FICLONE, so the header
+ * and dictionary are never copied at all, and only the blocks the changed
+ * range lands in are written. Elsewhere, the header and dictionary are copied
+ * within the kernel by copy_file_range, which may itself share or offload
+ * them. Where neither is available, they are written from memory as before.
+ */
+
+/* Writes all of data at offset, or at the current position if offset is
+ * negative, returning 0 on failure.
+ */
+static int write_all(int fd, const char* data, size_t length, off_t offset)
+{
+    while (length > 0) {
+        ssize_t written = offset < 0 ?
+            write(fd, data, length) :
+            pwrite(fd, data, length, offset);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            return 0;
+        }
+
+        data   += written;
+        length -= (size_t) written;
+
+        if (offset >= 0) {
+            offset += written;
+        }
+    }
+
+    return 1;
+}
+
+/* Copies length bytes at offset from the input to the same offset in the
+ * output, or to its current position if it is not seekable. *kernel_copy is
+ * cleared once copy_file_range is found not to work between the two files,
+ * and the bytes are then written from brain instead. Returns 0 on failure.
+ */
+static int copy_unchanged(
+    int         input_fd,
+    int         output_fd,
+    int         seekable,
+    const char* brain,
+    off_t       offset,
+    size_t      length,
+    int*        kernel_copy
+)
+{
+    #ifdef __linux__
+    while (*kernel_copy && length > 0) {
+        loff_t  in_offset  = offset;
+        loff_t  out_offset = offset;
+        ssize_t copied     = copy_file_range(
+            input_fd,
+            &in_offset,
+            output_fd,
+            &out_offset,
+            length,
+            0
+        );
+
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // Unsupported between these files, or the input has shrunk.
+        if (copied <= 0) {
+            *kernel_copy = 0;
+            break;
+        }
+
+        offset += copied;
+        length -= (size_t) copied;
+    }
+    #else
+    (void) input_fd;
+    *kernel_copy = 0;
+    #endif
+
+    return write_all(
+        output_fd,
+        brain + offset,
+        length,
+        seekable ? offset : -1
+    );
+}
+
+int write_regions(
+    int                  input_fd,
+    const char*          output,
+    const char*          brain,
+    size_t               brain_length,
+    const brnflip_range* changed,
+    const char*          changed_bytes
+)
+{
+    struct stat input_stat;
+    struct stat output_stat;
+
+    int fd = open(output, O_WRONLY | O_CREAT, 0666);
+
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open output file: %s\n", output);
+        return 0;
+    }
+
+    // Truncating the input to clone it into itself would lose the brain.
+    if (fstat(input_fd, &input_stat) != 0 ||
+        fstat(fd, &output_stat) != 0 ||
+        (input_stat.st_dev == output_stat.st_dev &&
+         input_stat.st_ino == output_stat.st_ino) ||
+        (S_ISREG(output_stat.st_mode) && ftruncate(fd, 0) != 0)) {
+        fprintf(stderr, "Unable to write output file: %s\n", output);
+        close(fd);
+        return 0;
+    }
+
+    // Devices and pipes are written from memory, front to back.
+    int    seekable    = S_ISREG(output_stat.st_mode);
+    int    kernel_copy = seekable;
+    int    cloned      = 0;
+    size_t end         = (size_t) changed->offset + changed->length;
+    int    written;
+
+    #ifdef FICLONE
+    cloned = seekable &&
+        (size_t) input_stat.st_size == brain_length &&
+        ioctl(fd, FICLONE, input_fd) == 0;
+    #endif
+
+    if (cloned) {
+        written = write_all(fd, changed_bytes, changed->length, changed->offset);
+    } else {
+        written =
+            copy_unchanged(
+                input_fd,
+                fd,
+                seekable,
+                brain,
+                0,
+                (size_t) changed->offset,
+                &kernel_copy
+            ) &&
+            write_all(
+                fd,
+                changed_bytes,
+                changed->length,
+                seekable ? changed->offset : -1
+            ) &&
+            copy_unchanged(
+                input_fd,
+                fd,
+                seekable,
+                brain,
+                (off_t) end,
+                brain_length - end,
+                &kernel_copy
+            );
+    }
+
+    if (close(fd) != 0 || !written) {
+        fprintf(stderr, "Unable to write output file: %s\n", output);
+        return 0;
+    }
+
+    return 1;
+}
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "brnflip.h"
+#include "brnflip_internal.h"
+
+/* Skip Indexes
+ *
+ * A skip index is built in one pre-order walk of the trees, which keeps the
+ * same explicit stack as brnflip_traverse_tree, along with the number of
+ * each node on the stack. When a node's last child's subtree ends, the
+ * number of nodes walked since the node is its skip. The walk is kept apart
+ * from brnflip_traverse_tree, rather than being an option of it, so that
+ * ordinary conversions do not pay for the extra stack.
+ */
+
+static const char     skip_magic[8]   = { 'M', 'H', 'A', 'L', 'S', 'K', 'P', '1' };
+static const uint32_t skip_version    = 1;
+static const uint32_t skip_byte_order = 0x01020304;
+
+typedef struct
+{
+    uint64_t node;
+    uint16_t pending;
+} brnflip_skip_frame;
+
+static uint16_t brnflip_skip_read_16(const char* data, int flipped)
+{
+    uint16_t value;
+
+    memcpy(&value, data, sizeof(uint16_t));
+
+    if (flipped) {
+        brnflip_flip_16_in_place((char*) &value);
+    }
+
+    return value;
+}
+
+/* Returns the number of nodes in the node region that ends at
+ * dictionary_offset.
+ */
+static uint64_t brnflip_skip_num_nodes(off_t dictionary_offset)
+{
+    return (uint64_t) (dictionary_offset - brnflip_header_length) /
+        brnflip_tree_node_length;
+}
+
+/* Walks the trees, filling in skips and the roots and depth in header.
+ * Returns invalid_file if the trees do not end exactly at the dictionary, or
+ * if a subtree is too large for its skip.
+ */
+static brnflip_error brnflip_skip_walk(
+    const char*          brain,
+    int                  flipped,
+    uint64_t             num_nodes,
+    uint32_t*            skips,
+    brnflip_skip_header* header
+)
+{
+    brnflip_skip_frame  initial_stack[64];
+    brnflip_skip_frame* stack    = initial_stack;
+    size_t              capacity = sizeof(initial_stack) / sizeof(initial_stack[0]);
+    uint64_t            node     = 0;
+
+    brnflip_error return_code = no_error;
+
+    uint32_t tree;
+    for (tree = 0;
+         tree < brnflip_num_trees && return_code == no_error;
+         ++tree) {
+        size_t depth = 0;
+
+        header->root_offsets[tree] = brnflip_skip_node_offset(node);
+
+        do {
+            if (node >= num_nodes) {
+                return_code = invalid_file;
+                break;
+            }
+
+            uint16_t num_branches = brnflip_skip_read_16(
+                brain + brnflip_skip_node_offset(node) +
+                    brnflip_tree_node_length - sizeof(uint16_t),
+                flipped
+            );
+
+            if (depth > header->max_depth) {
+                header->max_depth = depth > UINT32_MAX ?
+                    UINT32_MAX :
+                    (uint32_t) depth;
+            }
+
+            if (num_branches > 0) {
+                if (depth == capacity) {
+                    brnflip_skip_frame* grown = stack == initial_stack ?
+                        malloc(capacity * 2 * sizeof(brnflip_skip_frame)) :
+                        realloc(stack, capacity * 2 * sizeof(brnflip_skip_frame));
+
+                    if (grown == NULL) {
+                        return_code = invalid_file;
+                        break;
+                    }
+
+                    if (stack == initial_stack) {
+                        memcpy(grown, initial_stack, sizeof(initial_stack));
+                    }
+
+                    stack     = grown;
+                    capacity *= 2;
+                }
+
+                stack[depth].node    = node;
+                stack[depth].pending = num_branches;
+                ++depth;
+            } else {
+                skips[node] = 0;
+
+                // A leaf ends the subtree of every ancestor it is the last of.
+                while (depth > 0 && --stack[depth - 1].pending == 0) {
+                    uint64_t skip = node - stack[depth - 1].node;
+
+                    if (skip > UINT32_MAX) {
+                        return_code = invalid_file;
+                        break;
+                    }
+
+                    skips[stack[depth - 1].node] = (uint32_t) skip;
+                    --depth;
+                }
+            }
+
+            ++node;
+        } while (depth > 0 && return_code == no_error);
+    }
+
+    if (stack != initial_stack) {
+        free(stack);
+    }
+
+    if (return_code == no_error && node != num_nodes) {
+        return_code = invalid_file;
+    }
+
+    return return_code;
+}
+
+size_t brnflip_skip_index_length(const brnflip_brain_info* info)
+{
+    return sizeof(brnflip_skip_header) +
+        brnflip_skip_num_nodes(info->dictionary_offset) * sizeof(uint32_t);
+}
+
+brnflip_error brnflip_build_skip_index(
+    const char*               brain,
+    size_t                    brain_length,
+    const brnflip_brain_info* info,
+    char*                     sidecar
+)
+{
+    brnflip_skip_header* header = (brnflip_skip_header*) sidecar;
+
+    if (info->dictionary_offset < brnflip_header_length ||
+        (size_t) info->dictionary_offset + brnflip_min_dict_length >
+            brain_length ||
+        (info->dictionary_offset - brnflip_header_length) %
+            brnflip_tree_node_length != 0 ||
+        (info->file_type != big_endian && info->file_type != little_endian)) {
+        return invalid_file;
+    }
+
+    memset(header, 0, sizeof(brnflip_skip_header));
+    memcpy(header->magic, skip_magic, sizeof(skip_magic));
+
+    header->byte_order        = skip_byte_order;
+    header->version           = skip_version;
+    header->file_type         = (uint32_t) info->file_type;
+    header->num_words         = info->num_words;
+    header->brain_length      = brain_length;
+    header->num_nodes         = brnflip_skip_num_nodes(info->dictionary_offset);
+    header->dictionary_offset = (uint64_t) info->dictionary_offset;
+    header->skips_offset      = sizeof(brnflip_skip_header);
+
+    brnflip_error return_code = brnflip_skip_walk(
+        brain,
+        info->file_type != megahal_native_endianess,
+        header->num_nodes,
+        (uint32_t*) (sidecar + header->skips_offset),
+        header
+    );
+
+    if (return_code != no_error) {
+        return invalid_file;
+    }
+
+    header->checksum = brnflip_crc32c(0, brain, brain_length);
+
+    return no_error;
+}
+
+brnflip_error brnflip_open_skip_index(
+    const char*         sidecar,
+    size_t              sidecar_length,
+    brnflip_skip_index* out_index
+)
+{
+    const brnflip_skip_header* header = (const brnflip_skip_header*) sidecar;
+
+    memset(out_index, 0, sizeof(brnflip_skip_index));
+
+    if (sidecar_length < sizeof(brnflip_skip_header) ||
+        memcmp(header->magic, skip_magic, sizeof(skip_magic)) != 0 ||
+        header->byte_order != skip_byte_order ||
+        header->version != skip_version ||
+        (header->file_type != big_endian && header->file_type != little_endian) ||
+        header->skips_offset != sizeof(brnflip_skip_header) ||
+        header->num_nodes < brnflip_num_trees ||
+        header->num_nodes > (sidecar_length - header->skips_offset) /
+            sizeof(uint32_t)) {
+        return invalid_file;
+    }
+
+    const uint32_t* skips = (const uint32_t*) (sidecar + header->skips_offset);
+
+    // The second tree starts right after the subtree of the first root.
+    if (header->dictionary_offset !=
+            (uint64_t) brnflip_skip_node_offset(header->num_nodes) ||
+        header->dictionary_offset + brnflip_min_dict_length >
+            header->brain_length ||
+        header->root_offsets[0] != (uint64_t) brnflip_header_length ||
+        skips[0] + (uint64_t) 1 >= header->num_nodes ||
+        header->root_offsets[1] !=
+            (uint64_t) brnflip_skip_node_offset(skips[0] + (uint64_t) 1)) {
+        return invalid_file;
+    }
+
+    out_index->header = header;
+    out_index->skips  = skips;
+
+    return no_error;
+}
+
+brnflip_error brnflip_match_skip_index(
+    const brnflip_skip_index* index,
+    const char*               brain,
+    size_t                    brain_length,
+    brnflip_brain_info*       out_info
+)
+{
+    const brnflip_skip_header* header = index->header;
+
+    memset(out_info, 0, sizeof(brnflip_brain_info));
+
+    if (header->brain_length != brain_length ||
+        header->checksum != brnflip_crc32c(0, brain, brain_length)) {
+        return invalid_file;
+    }
+
+    out_info->detected_file_type = (megahal_filetype) header->file_type;
+    out_info->file_type          = out_info->detected_file_type;
+    out_info->dictionary_offset  = (off_t) header->dictionary_offset;
+    out_info->num_nodes          = header->num_nodes;
+    out_info->num_words          = header->num_words;
+    out_info->max_depth          = header->max_depth;
+
+    return no_error;
+}
+
+off_t brnflip_skip_node_offset(uint64_t node)
+{
+    return brnflip_header_length + (off_t) node * brnflip_tree_node_length;
+}
+
+int brnflip_skip_find_child(
+    const brnflip_skip_index* index,
+    const char*               brain,
+    uint64_t                  node,
+    uint16_t                  symbol,
+    uint64_t*                 out_child
+)
+{
+    uint64_t num_nodes = index->header->num_nodes;
+    int      flipped   = index->header->file_type != megahal_native_endianess;
+
+    if (node >= num_nodes) {
+        return 0;
+    }
+
+    uint16_t num_branches = brnflip_skip_read_16(
+        brain + brnflip_skip_node_offset(node) +
+            brnflip_tree_node_length - sizeof(uint16_t),
+        flipped
+    );
+
+    uint64_t child = node + 1;
+
+    // The skips are not checked when the index is opened, so bound every hop.
+    uint16_t i;
+    for (i = 0; i < num_branches && child < num_nodes; ++i) {
+        uint16_t child_symbol = brnflip_skip_read_16(
+            brain + brnflip_skip_node_offset(child),
+            flipped
+        );
+
+        if (child_symbol == symbol) {
+            *out_child = child;
+            return 1;
+        }
+
+        child += (uint64_t) index->skips[child] + 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include <stdint.h>
+
+#include "brnflip.h"
+#include "brnflip_internal.h"
+
+/* Statistics
+ *
+ * Each thread has its own collector, so that workers converting different
+ * brains at once do not mix up their numbers, and so that recording a phase
+ * takes no lock. When no collector is set, which is the default, a phase
+ * costs one thread-local load at its start and one at its end, and the clock
+ * is never read. Phases are recorded once per call, never per node.
+ */
+
+static _Thread_local brnflip_stats* current_stats = NULL;
+
+static const char* phase_names[num_brnflip_phases] = {
+    "dictionary",
+    "walk",
+    "flip"
+};
+
+void brnflip_collect_stats(brnflip_stats* stats)
+{
+    current_stats = stats;
+}
+
+const char* brnflip_phase_name(brnflip_phase phase)
+{
+    return phase < num_brnflip_phases ? phase_names[phase] : "unknown";
+}
+
+uint64_t brnflip_stats_start(void)
+{
+    if (current_stats == NULL) {
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void brnflip_stats_stop(
+    brnflip_phase phase,
+    uint64_t      start,
+    uint64_t      bytes,
+    uint64_t      nodes
+)
+{
+    brnflip_stats* stats = current_stats;
+
+    if (stats == NULL || start == 0) {
+        return;
+    }
+
+    brnflip_phase_stats* phase_stats = &stats->phases[phase];
+
+    phase_stats->calls       += 1;
+    phase_stats->nanoseconds += brnflip_stats_start() - start;
+    phase_stats->bytes       += bytes;
+    phase_stats->nodes       += nodes;
+}
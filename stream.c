@@ -0,0 +1,384 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "brnflip.h"
+#include "brnflip_internal.h"
+
+/* Streaming Conversion
+ *
+ * A brain can be parsed front to back without ever seeing the rest of it: each
+ * node's branch count says how many more nodes belong to the current tree, so
+ * the end of the second tree, and therefore the start of the dictionary, is
+ * known as soon as it is reached. The stream keeps a running count of the
+ * nodes the current tree still owes, flips each run of nodes with the node
+ * kernels, flips the dictionary length, and passes the dictionary through
+ * while counting its words so that brnflip_stream_finish can check them
+ * against the dictionary length.
+ */
+
+enum
+{
+    stream_header = 0,
+    stream_nodes,
+    stream_dictionary_length,
+    stream_dictionary
+};
+
+static const char* first_dict_word = "<ERROR>";
+
+static uint16_t brnflip_stream_read_16(
+    const brnflip_stream* stream,
+    const char*           data
+)
+{
+    uint16_t value;
+
+    memcpy(&value, data, sizeof(uint16_t));
+
+    if (stream->source_flipped) {
+        brnflip_flip_16_in_place((char*) &value);
+    }
+
+    return value;
+}
+
+static uint32_t brnflip_stream_read_32(
+    const brnflip_stream* stream,
+    const char*           data
+)
+{
+    uint32_t value;
+
+    memcpy(&value, data, sizeof(uint32_t));
+
+    if (stream->source_flipped) {
+        brnflip_flip_32_in_place((char*) &value);
+    }
+
+    return value;
+}
+
+/* Records a node with the given number of branches in the stream's depth
+ * stack. Depth is only tracked up to BRNFLIP_STREAM_MAX_DEPTH; a deeper tree
+ * saturates max_depth, but its structure is still checked through
+ * pending_nodes.
+ */
+static void brnflip_stream_track_depth(brnflip_stream* stream, uint16_t branch)
+{
+    if (stream->max_depth > BRNFLIP_STREAM_MAX_DEPTH) {
+        return;
+    }
+
+    if (stream->depth > stream->max_depth) {
+        stream->max_depth = stream->depth;
+    }
+
+    if (stream->depth > 0) {
+        --stream->depth_pending[stream->depth - 1];
+    }
+
+    if (branch > 0) {
+        if (stream->depth == BRNFLIP_STREAM_MAX_DEPTH) {
+            stream->max_depth = BRNFLIP_STREAM_MAX_DEPTH + 1;
+            return;
+        }
+
+        stream->depth_pending[stream->depth] = branch;
+        ++stream->depth;
+    }
+
+    while (stream->depth > 0 && stream->depth_pending[stream->depth - 1] == 0) {
+        --stream->depth;
+    }
+}
+
+/* Advances the stream over data. If out is not NULL, the converted bytes are
+ * written to it, which may be data itself. Otherwise, the data is only parsed.
+ */
+static brnflip_error brnflip_stream_advance(
+    brnflip_stream* stream,
+    const char*     data,
+    char*           out,
+    size_t          length,
+    size_t*         out_converted
+)
+{
+    size_t position = 0;
+
+    brnflip_error return_code = no_error;
+
+    while (return_code == no_error && position < length) {
+        size_t remaining = length - position;
+
+        if (stream->state == stream_header) {
+            if (remaining < (size_t) brnflip_header_length) {
+                break;
+            }
+
+            if (memcmp(
+                    data + position,
+                    brnflip_cookie,
+                    brnflip_cookie_length
+                ) != 0 ||
+                data[position + brnflip_cookie_length] !=
+                    brnflip_model_order) {
+                return_code = invalid_file;
+                break;
+            }
+
+            if (out != NULL && out != data) {
+                memcpy(out + position, data + position, brnflip_header_length);
+            }
+
+            position += brnflip_header_length;
+            stream->state = stream_nodes;
+        } else if (stream->state == stream_nodes) {
+            size_t run_start = position;
+
+            while (remaining >= (size_t) brnflip_tree_node_length) {
+                uint16_t branch = brnflip_stream_read_16(
+                    stream,
+                    data + position +
+                        brnflip_tree_node_length - sizeof(uint16_t)
+                );
+
+                brnflip_stream_track_depth(stream, branch);
+
+                stream->pending_nodes += branch;
+                --stream->pending_nodes;
+
+                position  += brnflip_tree_node_length;
+                remaining -= brnflip_tree_node_length;
+
+                if (stream->pending_nodes == 0) {
+                    --stream->trees_remaining;
+
+                    if (stream->trees_remaining == 0) {
+                        stream->state = stream_dictionary_length;
+                        break;
+                    }
+
+                    stream->pending_nodes = 1;
+                }
+            }
+
+            if (out != NULL) {
+                if (stream->flip) {
+                    brnflip_flip_nodes(
+                        data + run_start,
+                        out + run_start,
+                        (position - run_start) / brnflip_tree_node_length
+                    );
+                } else if (out != data) {
+                    memcpy(
+                        out + run_start,
+                        data + run_start,
+                        position - run_start
+                    );
+                }
+            }
+
+            if (stream->state == stream_nodes) {
+                break;
+            }
+        } else if (stream->state == stream_dictionary_length) {
+            if (remaining < sizeof(uint32_t)) {
+                break;
+            }
+
+            stream->dictionary_length = brnflip_stream_read_32(
+                stream,
+                data + position
+            );
+
+            if (out != NULL) {
+                if (out != data) {
+                    memcpy(out + position, data + position, sizeof(uint32_t));
+                }
+
+                if (stream->flip) {
+                    brnflip_flip_32_in_place(out + position);
+                }
+            }
+
+            position += sizeof(uint32_t);
+            stream->state = stream_dictionary;
+        } else {
+            size_t dictionary_start = position;
+
+            while (position < length) {
+                if (stream->word_remaining == 0) {
+                    unsigned char word_length = data[position];
+
+                    if (stream->words_seen == 0 &&
+                        word_length != brnflip_first_dict_word_length) {
+                        return_code = invalid_file;
+                        break;
+                    }
+
+                    ++stream->words_seen;
+                    stream->word_remaining = word_length;
+                    ++position;
+                } else {
+                    size_t span = stream->word_remaining;
+
+                    if (span > length - position) {
+                        span = length - position;
+                    }
+
+                    if (stream->words_seen == 1) {
+                        size_t offset = brnflip_first_dict_word_length -
+                            stream->word_remaining;
+
+                        if (memcmp(
+                            data + position,
+                            first_dict_word + offset,
+                            span
+                        ) != 0) {
+                            return_code = invalid_file;
+                            break;
+                        }
+                    }
+
+                    stream->word_remaining -= span;
+                    position += span;
+                }
+            }
+
+            if (out != NULL && out != data) {
+                memcpy(
+                    out + dictionary_start,
+                    data + dictionary_start,
+                    position - dictionary_start
+                );
+            }
+        }
+    }
+
+    stream->position += position;
+    *out_converted = position;
+
+    return return_code;
+}
+
+brnflip_error brnflip_stream_detect(
+    const char*       data,
+    size_t            length,
+    int               complete,
+    megahal_filetype* out_file_type
+)
+{
+    brnflip_stream streams[2];
+    brnflip_error  errors[2];
+    int            reached_dictionary[2];
+
+    *out_file_type = unknown_filetype;
+
+    if (complete) {
+        return brnflip_detect_endianess(data, length, out_file_type);
+    }
+
+    megahal_filetype orders[2] = {
+        megahal_native_endianess,
+        megahal_native_endianess == big_endian ? little_endian : big_endian
+    };
+
+    int i;
+    for (i = 0; i < 2; ++i) {
+        size_t parsed;
+
+        brnflip_stream_init(&streams[i], orders[i], orders[i]);
+
+        errors[i] = brnflip_stream_advance(
+            &streams[i],
+            data,
+            NULL,
+            length,
+            &parsed
+        );
+
+        reached_dictionary[i] = errors[i] == no_error &&
+            streams[i].state == stream_dictionary &&
+            streams[i].words_seen > 0 &&
+            (streams[i].words_seen > 1 || streams[i].word_remaining == 0);
+    }
+
+    int chosen = -1;
+
+    if (errors[0] != no_error && errors[1] != no_error) {
+        return invalid_file;
+    } else if (errors[0] != no_error) {
+        chosen = 1;
+    } else if (errors[1] != no_error) {
+        chosen = 0;
+    } else if (reached_dictionary[0] != reached_dictionary[1]) {
+        chosen = reached_dictionary[0] ? 0 : 1;
+    } else if (streams[0].max_depth != streams[1].max_depth) {
+        /* Reading a branch count in the wrong byte order multiplies small
+         * counts by 256, so the misread trees keep nesting deeper instead of
+         * closing.
+         */
+        chosen = streams[0].max_depth < streams[1].max_depth ? 0 : 1;
+    }
+
+    if (chosen < 0 || megahal_native_endianess == unknown_filetype) {
+        return unknown_endianess;
+    }
+
+    *out_file_type = orders[chosen];
+    return no_error;
+}
+
+void brnflip_stream_init(
+    brnflip_stream*  stream,
+    megahal_filetype source,
+    megahal_filetype target
+)
+{
+    memset(stream, 0, sizeof(brnflip_stream));
+
+    stream->state           = stream_header;
+    stream->source_flipped  = source != megahal_native_endianess;
+    stream->flip            = source != target;
+    stream->trees_remaining = brnflip_num_trees;
+    stream->pending_nodes   = 1;
+}
+
+brnflip_error brnflip_stream_convert(
+    brnflip_stream* stream,
+    char*           data,
+    size_t          length,
+    size_t*         out_converted
+)
+{
+    return brnflip_stream_advance(stream, data, data, length, out_converted);
+}
+
+brnflip_error brnflip_stream_finish(brnflip_stream* stream)
+{
+    if (stream->state != stream_dictionary ||
+        stream->word_remaining != 0 ||
+        stream->words_seen != stream->dictionary_length) {
+        return invalid_file;
+    }
+
+    return no_error;
+}
@@ -0,0 +1,1102 @@
+/*
+ *  Copyright 2007-2017 Michael Buckley
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the license or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE.  See the Gnu Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "brnflip.h"
+#include "cli.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* Watching
+ *
+ * A synced brain would otherwise cost a process start, a full read and a full
+ * detection every time it arrives. Instead, one process stays up, watching
+ * directories with inotify. A brain is converted once it has been closed
+ * after writing, or renamed into place, and then left alone for the debounce
+ * interval, so that a burst of writes is converted once. The conversions run
+ * on a resident pool of workers, each of which keeps its buffer from one
+ * brain to the next, as in batch.c. A brain that needs flipping is written to
+ * a temporary file beside it and renamed over it, so readers only ever see
+ * the whole old brain or the whole new one. The rename is itself an event,
+ * so the file it produced is remembered and its event is skipped.
+ *
+ * Conversions can also be requested over a command channel, which is stdin,
+ * or a Unix socket given by --socket. Each line is either "convert PATH",
+ * which is answered with the same line the watcher logs once the brain has
+ * been converted, or "quit".
+ */
+
+// The most self-written files remembered while waiting for their events.
+#define WATCH_MAX_WRITTEN 1024
+
+// The longest command line accepted.
+#define WATCH_MAX_COMMAND 4096
+
+typedef enum
+{
+    watch_converted = 0,
+    watch_unchanged,
+    watch_failed
+} watch_status;
+
+// A source of commands, and where their answers go.
+typedef struct watch_client
+{
+    int                  in_fd;
+    int                  out_fd;
+    char                 line[WATCH_MAX_COMMAND];
+    size_t               line_length;
+    int                  discarding;
+    int                  closed;
+    unsigned int         pending;
+    struct watch_client* next;
+} watch_client;
+
+// A brain waiting for a worker. client is NULL for watched brains.
+typedef struct watch_job
+{
+    char*             path;
+    watch_client*     client;
+    struct watch_job* next;
+} watch_job;
+
+// A brain waiting out the debounce interval.
+typedef struct
+{
+    char*    path;
+    uint64_t deadline;
+} watch_pending;
+
+typedef struct
+{
+    int   wd;
+    char* path;
+} watch_directory;
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+} watch_written;
+
+typedef struct
+{
+    int                inotify_fd;
+    int                listen_fd;
+    int                recursive;
+    uint64_t           debounce;
+    const cli_options* options;
+
+    watch_directory*   directories;
+    size_t             num_directories;
+    size_t             directories_capacity;
+
+    watch_pending*     pending;
+    size_t             num_pending;
+    size_t             pending_capacity;
+
+    // Everything below is shared with the workers, under lock.
+    pthread_mutex_t    lock;
+    pthread_cond_t     ready;
+    watch_job*         head;
+    watch_job*         tail;
+    int                stopping;
+    watch_client*      clients;
+    watch_written      written[WATCH_MAX_WRITTEN];
+    size_t             num_written;
+} watcher;
+
+static volatile sig_atomic_t watch_stop_requested = 0;
+
+static void watch_handle_signal(int signal_number)
+{
+    (void) signal_number;
+    watch_stop_requested = 1;
+}
+
+static uint64_t watch_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static char* watch_join_path(const char* directory, const char* name)
+{
+    size_t length = strlen(directory) + strlen(name) + 2;
+    char*  path   = (char*) malloc(length);
+
+    if (path != NULL) {
+        snprintf(path, length, "%s/%s", directory, name);
+    }
+
+    return path;
+}
+
+/* Adds a watch on a directory, and on those below it if the watcher is
+ * recursive. Returns 0 if the directory itself could not be watched.
+ */
+static int watch_add_directory(watcher* w, const char* path)
+{
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR;
+
+    if (w->recursive) {
+        mask |= IN_CREATE;
+    }
+
+    int wd = inotify_add_watch(w->inotify_fd, path, mask);
+
+    if (wd < 0) {
+        fprintf(stderr, "Unable to watch directory: %s\n", path);
+        return 0;
+    }
+
+    size_t i;
+    for (i = 0; i < w->num_directories; ++i) {
+        if (w->directories[i].wd == wd) {
+            return 1;
+        }
+    }
+
+    if (w->num_directories == w->directories_capacity) {
+        size_t capacity = w->directories_capacity > 0 ?
+            w->directories_capacity * 2 :
+            16;
+
+        watch_directory* directories = (watch_directory*) realloc(
+            w->directories,
+            capacity * sizeof(watch_directory)
+        );
+
+        if (directories == NULL) {
+            inotify_rm_watch(w->inotify_fd, wd);
+            return 0;
+        }
+
+        w->directories          = directories;
+        w->directories_capacity = capacity;
+    }
+
+    char* copy = strdup(path);
+
+    if (copy == NULL) {
+        inotify_rm_watch(w->inotify_fd, wd);
+        return 0;
+    }
+
+    w->directories[w->num_directories].wd   = wd;
+    w->directories[w->num_directories].path = copy;
+    ++w->num_directories;
+
+    if (!w->recursive) {
+        return 1;
+    }
+
+    DIR* directory = opendir(path);
+
+    if (directory == NULL) {
+        return 1;
+    }
+
+    struct dirent* entry;
+
+    while ((entry = readdir(directory)) != NULL) {
+        struct stat child_stat;
+
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char* child = watch_join_path(path, entry->d_name);
+
+        if (child != NULL &&
+            lstat(child, &child_stat) == 0 &&
+            S_ISDIR(child_stat.st_mode)) {
+            watch_add_directory(w, child);
+        }
+
+        free(child);
+    }
+
+    closedir(directory);
+    return 1;
+}
+
+static void watch_remove_directory(watcher* w, int wd)
+{
+    size_t i;
+    for (i = 0; i < w->num_directories; ++i) {
+        if (w->directories[i].wd == wd) {
+            free(w->directories[i].path);
+            w->directories[i] = w->directories[--w->num_directories];
+            return;
+        }
+    }
+}
+
+static const char* watch_directory_path(const watcher* w, int wd)
+{
+    size_t i;
+    for (i = 0; i < w->num_directories; ++i) {
+        if (w->directories[i].wd == wd) {
+            return w->directories[i].path;
+        }
+    }
+
+    return NULL;
+}
+
+/* Starts or restarts the debounce interval of a brain. Takes ownership of
+ * path.
+ */
+static void watch_schedule(watcher* w, char* path)
+{
+    uint64_t deadline = watch_now_ms() + w->debounce;
+
+    size_t i;
+    for (i = 0; i < w->num_pending; ++i) {
+        if (strcmp(w->pending[i].path, path) == 0) {
+            w->pending[i].deadline = deadline;
+            free(path);
+            return;
+        }
+    }
+
+    if (w->num_pending == w->pending_capacity) {
+        size_t capacity = w->pending_capacity > 0 ?
+            w->pending_capacity * 2 :
+            16;
+
+        watch_pending* pending = (watch_pending*) realloc(
+            w->pending,
+            capacity * sizeof(watch_pending)
+        );
+
+        if (pending == NULL) {
+            fprintf(stderr, "Out of memory queueing: %s\n", path);
+            free(path);
+            return;
+        }
+
+        w->pending          = pending;
+        w->pending_capacity = capacity;
+    }
+
+    w->pending[w->num_pending].path     = path;
+    w->pending[w->num_pending].deadline = deadline;
+    ++w->num_pending;
+}
+
+/* Hands a brain to the workers, taking ownership of path. Must be called with
+ * the lock held.
+ */
+static void watch_enqueue(watcher* w, char* path, watch_client* client)
+{
+    watch_job* job = (watch_job*) malloc(sizeof(watch_job));
+
+    if (job == NULL) {
+        fprintf(stderr, "Out of memory queueing: %s\n", path);
+        free(path);
+        return;
+    }
+
+    job->path   = path;
+    job->client = client;
+    job->next   = NULL;
+
+    if (client != NULL) {
+        ++client->pending;
+    }
+
+    if (w->tail != NULL) {
+        w->tail->next = job;
+    } else {
+        w->head = job;
+    }
+
+    w->tail = job;
+    pthread_cond_signal(&w->ready);
+}
+
+/* Returns 1, forgetting it, if a file is one a worker has just renamed into
+ * place. Must be called with the lock held.
+ */
+static int watch_take_written(watcher* w, const struct stat* file_stat)
+{
+    size_t i;
+    for (i = 0; i < w->num_written; ++i) {
+        if (w->written[i].dev == file_stat->st_dev &&
+            w->written[i].ino == file_stat->st_ino) {
+            w->written[i] = w->written[--w->num_written];
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Queues every brain whose debounce interval has passed, and returns how many
+ * milliseconds until the next one will have, or -1 if none are waiting.
+ */
+static int watch_dispatch(watcher* w)
+{
+    uint64_t now  = watch_now_ms();
+    uint64_t next = UINT64_MAX;
+    size_t   i    = 0;
+
+    while (i < w->num_pending) {
+        watch_pending* pending = &w->pending[i];
+
+        if (pending->deadline > now) {
+            if (pending->deadline < next) {
+                next = pending->deadline;
+            }
+
+            ++i;
+            continue;
+        }
+
+        struct stat file_stat;
+        char*       path = pending->path;
+
+        w->pending[i] = w->pending[--w->num_pending];
+
+        if (stat(path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+            free(path);
+            continue;
+        }
+
+        pthread_mutex_lock(&w->lock);
+
+        if (watch_take_written(w, &file_stat)) {
+            free(path);
+        } else {
+            watch_enqueue(w, path, NULL);
+        }
+
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return next == UINT64_MAX ? -1 : (int) (next - now);
+}
+
+static void watch_read_events(watcher* w)
+{
+    char buffer[16384]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    ssize_t length = read(w->inotify_fd, buffer, sizeof(buffer));
+
+    if (length <= 0) {
+        return;
+    }
+
+    char* position = buffer;
+
+    while (position < buffer + length) {
+        const struct inotify_event* event =
+            (const struct inotify_event*) position;
+
+        position += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            fprintf(stderr, "Too many changes at once; some were missed.\n");
+            continue;
+        }
+
+        if (event->mask & IN_IGNORED) {
+            watch_remove_directory(w, event->wd);
+            continue;
+        }
+
+        const char* directory = watch_directory_path(w, event->wd);
+
+        if (directory == NULL || event->len == 0 ||
+            cache_is_own_file(event->name)) {
+            continue;
+        }
+
+        char* path = watch_join_path(directory, event->name);
+
+        if (path == NULL) {
+            continue;
+        }
+
+        if (event->mask & IN_ISDIR) {
+            if (w->recursive) {
+                watch_add_directory(w, path);
+            }
+
+            free(path);
+        } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            watch_schedule(w, path);
+        } else {
+            free(path);
+        }
+    }
+}
+
+// Frees a client once it has closed and has no conversions left to answer.
+static void watch_release_client(watch_client* client)
+{
+    if (client->closed && client->pending == 0) {
+        if (client->in_fd != STDIN_FILENO) {
+            close(client->in_fd);
+            free(client);
+        }
+    }
+}
+
+/* Answers a conversion, or logs it if nobody asked for it. Must be called
+ * with the lock held.
+ */
+static void watch_report(
+    watch_client* client,
+    const char*   path,
+    watch_status  status,
+    const char*   message
+)
+{
+    char line[WATCH_MAX_COMMAND + 64];
+
+    switch (status) {
+        case watch_converted:
+            snprintf(line, sizeof(line), "converted: %s\n", path);
+            break;
+
+        case watch_unchanged:
+            snprintf(line, sizeof(line), "unchanged: %s\n", path);
+            break;
+
+        case watch_failed:
+            snprintf(line, sizeof(line), "failed:    %s (%s)\n", path, message);
+            break;
+    }
+
+    if (client == NULL) {
+        fputs(line, stdout);
+        fflush(stdout);
+        return;
+    }
+
+    // Answers still go to stdout after stdin ends, but not to a closed socket.
+    if (!client->closed || client->in_fd == STDIN_FILENO) {
+        size_t length = strlen(line);
+        size_t done   = 0;
+
+        while (done < length) {
+            ssize_t count = write(client->out_fd, line + done, length - done);
+
+            if (count < 0 && errno == EINTR) {
+                continue;
+            } else if (count <= 0) {
+                break;
+            }
+
+            done += (size_t) count;
+        }
+    }
+
+    --client->pending;
+    watch_release_client(client);
+}
+
+/* Replaces the brain at path with a converted copy, as replace_file does, and
+ * remembers the copy so that the event for its rename is not mistaken for a
+ * new brain. An event read before the copy is remembered only costs a
+ * conversion that finds the brain already in the target endianess.
+ */
+static const char* watch_replace_file(
+    watcher*           w,
+    const char*        path,
+    const char*        buffer,
+    size_t             length,
+    const struct stat* original
+)
+{
+    struct stat temp_stat;
+    const char* message = replace_file(
+        path,
+        buffer,
+        length,
+        original,
+        &temp_stat
+    );
+
+    if (message != NULL) {
+        return message;
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->num_written == WATCH_MAX_WRITTEN) {
+        memmove(
+            w->written,
+            w->written + 1,
+            (WATCH_MAX_WRITTEN - 1) * sizeof(watch_written)
+        );
+        --w->num_written;
+    }
+
+    w->written[w->num_written].dev = temp_stat.st_dev;
+    w->written[w->num_written].ino = temp_stat.st_ino;
+    ++w->num_written;
+
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static watch_status watch_convert_file(
+    watcher*     w,
+    const char*  path,
+    char**       buffer,
+    size_t*      capacity,
+    const char** message
+)
+{
+    struct stat file_stat;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        *message = "unable to open file";
+        return watch_failed;
+    }
+
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        *message = "not a regular file";
+        close(fd);
+        return watch_failed;
+    }
+
+    if ((uintmax_t) file_stat.st_size > SIZE_MAX) {
+        *message = "file too large";
+        close(fd);
+        return watch_failed;
+    }
+
+    size_t brain_length = (size_t) file_stat.st_size;
+    int    loaded       = read_file(fd, brain_length, buffer, capacity);
+
+    close(fd);
+
+    if (!loaded) {
+        *message = "unable to read file";
+        return watch_failed;
+    }
+
+    int flipped;
+    brnflip_error error = convert_buffer(
+        *buffer,
+        brain_length,
+        w->options,
+        &flipped,
+        NULL,
+        NULL
+    );
+
+    if (error != no_error) {
+        *message = "does not appear to be a brain";
+        return watch_failed;
+    }
+
+    if (!flipped) {
+        return watch_unchanged;
+    }
+
+    *message = watch_replace_file(w, path, *buffer, brain_length, &file_stat);
+
+    return *message == NULL ? watch_converted : watch_failed;
+}
+
+static void* watch_worker(void* argument)
+{
+    watcher* w = (watcher*) argument;
+
+    char*  buffer   = NULL;
+    size_t capacity = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+
+        while (w->head == NULL && !w->stopping) {
+            pthread_cond_wait(&w->ready, &w->lock);
+        }
+
+        watch_job* job = w->head;
+
+        if (job != NULL) {
+            w->head = job->next;
+
+            if (w->head == NULL) {
+                w->tail = NULL;
+            }
+        }
+
+        pthread_mutex_unlock(&w->lock);
+
+        if (job == NULL) {
+            break;
+        }
+
+        const char*  message = NULL;
+        watch_status status  = watch_convert_file(
+            w,
+            job->path,
+            &buffer,
+            &capacity,
+            &message
+        );
+
+        pthread_mutex_lock(&w->lock);
+        watch_report(job->client, job->path, status, message);
+        pthread_mutex_unlock(&w->lock);
+
+        free(job->path);
+        free(job);
+    }
+
+    brnflip_free_buffer(buffer, capacity);
+    return NULL;
+}
+
+// Answers a line that is not a conversion. Must be called with the lock held.
+static void watch_reply(watch_client* client, const char* line)
+{
+    if (write(client->out_fd, line, strlen(line)) < 0) {
+        errno = 0;
+    }
+}
+
+static void watch_handle_command(watcher* w, watch_client* client, char* line)
+{
+    size_t length = strlen(line);
+
+    while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' ')) {
+        line[--length] = '\0';
+    }
+
+    if (length == 0) {
+        return;
+    }
+
+    if (strcmp(line, "quit") == 0) {
+        watch_stop_requested = 1;
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    if (strncmp(line, "convert ", 8) == 0 && line[8] != '\0') {
+        char* path = strdup(line + 8);
+
+        if (path == NULL) {
+            watch_reply(client, "error: out of memory\n");
+        } else {
+            watch_enqueue(w, path, client);
+        }
+    } else {
+        watch_reply(client, "error: unknown command\n");
+    }
+
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Reads whatever a client has sent and runs each whole line. Lines longer than
+ * WATCH_MAX_COMMAND are answered with an error and dropped.
+ */
+static void watch_read_client(watcher* w, watch_client* client)
+{
+    size_t  room  = sizeof(client->line) - client->line_length;
+    ssize_t count = read(client->in_fd, client->line + client->line_length, room);
+
+    if (count < 0 && errno == EINTR) {
+        return;
+    }
+
+    if (count <= 0) {
+        pthread_mutex_lock(&w->lock);
+
+        watch_client** link = &w->clients;
+
+        while (*link != NULL && *link != client) {
+            link = &(*link)->next;
+        }
+
+        if (*link != NULL) {
+            *link = client->next;
+        }
+
+        client->closed = 1;
+        watch_release_client(client);
+
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+
+    client->line_length += (size_t) count;
+
+    char*  start  = client->line;
+    size_t remain = client->line_length;
+    char*  end;
+
+    while ((end = (char*) memchr(start, '\n', remain)) != NULL) {
+        *end = '\0';
+
+        if (!client->discarding) {
+            watch_handle_command(w, client, start);
+        }
+
+        client->discarding = 0;
+        remain -= (size_t) (end + 1 - start);
+        start   = end + 1;
+    }
+
+    if (remain == sizeof(client->line)) {
+        if (!client->discarding) {
+            pthread_mutex_lock(&w->lock);
+            watch_reply(client, "error: command too long\n");
+            pthread_mutex_unlock(&w->lock);
+        }
+
+        client->discarding = 1;
+        remain             = 0;
+    }
+
+    memmove(client->line, start, remain);
+    client->line_length = remain;
+}
+
+static void watch_accept_client(watcher* w)
+{
+    int fd = accept(w->listen_fd, NULL, NULL);
+
+    if (fd < 0) {
+        return;
+    }
+
+    watch_client* client = (watch_client*) calloc(1, sizeof(watch_client));
+
+    if (client == NULL) {
+        close(fd);
+        return;
+    }
+
+    client->in_fd  = fd;
+    client->out_fd = fd;
+
+    pthread_mutex_lock(&w->lock);
+    client->next = w->clients;
+    w->clients   = client;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static int watch_listen(const char* socket_path)
+{
+    struct sockaddr_un address;
+    struct stat        socket_stat;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+        return -1;
+    }
+
+    // A socket left behind by an earlier watcher is replaced.
+    if (lstat(socket_path, &socket_stat) == 0 && S_ISSOCK(socket_stat.st_mode)) {
+        unlink(socket_path);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0 ||
+        bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+        listen(fd, 16) != 0) {
+        fprintf(stderr, "Unable to listen on socket: %s\n", socket_path);
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        return -1;
+    }
+
+    return fd;
+}
+
+int convert_watch(
+    char**             paths,
+    int                num_paths,
+    int                recursive,
+    unsigned int       num_jobs,
+    unsigned int       debounce_ms,
+    const char*        socket_path,
+    const cli_options* options
+)
+{
+    watcher      w;
+    watch_client stdin_client;
+
+    memset(&w, 0, sizeof(watcher));
+    memset(&stdin_client, 0, sizeof(watch_client));
+
+    w.recursive = recursive;
+    w.debounce  = debounce_ms;
+    w.options   = options;
+    w.listen_fd = -1;
+
+    w.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (w.inotify_fd < 0) {
+        fprintf(stderr, "Unable to start watching.\n");
+        return 1;
+    }
+
+    int i;
+    for (i = 0; i < num_paths; ++i) {
+        if (!watch_add_directory(&w, paths[i])) {
+            close(w.inotify_fd);
+            return 1;
+        }
+    }
+
+    if (socket_path != NULL) {
+        w.listen_fd = watch_listen(socket_path);
+
+        if (w.listen_fd < 0) {
+            close(w.inotify_fd);
+            return 1;
+        }
+    } else {
+        stdin_client.in_fd  = STDIN_FILENO;
+        stdin_client.out_fd = STDOUT_FILENO;
+        w.clients           = &stdin_client;
+    }
+
+    if (num_jobs == 0) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_jobs = num_cpus > 0 ? (unsigned int) num_cpus : 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = watch_handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // A client that hangs up early must not take the watcher down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.ready, NULL);
+
+    pthread_t* workers = (pthread_t*) calloc(num_jobs, sizeof(pthread_t));
+    unsigned int num_started = 0;
+
+    while (workers != NULL && num_started < num_jobs &&
+           pthread_create(&workers[num_started], NULL, watch_worker, &w) == 0) {
+        ++num_started;
+    }
+
+    int result = 0;
+
+    if (num_started == 0) {
+        fprintf(stderr, "Unable to start any workers.\n");
+        watch_stop_requested = 1;
+        result = 1;
+    } else {
+        fprintf(
+            stderr,
+            "Watching %zu directories with %u workers.\n",
+            w.num_directories,
+            num_started
+        );
+    }
+
+    struct pollfd* fds      = NULL;
+    size_t         num_fds  = 0;
+    size_t         fds_size = 0;
+
+    while (!watch_stop_requested) {
+        int timeout = watch_dispatch(&w);
+
+        // The clients are only added and removed on this thread.
+        size_t num_clients = 0;
+        watch_client* client;
+
+        for (client = w.clients; client != NULL; client = client->next) {
+            ++num_clients;
+        }
+
+        if (num_clients + 2 > fds_size) {
+            struct pollfd* grown = (struct pollfd*) realloc(
+                fds,
+                (num_clients + 2) * sizeof(struct pollfd)
+            );
+
+            if (grown == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                result = 1;
+                break;
+            }
+
+            fds      = grown;
+            fds_size = num_clients + 2;
+        }
+
+        num_fds = 0;
+        fds[num_fds].fd     = w.inotify_fd;
+        fds[num_fds].events = POLLIN;
+        ++num_fds;
+
+        if (w.listen_fd >= 0) {
+            fds[num_fds].fd     = w.listen_fd;
+            fds[num_fds].events = POLLIN;
+            ++num_fds;
+        }
+
+        size_t first_client = num_fds;
+
+        for (client = w.clients; client != NULL; client = client->next) {
+            fds[num_fds].fd     = client->in_fd;
+            fds[num_fds].events = POLLIN;
+            ++num_fds;
+        }
+
+        if (poll(fds, num_fds, timeout) <= 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            watch_read_events(&w);
+        }
+
+        if (w.listen_fd >= 0 && (fds[1].revents & POLLIN)) {
+            watch_accept_client(&w);
+        }
+
+        // Reading a client may free it, so find each one by its descriptor.
+        size_t j;
+        for (j = first_client; j < num_fds; ++j) {
+            if (!(fds[j].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            for (client = w.clients; client != NULL; client = client->next) {
+                if (client->in_fd == fds[j].fd) {
+                    watch_read_client(&w, client);
+                    break;
+                }
+            }
+        }
+    }
+
+    free(fds);
+
+    // Brains already handed to the workers are finished before exiting.
+    pthread_mutex_lock(&w.lock);
+    w.stopping = 1;
+    pthread_cond_broadcast(&w.ready);
+    pthread_mutex_unlock(&w.lock);
+
+    unsigned int j;
+    for (j = 0; j < num_started; ++j) {
+        pthread_join(workers[j], NULL);
+    }
+
+    free(workers);
+
+    while (w.clients != NULL) {
+        watch_client* client = w.clients;
+
+        w.clients      = client->next;
+        client->closed = 1;
+        watch_release_client(client);
+    }
+
+    if (w.listen_fd >= 0) {
+        close(w.listen_fd);
+        unlink(socket_path);
+    }
+
+    size_t k;
+    for (k = 0; k < w.num_pending; ++k) {
+        free(w.pending[k].path);
+    }
+
+    for (k = 0; k < w.num_directories; ++k) {
+        free(w.directories[k].path);
+    }
+
+    free(w.pending);
+    free(w.directories);
+    close(w.inotify_fd);
+
+    pthread_cond_destroy(&w.ready);
+    pthread_mutex_destroy(&w.lock);
+
+    return result;
+}
+
+#else
+
+int convert_watch(
+    char**             paths,
+    int                num_paths,
+    int                recursive,
+    unsigned int       num_jobs,
+    unsigned int       debounce_ms,
+    const char*        socket_path,
+    const cli_options* options
+)
+{
+    (void) paths;
+    (void) num_paths;
+    (void) recursive;
+    (void) num_jobs;
+    (void) debounce_ms;
+    (void) socket_path;
+    (void) options;
+
+    fprintf(stderr, "Watching is only supported on Linux.\n");
+    return 1;
+}
+
+#endif